@@ -61,7 +61,7 @@ int main(int ac, char **av)
 {
   netbios_ns        *ns;
   struct in_addr      addr;
-  const char          *name;
+  char                *name;
 
   ns = netbios_ns_new();
 
@@ -80,6 +80,7 @@ int main(int ac, char **av)
   }
 
   printf("%s\n", name);
+  free(name);
   netbios_ns_destroy(ns);
   return 0;
 }
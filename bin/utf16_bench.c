@@ -0,0 +1,137 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Measures the cost of converting the names of a 100k entries directory
+// listing from UCS-2LE, the way smb_tr2_find2_parse_entries() does, with
+// smb_from_utf16() and with a fresh iconv descriptor per entry (what it used
+// to do). It uses internal functions, build it with the library sources:
+//   cc -O2 -DHAVE_CONFIG_H -I<builddir> -Iinclude -Isrc -Icompat
+//      bin/utf16_bench.c src/smb_utils.c -lpthread
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <iconv.h>
+#include <locale.h>
+#include <time.h>
+#if defined( __APPLE__ ) || !defined(HAVE_NL_LANGINFO)
+# define CODESET_NAME "UTF-8"
+#else
+# include <langinfo.h>
+# define CODESET_NAME nl_langinfo(CODESET)
+#endif
+
+#include "smb_utils.h"
+
+#define ENTRY_COUNT 100000
+
+static double now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t uncached_from_utf16(const char *src, size_t src_len, char **dst)
+{
+  iconv_t ic = iconv_open(CODESET_NAME, "UCS-2LE");
+  char    *inp = (char *)src, *outp;
+  size_t  inb = src_len, outb = 4 * src_len, ret = 0;
+
+  *dst = NULL;
+  if (ic == (iconv_t)-1)
+    return 0;
+  outp = *dst = malloc(outb);
+  if (*dst && iconv(ic, &inp, &inb, &outp, &outb) != (size_t)-1)
+    ret = 4 * src_len - outb;
+  iconv_close(ic);
+  return ret;
+}
+
+int main(int ac, char **av)
+{
+  char    **names;
+  size_t  *lens, total = 0;
+  double  start, cached, uncached;
+
+  (void)ac; (void)av;
+  setlocale(LC_ALL, "");
+
+  names = calloc(ENTRY_COUNT, sizeof(*names));
+  lens  = calloc(ENTRY_COUNT, sizeof(*lens));
+  if (!names || !lens)
+    exit(1);
+
+  // Typical file names, some of them with non ASCII characters
+  for (size_t i = 0; i < ENTRY_COUNT; i++)
+  {
+    char name[64];
+    int  len = snprintf(name, sizeof(name), i % 8 ? "IMG_%05zu.JPG"
+                        : "R\xc3\xa9sum\xc3\xa9 %zu.docx", i);
+
+    lens[i] = smb_to_utf16(name, len, &names[i]);
+    if (lens[i] == 0)
+    {
+      fprintf(stderr, "Unable to convert '%s' in this locale\n", name);
+      exit(1);
+    }
+  }
+
+  start = now();
+  for (size_t i = 0; i < ENTRY_COUNT; i++)
+  {
+    char *out;
+    total += smb_from_utf16(names[i], lens[i], &out);
+    free(out);
+  }
+  cached = now() - start;
+
+  start = now();
+  for (size_t i = 0; i < ENTRY_COUNT; i++)
+  {
+    char *out;
+    total += uncached_from_utf16(names[i], lens[i], &out);
+    free(out);
+  }
+  uncached = now() - start;
+
+  printf("%d entries, locale encoding %s (%zu bytes)\n", ENTRY_COUNT,
+         CODESET_NAME, total / 2);
+  printf("smb_from_utf16:      %8.1f ns/entry\n", cached * 1e9 / ENTRY_COUNT);
+  printf("iconv_open per call: %8.1f ns/entry\n", uncached * 1e9 / ENTRY_COUNT);
+
+  for (size_t i = 0; i < ENTRY_COUNT; i++)
+    free(names[i]);
+  free(names);
+  free(lens);
+
+  return 0;
+}
@@ -41,7 +41,11 @@
 #include "bdsm/smb_session.h"
 #include "bdsm/smb_share.h"
 #include "bdsm/smb_file.h"
+#include "bdsm/smb_hash.h"
 #include "bdsm/smb_stat.h"
+#include "bdsm/smb_transfer.h"
 #include "bdsm/smb_dir.h"
+#include "bdsm/smb_walk.h"
+#include "bdsm/smb_watch.h"
 
 #endif
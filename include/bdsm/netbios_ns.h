@@ -31,6 +31,7 @@
 #ifndef __BDSM_NETBIOS_NS_H_
 #define __BDSM_NETBIOS_NS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -88,10 +89,59 @@ netbios_ns    *netbios_ns_new();
  */
 void          netbios_ns_destroy(netbios_ns *ns);
 
+/**
+ * @brief Set the overall deadline of netbios_ns_resolve() and
+ * netbios_ns_inverse()
+ * @details Queries are retransmitted with an exponential backoff starting
+ * from a per-host estimate of the round-trip time, until a reply is received
+ * or this deadline expires.
+ *
+ * @param ns The name service object.
+ * @param timeout The deadline in milliseconds, or 0 to restore the defaults
+ * (2000ms for a resolve, 1500ms for an inverse lookup)
+ */
+void          netbios_ns_set_timeout(netbios_ns *ns, unsigned int timeout);
+
+/**
+ * @brief Keep the entries of the name service in a cache file
+ * @details The entries found in the file are loaded right away, so this
+ * should be called just after netbios_ns_new() and before starting a
+ * discovery. They are revalidated by the next discovery, or on their first
+ * use by netbios_ns_resolve() and netbios_ns_inverse(), which ask the host
+ * for its name: the ones that don't answer are dropped. The file is written when the discovery stops and when
+ * the name service is destroyed.
+ *
+ * @param ns The name service object.
+ * @param path The path of the cache file. It doesn't have to exist.
+ * @return 0 on success or -1 if the file couldn't be read
+ */
+int           netbios_ns_set_cache_file(netbios_ns *ns, const char *path);
+
+/// Maximum number of WINS servers, @see netbios_ns_set_wins()
+#define NETBIOS_NS_WINS_MAX 4
+
+/**
+ * @brief Set the WINS (NBNS) servers used by netbios_ns_resolve()
+ * @details Names are then resolved with unicast queries sent to all the
+ * servers at once, the first positive answer wins. Broadcast queries are only
+ * used if none of the servers knows the name.
+ *
+ * @param ns The name service object.
+ * @param servers An array of IPv4 addresses in network byte order
+ * @param count The number of servers, at most NETBIOS_NS_WINS_MAX. 0 disables
+ * WINS resolution
+ * @return 0 on success or -1 if there are too many servers
+ */
+int           netbios_ns_set_wins(netbios_ns *ns, const uint32_t *servers,
+                                  size_t count);
+
 /**
  * @brief Resolve a Netbios name
  * @details This function tries to resolves the given NetBIOS name with the
- * given type on the LAN, using broadcast queries. No WINS server is called.
+ * given type, asking the WINS servers first if there are any (@see
+ * netbios_ns_set_wins()), then using broadcast queries on the LAN.
+ * It can be called while a discovery is running, in which case the hosts
+ * already discovered are answered from the discovery cache.
  *
  * @param ns the netbios name service object.
  * @param name the null-terminated ASCII netbios name to resolve. If it's
@@ -107,15 +157,15 @@ int           netbios_ns_resolve(netbios_ns *ns, const char *name,
  * @brief Perform an inverse netbios lookup (get name from ip)
  * @details This function does a NBSTAT and stores all the returned entry in
  * the internal list of entries. It returns one of the name found. (Normally
- * the <20> or <0> name)
+ * the <20> or <0> name). It can be called while a discovery is running.
  *
  * @param ns The name service object.
  * @param ip The ip address in network byte order.
  *
- * @return A null-terminated ASCII string containing the NETBIOS name. You don't
- * own the it (it'll be freed when destroying/clearing the name service)
+ * @return A null-terminated ASCII string containing the NETBIOS name, or NULL
+ * in case of error. You own it and have to free() it.
  */
-const char          *netbios_ns_inverse(netbios_ns *ns, uint32_t ip);
+char                *netbios_ns_inverse(netbios_ns *ns, uint32_t ip);
 
 typedef struct
 {
@@ -144,6 +194,49 @@ typedef struct
 int netbios_ns_discover_start(netbios_ns *ns, unsigned int broadcast_timeout,
                               netbios_ns_discover_callbacks *callbacks);
 
+/**
+ * @brief Start a NETBIOS discovery driven by the caller's event loop
+ *
+ * @details Same as netbios_ns_discover_start(), but no thread is created:
+ * the caller has to watch netbios_ns_get_fd() for reading and call
+ * netbios_ns_discover_process() when it's readable or when the timeout
+ * returned by the previous call expires. The callbacks are called from
+ * netbios_ns_discover_process().
+ *
+ * @param ns The name service object.
+ * @param broadcast_timeout Do a broadcast every timeout seconds
+ * @param callbacks The callbacks previously setup by the caller
+ *
+ * @return 0 on success or -1 on failure
+ */
+int netbios_ns_discover_attach(netbios_ns *ns, unsigned int broadcast_timeout,
+                               netbios_ns_discover_callbacks *callbacks);
+
+/**
+ * @brief Handle the pending answers of a discovery started with
+ * netbios_ns_discover_attach(), and broadcast a new query if it's time to.
+ * It never blocks.
+ *
+ * @param ns The name service object.
+ * @param[out] timeout The time in milliseconds before this function needs to
+ * be called again, or -1 if it only needs to be called when the fd is
+ * readable (like the timeout of poll()). Can be NULL.
+ *
+ * @return 0 on success or -1 on failure
+ */
+int netbios_ns_discover_process(netbios_ns *ns, int *timeout);
+
+/**
+ * @brief Get a file descriptor that becomes readable when an answer is
+ * received, to be watched by an event loop.
+ * @details It's the NS socket, or an epoll descriptor watching it on Linux.
+ * Don't read from it or close it.
+ *
+ * @param ns The name service object.
+ * @return A file descriptor
+ */
+int netbios_ns_get_fd(netbios_ns *ns);
+
 /**
  * @brief Stop the NETBIOS discovery.
  * @param ns The name service object.
@@ -138,22 +138,86 @@ enum smb_session_supports_what
 #define SMB_MOD_RO              (SMB_MOD_READ | SMB_MOD_READ_EXT \
                                 | SMB_MOD_READ_ATTR | SMB_MOD_READ_CTL )
 
+//-----------------------------------------------------------------------------/
+// File attributes (see smb_fopen_opts)
+//-----------------------------------------------------------------------------/
+#define SMB_ATTR_NORMAL         0
+#define SMB_ATTR_RO             (1 << 0)
+#define SMB_ATTR_HIDDEN         (1 << 1)
+#define SMB_ATTR_SYS            (1 << 2)
+#define SMB_ATTR_VOLID          (1 << 3)  // Volume ID
+#define SMB_ATTR_DIR            (1 << 4)
+#define SMB_ATTR_ARCHIVE        (1 << 5)  // Modified since last archive (!?)
+#define SMB_ATTR_TEMPORARY      (1 << 8)  // Short lived, better kept in cache
+#define SMB_ATTR_SPARSE         (1 << 9)
+#define SMB_ATTR_REPARSE_POINT  (1 << 10) // Junction, symlink, etc.
+#define SMB_ATTR_COMPRESSED     (1 << 11)
+#define SMB_ATTR_OFFLINE        (1 << 12)
+#define SMB_ATTR_NOT_INDEXED    (1 << 13)
+#define SMB_ATTR_ENCRYPTED      (1 << 14)
+
+//-----------------------------------------------------------------------------/
+// NT Create options (see smb_fopen_opts)
+//-----------------------------------------------------------------------------/
+#define SMB_CREATEOPT_DIRECTORY_FILE             (1 << 0)
+#define SMB_CREATEOPT_WRITE_THROUGH              (1 << 1)
+#define SMB_CREATEOPT_SEQUENTIAL_ONLY            (1 << 2)
+#define SMB_CREATEOPT_NO_INTERMEDIATE_BUFFERING  (1 << 3)
+#define SMB_CREATEOPT_SYNCHRONOUS_IO_ALERT       (1 << 3)
+#define SMB_CREATEOPT_SYNCHRONOUS_IO_NONALERTIF  (1 << 4)
+#define SMB_CREATEOPT_NON_DIRECTORY_FILE         (1 << 5)
+#define SMB_CREATEOPT_CREATE_TREE_CONNECTION     (1 << 6)
+#define SMB_CREATEOPT_COMPLETE_IF_OPLOCKED       (1 << 7)
+#define SMB_CREATEOPT_NO_EA_KNOWLEDGE            (1 << 8)
+#define SMB_CREATEOPT_OPEN_FOR_RECOVERY          (1 << 9)
+#define SMB_CREATEOPT_RANDOM_ACCESS              (1 << 10)
+#define SMB_CREATEOPT_DELETE_ON_CLOSE            (1 << 11)
+#define SMB_CREATEOPT_OPEN_BY_FILE_ID            (1 << 12)
+#define SMB_CREATEOPT_OPEN_FOR_BACKUP_INTENT     (1 << 13)
+#define SMB_CREATEOPT_NO_COMPRESSION             (1 << 14)
+#define SMB_CREATEOPT_RESERVE_OPFILTER           (1 << 15)
+#define SMB_CREATEOPT_OPEN_NO_RECALL             (1 << 16)
+#define SMB_CREATEOPT_OPEN_FOR_FREE_SPACE_QUERY  (1 << 17)
+
+//-----------------------------------------------------------------------------/
+// Opportunistic locks (see smb_fopen_opts and smb_fcache_rights())
+//-----------------------------------------------------------------------------/
+/// No oplock
+#define SMB_OPLOCK_NONE             0
+/// Only this client has the file open
+#define SMB_OPLOCK_EXCLUSIVE        1
+/// Exclusive, and the server even delays the closing of the file
+#define SMB_OPLOCK_BATCH            2
+/// Other clients may have it open too, but none is writing
+#define SMB_OPLOCK_LEVEL_II         3
+
+/// The data read may be cached
+#define SMB_CACHE_READ              (1 << 0)
+/// Writes may be delayed and cached
+#define SMB_CACHE_WRITE             (1 << 1)
+/// Closing the file may be delayed
+#define SMB_CACHE_HANDLE            (1 << 2)
+
 //-----------------------------------------------------------------------------/
 // NTSTATUS & internal return codes
 //-----------------------------------------------------------------------------/
 #define NT_STATUS_SUCCESS                   0x00000000
+#define NT_STATUS_NOTIFY_ENUM_DIR           0x0000010c
 #define NT_STATUS_INVALID_SMB               0x00010002
 #define NT_STATUS_SMB_BAD_TID               0x00050002
 #define NT_STATUS_SMB_BAD_UID               0x005b0002
 #define NT_STATUS_NOT_IMPLEMENTED           0xc0000002
+#define NT_STATUS_INVALID_PARAMETER         0xc000000d
 #define NT_STATUS_INVALID_DEVICE_REQUEST    0xc0000010
 #define NT_STATUS_NO_SUCH_DEVICE            0xc000000e
 #define NT_STATUS_NO_SUCH_FILE              0xc000000f
 #define NT_STATUS_MORE_PROCESSING_REQUIRED  0xc0000016
+#define NT_STATUS_NO_MEMORY                 0xc0000017
 #define NT_STATUS_INVALID_LOCK_SEQUENCE     0xc000001e
 #define NT_STATUS_INVALID_VIEW_SIZE         0xc000001f
 #define NT_STATUS_ALREADY_COMMITTED         0xc0000021
 #define NT_STATUS_ACCESS_DENIED             0xc0000022
+#define NT_STATUS_OBJECT_NAME_INVALID       0xc0000033
 #define NT_STATUS_OBJECT_NAME_NOT_FOUND     0xc0000034
 #define NT_STATUS_OBJECT_NAME_COLLISION     0xc0000035
 #define NT_STATUS_OBJECT_PATH_INVALID       0xc0000039
@@ -168,9 +232,11 @@ enum smb_session_supports_what
 #define NT_STATUS_MEDIA_WRITE_PROTECTED     0xc00000a2
 #define NT_STATUS_ILLEGAL_FUNCTION          0xc00000af
 #define NT_STATUS_FILE_IS_A_DIRECTORY       0xc00000ba
+#define NT_STATUS_INVALID_NETWORK_RESPONSE  0xc00000c3
 #define NT_STATUS_FILE_RENAMED              0xc00000d5
 #define NT_STATUS_REDIRECTOR_NOT_STARTED    0xc00000fb
 #define NT_STATUS_DIRECTORY_NOT_EMPTY       0xc0000101
+#define NT_STATUS_CANCELLED                 0xc0000120
 #define NT_STATUS_PROCESS_IS_TERMINATING    0xc000010a
 #define NT_STATUS_TOO_MANY_OPENED_FILES     0xc000011f
 #define NT_STATUS_CANNOT_DELETE             0xc0000121
@@ -50,6 +50,39 @@
  */
 int smb_directory_rm(smb_session *s, smb_tid tid, const char *path);
 
+/**
+ * @brief remove many directories on a share.
+ * @details Same as calling smb_directory_rm() for each path, but the
+ * requests are pipelined like with smb_file_rm_many().
+ *
+ * @param s The session object
+ * @param tid The tid of the share the directories are in, obtained via smb_tree_connect()
+ * @param paths The paths of the directories to delete
+ * @param count The number of paths
+ * @param status If not NULL, receives the NT status of each deletion
+ * @return 0 if all directories were deleted, DSM_ERROR_NT if some were not
+ * (see 'status') or another DSM error code if the batch failed
+ */
+int smb_directory_rm_many(smb_session *s, smb_tid tid,
+                          const char *const *paths, size_t count,
+                          uint32_t *status);
+
+/**
+ * @brief remove a directory and everything in it.
+ * @details Directories are listed one at a time, and their content deleted
+ * with pipelined requests. Failures to delete an item don't stop the
+ * removal of the others. Reparse points (junctions, symbolic links) are
+ * removed themselves, their target is left untouched.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the directory is in, obtained via smb_tree_connect()
+ * @param path The path of the directory to delete
+ * @return 0 on success, DSM_ERROR_NT if some items could not be deleted (the
+ * last NT status is available with smb_session_get_nt_status()) or another
+ * DSM error code in case of error
+ */
+int smb_directory_rm_tree(smb_session *s, smb_tid tid, const char *path);
+
 /**
  * @brief create a directory on a share.
  * @details Use this function to create a directory
@@ -56,6 +56,48 @@
 int       smb_fopen(smb_session *s, smb_tid tid, const char *path,
                     uint32_t mod, smb_fd *fd);
 
+/**
+ * @brief Options of smb_fopen_ex()
+ */
+typedef struct
+{
+    /// Space the server should reserve for the file if it gets created or
+    /// overwritten, so that it can allocate it contiguously. 0 for none.
+    uint64_t    alloc_size;
+    /// NT Create options (SMB_CREATEOPT_*), added to the default of
+    /// smb_fopen() (#SMB_CREATEOPT_WRITE_THROUGH for #SMB_MOD_RW, none
+    /// otherwise). With #SMB_CREATEOPT_DELETE_ON_CLOSE the server deletes the
+    /// file once closed, and the right to delete it is requested along with
+    /// the access modes.
+    uint32_t    create_opts;
+    /// Attributes (SMB_ATTR_*) of the file if it gets created or overwritten.
+    /// #SMB_ATTR_TEMPORARY tells the server to keep its data in cache rather
+    /// than write it to disk.
+    uint32_t    attributes;
+    /// Oplock to request, #SMB_OPLOCK_NONE, #SMB_OPLOCK_EXCLUSIVE or
+    /// #SMB_OPLOCK_BATCH. See smb_fcache_rights() for what was granted.
+    int         oplock;
+    /// If not 0, #SMB_CREATEOPT_WRITE_THROUGH is not added for #SMB_MOD_RW:
+    /// the server may acknowledge writes before they reach the disk.
+    int         no_write_through;
+} smb_fopen_opts;
+
+/**
+ * @brief Open a file on a share, with options
+ * @details Same as smb_fopen(), except for the options.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the file is in, obtained via smb_tree_connect()
+ * @param path The path of the file to open
+ * @param mod The access modes requested (example: #SMB_MOD_RO)
+ * @param opts The options, or NULL for the defaults of smb_fopen()
+ * @param fd The pointer to the smb file description that can be used for
+ * further file operations
+ * @return 0 on success or a DSM error code in case of error
+ */
+int       smb_fopen_ex(smb_session *s, smb_tid tid, const char *path,
+                       uint32_t mod, const smb_fopen_opts *opts, smb_fd *fd);
+
 /**
  * @brief Close an open file
  * @details The smb_fd is invalidated and MUST not be use it anymore. You can
@@ -115,6 +157,99 @@ ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
  */
 ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence);
 
+/**
+ * @brief Hash what is read from or written to a file as it goes through
+ * @details The data is fed to the hash straight from the network buffers by
+ * smb_fread() and smb_fwrite(), so the hash covers the bytes read or written
+ * sequentially from the current offset. Data read or written elsewhere after
+ * a seek is not hashed.
+ *
+ * @param s The session object
+ * @param fd The file to hash
+ * @param hash The hash context, which must stay valid until the file is
+ * closed or another hash is set. NULL stops hashing.
+ * @return 0 on success or a DSM error code in case of error
+ */
+int       smb_fhash(smb_session *s, smb_fd fd, smb_hash *hash);
+
+/**
+ * @brief Set the size of an open file
+ * @details The file is truncated or extended with zeroes. The file offset
+ * does not change.
+ *
+ * @param s The session object
+ * @param fd The file, opened for writing
+ * @param size The new size of the file
+ * @return 0 on success or a DSM error code in case of error
+ */
+int       smb_ftruncate(smb_session *s, smb_fd fd, uint64_t size);
+
+/**
+ * @brief Set the space allocated to an open file
+ * @details Reserving the space of a file before writing it lets the server
+ * allocate it in one go. Servers truncate the file if the size given is
+ * smaller than its current size.
+ *
+ * @param s The session object
+ * @param fd The file, opened for writing
+ * @param size The space to allocate
+ * @return 0 on success or a DSM error code in case of error
+ */
+int       smb_fallocate(smb_session *s, smb_fd fd, uint64_t size);
+
+/**
+ * @brief Get what may be cached of a file under its current oplock
+ * @details The rights shrink when the server breaks the oplock, see
+ * smb_session_set_oplock_cb().
+ *
+ * @param s The session object
+ * @param fd The file
+ * @return #SMB_CACHE_READ, #SMB_CACHE_WRITE and #SMB_CACHE_HANDLE OR'ed, 0
+ * if nothing may be cached
+ */
+int       smb_fcache_rights(smb_session *s, smb_fd fd);
+
+/**
+ * @brief Enable or disable the data cache of a session
+ * @details When enabled, smb_fread() reads whole aligned blocks of the file
+ * and keeps them in memory, least recently used ones being evicted first, so
+ * that reading the same bytes again (after seeking back, or through another
+ * smb_fd of the same file) does not go to the server. Blocks are identified by
+ * share, path (matched case insensitively) and offset.
+ *
+ * Blocks are dropped when the last write time or size returned when opening
+ * the file differ from the ones of the file they were read from, by
+ * liBDSM's own modifications (smb_fwrite(), smb_ftruncate(), smb_file_rm(),
+ * ...), and when an oplock of the file is broken to none. Changes made by
+ * other clients while the file is open are thus only seen if an oplock was
+ * requested (see smb_fopen_ex()), otherwise from the next smb_fopen().
+ *
+ * @param s The session object
+ * @param budget The memory the cache may use, in bytes. 0 disables the cache
+ * and releases its content.
+ * @return 0 on success or a DSM error code in case of error
+ */
+int       smb_block_cache_enable(smb_session *s, size_t budget);
+
+/**
+ * @brief Drop every block of the data cache of a session
+ *
+ * @param s The session object
+ */
+void      smb_block_cache_flush(smb_session *s);
+
+/**
+ * @brief Get the counters of the data cache of a session
+ *
+ * @param s The session object
+ * @param[out] hits Number of smb_fread() answered from the cache, can be NULL
+ * @param[out] misses Number of smb_fread() that went to the server while the
+ * cache was enabled, can be NULL
+ * @param[out] used Memory currently used by the cache, in bytes, can be NULL
+ */
+void      smb_block_cache_counters(smb_session *s, uint64_t *hits,
+                                   uint64_t *misses, size_t *used);
+
 /**
  * @brief remove a file on a share.
  * @details Use this function to delete a file
@@ -138,4 +273,41 @@ int  smb_file_rm(smb_session *s, smb_tid tid, const char *path);
  */
 int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *new_path);
 
+/**
+ * @brief remove many files on a share.
+ * @details Same as calling smb_file_rm() for each path, but the requests are
+ * sent without waiting for the previous answers, as many at a time as the
+ * server accepts.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the files are in, obtained via smb_tree_connect()
+ * @param paths The paths of the files to delete
+ * @param count The number of paths
+ * @param status If not NULL, receives the NT status of each deletion
+ * @return 0 if all files were deleted, DSM_ERROR_NT if some were not (see
+ * 'status') or another DSM error code if the batch failed
+ */
+int       smb_file_rm_many(smb_session *s, smb_tid tid,
+                           const char *const *paths, size_t count,
+                           uint32_t *status);
+
+/**
+ * @brief move/rename many files/directories on a share.
+ * @details Same as calling smb_file_mv() for each pair of paths, but the
+ * requests are pipelined like with smb_file_rm_many().
+ *
+ * @param s The session object
+ * @param tid The tid of the share the files are in, obtained via smb_tree_connect()
+ * @param old_paths The current paths of the files/directories
+ * @param new_paths The new paths, one for each of 'old_paths'
+ * @param count The number of pairs
+ * @param status If not NULL, receives the NT status of each move
+ * @return 0 if all moves succeeded, DSM_ERROR_NT if some failed (see
+ * 'status') or another DSM error code if the batch failed
+ */
+int       smb_file_mv_many(smb_session *s, smb_tid tid,
+                           const char *const *old_paths,
+                           const char *const *new_paths, size_t count,
+                           uint32_t *status);
+
 #endif
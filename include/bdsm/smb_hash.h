@@ -0,0 +1,100 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_hash.h
+ * @brief Checksums computed on the fly while reading or writing
+ */
+
+#ifndef __BDSM_SMB_HASH_H_
+#define __BDSM_SMB_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bdsm/smb_types.h"
+
+/**
+ * @brief An incremental hash algorithm
+ * @details Besides the ones provided (smb_hash_md5(), smb_hash_crc32c(),
+ * smb_hash_xxh64()), any algorithm can be plugged by filling this structure.
+ */
+typedef struct
+{
+    const char  *name;
+    size_t      ctx_size;       ///< Size of the context given to the callbacks
+    size_t      digest_size;
+    void        (*init)(void *ctx);
+    void        (*update)(void *ctx, const void *data, size_t size);
+    void        (*final)(void *ctx, uint8_t *digest);
+} smb_hash_algo;
+
+/// MD5, 16 bytes digest
+const smb_hash_algo *smb_hash_md5(void);
+/// CRC-32C (Castagnoli), 4 bytes digest, big endian
+const smb_hash_algo *smb_hash_crc32c(void);
+/// XXH64 with a seed of 0, 8 bytes digest, big endian
+const smb_hash_algo *smb_hash_xxh64(void);
+
+/**
+ * @brief Create a hash context
+ *
+ * @param algo The algorithm, which must stay valid as long as the context
+ * @return A new hash context, or NULL on failure. Destroy it with
+ * smb_hash_destroy()
+ */
+smb_hash        *smb_hash_new(const smb_hash_algo *algo);
+
+/**
+ * @brief Add data to the hash
+ */
+void            smb_hash_update(smb_hash *h, const void *data, size_t size);
+
+/**
+ * @brief Get the number of bytes hashed so far
+ */
+uint64_t        smb_hash_bytes(smb_hash *h);
+
+/**
+ * @brief Finish the hash and get its digest
+ * @details The context is reset, ready to hash something else.
+ *
+ * @param h The hash context
+ * @param digest Receives the digest, algo->digest_size bytes
+ * @return The size of the digest
+ */
+size_t          smb_hash_final(smb_hash *h, uint8_t *digest);
+
+/**
+ * @brief Destroy a hash context
+ */
+void            smb_hash_destroy(smb_hash *h);
+
+#endif
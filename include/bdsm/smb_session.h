@@ -108,6 +108,65 @@ int             smb_session_login(smb_session *s);
 
 int             smb_session_logoff(smb_session *s);
 
+/**
+ * @brief Reconnect automatically when the connection is lost during a read
+ * or a write
+ * @details When smb_fread() or smb_fwrite() fail because the connection was
+ * lost, the session calls smb_session_reconnect() and sends the request
+ * again, up to 'retries' times. The transfer goes on from the file offset,
+ * so it is not restarted from the beginning. Files on the IPC$ share (named
+ * pipes) are never retried, since they lose their state with the connection.
+ *
+ * @param s The session object
+ * @param retries The number of reconnections to try per failed request, 0
+ * (the default) disables them
+ */
+void            smb_session_set_reconnect(smb_session *s, unsigned retries);
+
+/**
+ * @brief Connect again to the server, login, and restore shares and files
+ * @details Uses the host, transport and credentials of the last
+ * smb_session_connect() and smb_session_set_creds() calls. Connected shares
+ * and opened files keep their smb_tid and smb_fd, but files are opened again
+ * without truncation or creation, from the same offset. Cached attributes
+ * are dropped, since changes may have been missed. Pending
+ * smb_watch_wait() requests are lost.
+ *
+ * @param s The session object
+ * @return 0 on success, DSM_ERROR_NT if some shares or files could not be
+ * restored (they are left unusable) or another DSM error code if the
+ * connection or the login failed
+ */
+int             smb_session_reconnect(smb_session *s);
+
+/**
+ * @brief Set the callback told about oplock breaks
+ * @details Breaks are handled whenever a call receives from the session.
+ * The callback lets the caching layers drop what the new oplock level does
+ * not allow to keep.
+ *
+ * @param s The session object
+ * @param cb The callback, NULL for none
+ * @param opaque An opaque pointer given to the callback
+ */
+void            smb_session_set_oplock_cb(smb_session *s, smb_oplock_cb cb,
+                                          void *opaque);
+
+/**
+ * @brief Handle the oplock breaks sent while the session is idle
+ * @details The server waits for an oplock to be acknowledged before letting
+ * another client open the file, so a session holding oplocks must call this
+ * when it is not otherwise in use, e.g. whenever its socket is readable. It
+ * must not be called while an smb_watch_wait() request is pending, as the
+ * notification would be dropped.
+ *
+ * @param s The session object
+ * @param timeout How long to wait for something to arrive, in milliseconds
+ * @return The number of breaks handled, 0 if nothing arrived, or a DSM error
+ * code in case of error
+ */
+int             smb_session_poll(smb_session *s, int timeout);
+
 /**
  * @brief Am i logged in as Guest ?
  *
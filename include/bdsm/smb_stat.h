@@ -54,6 +54,16 @@
 /// smb_stat_get() OP: Get file last moditification time
 #define SMB_STAT_MTIME        6
 
+/// smb_find_info() level: Names only. smb_stat_get() returns 0 for everything
+#define SMB_FIND_INFO_NAMES       0x0103
+/// smb_find_info() level: Names, timestamps, sizes and attributes
+#define SMB_FIND_INFO_DIRECTORY   0x0101
+/// smb_find_info() level: #SMB_FIND_INFO_DIRECTORY plus the EA size
+#define SMB_FIND_INFO_FULL        0x0102
+/// smb_find_info() level: #SMB_FIND_INFO_FULL plus the short name. Used by
+/// smb_find()
+#define SMB_FIND_INFO_BOTH        0x0104
+
 /**
  * @brief Returns infos about files matching a pattern
  * @details This functions uses the FIND_FIRST2 SMB operations to list files
@@ -69,6 +79,38 @@
  */
 smb_stat_list   smb_find(smb_session *s, smb_tid tid, const char *pattern);
 
+/**
+ * @brief Returns infos about files matching a pattern, at a given level
+ * @details Same as smb_find(), but lets you choose how much is transferred
+ * for each file. Only the name and the fields readable with smb_stat_get()
+ * are kept, which #SMB_FIND_INFO_DIRECTORY already provides entirely;
+ * #SMB_FIND_INFO_NAMES is the cheapest, but has no attributes (not even
+ * #SMB_STAT_ISDIR).
+ *
+ * @param s The session object
+ * @param tid The share inside of which we want to find files obtained by
+ * smb_tree_connect()
+ * @param pattern The pattern to match files, see smb_find()
+ * @param level One of #SMB_FIND_INFO_NAMES, #SMB_FIND_INFO_DIRECTORY,
+ * #SMB_FIND_INFO_FULL or #SMB_FIND_INFO_BOTH
+ * @return An opaque list of smb_stat or NULL in case of error
+ */
+smb_stat_list   smb_find_info(smb_session *s, smb_tid tid, const char *pattern,
+                              int level);
+
+/**
+ * @brief Get the number of FIND_FIRST2/FIND_NEXT2 round trips done on a
+ * session, and of entries they returned
+ * @details The ratio tells how well listings are batched; the search sizes
+ * are derived from the buffer size and capabilities the server negotiated.
+ *
+ * @param s The session object
+ * @param round_trips Where to store the number of requests, can be NULL
+ * @param entries Where to store the number of entries received, can be NULL
+ */
+void            smb_find_counters(smb_session *s, uint64_t *round_trips,
+                                  uint64_t *entries);
+
 /**
  * @brief Get the status of a file from it's path inside of a share
  *
@@ -82,6 +124,53 @@ smb_stat_list   smb_find(smb_session *s, smb_tid tid, const char *pattern);
  */
 smb_stat        smb_fstat(smb_session *s, smb_tid tid, const char *path);
 
+/**
+ * @brief Get the status of many files at once
+ * @details Same as calling smb_fstat() for each path, but the requests are
+ * sent without waiting for the previous answers, as many at a time as the
+ * server accepts. The call returns once every path has its answer.
+ *
+ * @param s The session object
+ * @param tid The tree id of a share obtained by smb_tree_connect()
+ * @param paths The full paths of the files relative to the root of the share
+ * @param count The number of paths
+ *
+ * @return An opaque smb_stat_batch or NULL in case of error (if the
+ * connection failed, not if a path has no status). You need to destroy this
+ * object with smb_stat_batch_destroy() after usage.
+ */
+smb_stat_batch  *smb_fstat_many(smb_session *s, smb_tid tid,
+                                const char *const *paths, size_t count);
+
+/**
+ * @brief Get the NT status of one path of a smb_fstat_many() call
+ *
+ * @param batch A batch returned by smb_fstat_many()
+ * @param index The index of the path in the array given to smb_fstat_many()
+ *
+ * @return #NT_STATUS_SUCCESS if the file status is available, the status
+ * returned by the server otherwise (e.g. #NT_STATUS_OBJECT_NAME_NOT_FOUND)
+ */
+uint32_t        smb_stat_batch_status(smb_stat_batch *batch, size_t index);
+
+/**
+ * @brief Get the file status of one path of a smb_fstat_many() call
+ *
+ * @param batch A batch returned by smb_fstat_many()
+ * @param index The index of the path in the array given to smb_fstat_many()
+ *
+ * @return An opaque smb_stat or NULL if this path has no status. You don't
+ * own this object memory: it lives as long as the batch.
+ */
+smb_stat        smb_stat_batch_at(smb_stat_batch *batch, size_t index);
+
+/**
+ * @brief Release the memory of a smb_fstat_many() result
+ *
+ * @param batch The batch to destroy
+ */
+void            smb_stat_batch_destroy(smb_stat_batch *batch);
+
 /**
  * @brief Get the status of an open file from it's file descriptor
  * @details The file status will be those at the time of open
@@ -151,4 +240,61 @@ const char        *smb_stat_name(smb_stat info);
  */
 uint64_t          smb_stat_get(smb_stat info, int what);
 
+/**
+ * @brief Enable or disable the attributes cache of a share
+ * @details When enabled, smb_fstat() results and the entries returned by
+ * smb_find() are kept for ttl milliseconds, and smb_fstat() is answered from
+ * this cache when possible. Paths are matched case insensitively. Entries are
+ * dropped by liBDSM's own modifications (smb_fwrite(), smb_file_rm(),
+ * smb_file_mv(), smb_directory_rm(), smb_directory_create(), ...), but
+ * changes made by other clients are only seen once the entry has expired.
+ *
+ * @param s The session object
+ * @param tid The tree id of a share obtained by smb_tree_connect()
+ * @param ttl How long an entry stays valid, in ms. 0 disables the cache and
+ * releases its content.
+ *
+ * @return 0 on success or a DSM error code in case of error
+ */
+int               smb_stat_cache_enable(smb_session *s, smb_tid tid,
+                                        unsigned int ttl);
+
+/**
+ * @brief Answer lookups of nonexistent files from directory listings
+ * @details Once enabled, a directory completely listed with smb_find() (using
+ * a '\\dir\\*' pattern) while the attributes cache was enabled is known
+ * for the same ttl: smb_fstat() and read-only smb_fopen() of any other name
+ * inside of it fail with NT_STATUS_OBJECT_NAME_NOT_FOUND without contacting
+ * the server. Files created by another client during that time can then be
+ * reported missing.
+ *
+ * @param s The session object
+ * @param tid The tree id of a share, whose attributes cache is enabled
+ * @param enable 0 to disable, any other value to enable
+ *
+ * @return 0 on success or a DSM error code in case of error (cache disabled)
+ */
+int               smb_stat_cache_negative(smb_session *s, smb_tid tid,
+                                          int enable);
+
+/**
+ * @brief Drop every entry of the attributes cache of a share
+ *
+ * @param s The session object
+ * @param tid The tree id of a share obtained by smb_tree_connect()
+ */
+void              smb_stat_cache_flush(smb_session *s, smb_tid tid);
+
+/**
+ * @brief Get the hit/miss counters of the attributes cache of a share
+ *
+ * @param s The session object
+ * @param tid The tree id of a share obtained by smb_tree_connect()
+ * @param[out] hits Number of smb_fstat() answered from the cache, can be NULL
+ * @param[out] misses Number of smb_fstat() that went to the server while the
+ * cache was enabled, can be NULL
+ */
+void              smb_stat_cache_counters(smb_session *s, smb_tid tid,
+                                          uint64_t *hits, uint64_t *misses);
+
 #endif
@@ -0,0 +1,109 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_transfer.h
+ * @brief Whole file transfers between a share and a local file
+ */
+
+#ifndef __BDSM_SMB_TRANSFER_H_
+#define __BDSM_SMB_TRANSFER_H_
+
+#include "bdsm/smb_session.h"
+#include "bdsm/smb_hash.h"
+
+/// Reserve the space of the whole file on the destination before copying
+#define SMB_TRANSFER_PREALLOCATE    (1 << 0)
+
+/**
+ * @brief Callback reporting the progress of smb_fget() and smb_fput()
+ *
+ * @param opaque The opaque pointer given to smb_fget() or smb_fput()
+ * @param done The number of bytes copied so far
+ * @param total The size of the file
+ * @param bytes_per_sec The average rate achieved since the beginning
+ *
+ * @return 0 to continue, anything else aborts the transfer
+ */
+typedef int (*smb_transfer_cb)(void *opaque, uint64_t done, uint64_t total,
+                               double bytes_per_sec);
+
+/**
+ * @brief Download a whole file to a local file descriptor
+ * @details The file is read in the largest requests the server accepts,
+ * keeping as many of them in flight as it allows, and written at their
+ * offset in the local file, whatever the order the answers come in.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the file is in
+ * @param path The path of the file to download
+ * @param local_fd A local file descriptor opened for writing. The data is
+ * written from its offset 0, its current offset is not used. A regular file
+ * is truncated to the size downloaded.
+ * @param flags 0 or #SMB_TRANSFER_PREALLOCATE
+ * @param hash If not NULL, a fresh hash context fed with the whole file,
+ * from the answers as they come in whenever they come in order. Get the
+ * digest with smb_hash_final() once this returns.
+ * @param cb An optional progress callback, may be NULL
+ * @param opaque An opaque pointer given to the callback
+ *
+ * @return 0 on success or a DSM error code in case of error. A callback
+ * aborting the transfer gives DSM_ERROR_GENERIC.
+ */
+int             smb_fget(smb_session *s, smb_tid tid, const char *path,
+                         int local_fd, int flags, smb_hash *hash,
+                         smb_transfer_cb cb, void *opaque);
+
+/**
+ * @brief Upload a local file, creating or overwriting the remote one
+ * @details The writes are pipelined like the reads of smb_fget() and are
+ * not written through, the data is only guaranteed to be on the server's
+ * disk once it has been closed.
+ *
+ * @param s The session object
+ * @param tid The tid of the share to write into
+ * @param path The path of the file to create
+ * @param local_fd A local file descriptor opened for reading. The data is
+ * read from its offset 0, its current offset is not used.
+ * @param flags 0 or #SMB_TRANSFER_PREALLOCATE, which has the server allocate
+ * the file when creating it
+ * @param hash If not NULL, a fresh hash context fed with the whole file as
+ * it is read
+ * @param cb An optional progress callback, may be NULL
+ * @param opaque An opaque pointer given to the callback
+ *
+ * @return 0 on success or a DSM error code in case of error. A callback
+ * aborting the transfer gives DSM_ERROR_GENERIC.
+ */
+int             smb_fput(smb_session *s, smb_tid tid, const char *path,
+                         int local_fd, int flags, smb_hash *hash,
+                         smb_transfer_cb cb, void *opaque);
+
+#endif
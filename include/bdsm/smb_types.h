@@ -104,4 +104,28 @@ typedef smb_file *smb_stat_list;
  */
 typedef smb_file *smb_stat;
 
+/**
+ * @brief An opaque structure containing the results of smb_fstat_many()
+ */
+typedef struct smb_stat_batch smb_stat_batch;
+
+/**
+ * @brief An opaque structure containing a hash being computed
+ * @see smb_hash_new()
+ */
+typedef struct smb_hash smb_hash;
+
+/**
+ * @brief Callback told about the oplock breaks sent by the server
+ * @details It is called from whatever call is receiving from the session
+ * when the break arrives, before the break is acknowledged. It must drop
+ * what it cached of the file and must not use the session.
+ *
+ * @param opaque The opaque pointer given to smb_session_set_oplock_cb()
+ * @param fd The file whose oplock is broken
+ * @param level The oplock level now held, #SMB_OPLOCK_LEVEL_II or
+ * #SMB_OPLOCK_NONE
+ */
+typedef void (*smb_oplock_cb)(void *opaque, smb_fd fd, int level);
+
 #endif
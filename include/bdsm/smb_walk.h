@@ -0,0 +1,93 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_walk.h
+ * @brief Parallel recursive listing
+ */
+
+#ifndef __BDSM_SMB_WALK_H_
+#define __BDSM_SMB_WALK_H_
+
+#include "bdsm/smb_session.h"
+#include "bdsm/smb_stat.h"
+
+/// smb_walk_cb return value: Keep walking
+#define SMB_WALK_CONTINUE   0
+/// smb_walk_cb return value: Do not descend into this directory
+#define SMB_WALK_SKIP       1
+/// smb_walk_cb return value: Stop the whole walk
+#define SMB_WALK_STOP       2
+
+/**
+ * @brief Callback receiving the entries found by smb_walk()
+ * @details Calls are serialized, but made from the worker threads.
+ *
+ * @param opaque The opaque pointer given to smb_walk()
+ * @param path The full path of the entry inside of the share
+ * @param st The status of the entry, only valid during the call
+ * @param depth 0 for the entries of the root directory, 1 for their children,
+ * etc.
+ *
+ * @return One of #SMB_WALK_CONTINUE, #SMB_WALK_SKIP or #SMB_WALK_STOP
+ */
+typedef int (*smb_walk_cb)(void *opaque, const char *path, smb_stat st,
+                           int depth);
+
+/**
+ * @brief Recursively list a directory using several sessions in parallel
+ * @details Each session is driven by its own thread, listing directories
+ * taken from a shared work-stealing queue. The sessions must all be logged
+ * in to the same server and connected to the same share, and must not be
+ * used by anything else until smb_walk() returns.
+ *
+ * @param sessions The worker sessions
+ * @param tids The tree id of the share in each of the sessions
+ * @param count The number of sessions (and tids)
+ * @param root The directory to walk (e.g. '\\' or '\\folder')
+ * @param max_depth Do not descend deeper than this, -1 for no limit. 0 only
+ * lists the root directory.
+ * @param pattern If not NULL, only entries whose name matches this pattern
+ * ('*' and '?' wildcards, case insensitive) are given to the callback. All the
+ * directories are walked anyway.
+ * Reparse points (junctions, symbolic links) are given to the callback but
+ * never descended into.
+ * @param cb The callback receiving the entries
+ * @param opaque An opaque pointer given to the callback
+ *
+ * @return 0 on success, or a DSM error code in case of error. The walk goes
+ * on when a directory can not be listed, but smb_walk() then returns
+ * DSM_ERROR_NT (see smb_session_get_nt_status() on the worker sessions).
+ */
+int             smb_walk(smb_session **sessions, const smb_tid *tids,
+                         size_t count, const char *root, int max_depth,
+                         const char *pattern, smb_walk_cb cb, void *opaque);
+
+#endif
@@ -0,0 +1,138 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_watch.h
+ * @brief Directory change notifications
+ */
+
+#ifndef __BDSM_SMB_WATCH_H_
+#define __BDSM_SMB_WATCH_H_
+
+#include "bdsm/smb_session.h"
+
+/// smb_watch_open() filter: File creation, deletion or renaming
+#define SMB_NOTIFY_FILE_NAME        0x00000001
+/// smb_watch_open() filter: Directory creation, deletion or renaming
+#define SMB_NOTIFY_DIR_NAME         0x00000002
+/// smb_watch_open() filter: Attributes change
+#define SMB_NOTIFY_ATTRIBUTES       0x00000004
+/// smb_watch_open() filter: File size change
+#define SMB_NOTIFY_SIZE             0x00000008
+/// smb_watch_open() filter: Last write time change
+#define SMB_NOTIFY_LAST_WRITE       0x00000010
+/// smb_watch_open() filter: Last access time change
+#define SMB_NOTIFY_LAST_ACCESS      0x00000020
+/// smb_watch_open() filter: Creation time change
+#define SMB_NOTIFY_CREATION         0x00000040
+/// smb_watch_open() filter: Security descriptor change
+#define SMB_NOTIFY_SECURITY         0x00000100
+
+/// smb_watch_cb action: Changes were lost, the directory has to be listed again
+#define SMB_NOTIFY_ACTION_OVERFLOW      0
+/// smb_watch_cb action: The file was added
+#define SMB_NOTIFY_ACTION_ADDED         1
+/// smb_watch_cb action: The file was removed
+#define SMB_NOTIFY_ACTION_REMOVED       2
+/// smb_watch_cb action: The file was modified
+#define SMB_NOTIFY_ACTION_MODIFIED      3
+/// smb_watch_cb action: The file was renamed, this is its old name
+#define SMB_NOTIFY_ACTION_RENAMED_OLD   4
+/// smb_watch_cb action: The file was renamed, this is its new name
+#define SMB_NOTIFY_ACTION_RENAMED_NEW   5
+
+/**
+ * @struct smb_watch
+ * @brief An opaque object representing a watched directory
+ */
+typedef struct smb_watch smb_watch;
+
+/**
+ * @brief Callback receiving the changes of a watched directory
+ *
+ * @param opaque The opaque pointer given to smb_watch_wait()
+ * @param action One of the SMB_NOTIFY_ACTION_* values
+ * @param name The name of the changed file, relative to the watched directory,
+ * in your current locale encoding. NULL for #SMB_NOTIFY_ACTION_OVERFLOW
+ */
+typedef void (*smb_watch_cb)(void *opaque, int action, const char *name);
+
+/**
+ * @brief Start watching a directory for changes
+ * @details This opens the directory; the changes are then received with
+ * smb_watch_wait().
+ *
+ * @param s The session object
+ * @param tid The tid of the share the directory is in, obtained via
+ * smb_tree_connect()
+ * @param path The path of the directory to watch
+ * @param filter The changes to report, a combination of SMB_NOTIFY_* flags
+ * @param subtree If not 0, also report the changes in all the subdirectories
+ * @param[out] watch The new watch object
+ *
+ * @return 0 on success or a DSM error code in case of error
+ */
+int             smb_watch_open(smb_session *s, smb_tid tid, const char *path,
+                               uint32_t filter, int subtree,
+                               smb_watch **watch);
+
+/**
+ * @brief Wait for changes in a watched directory
+ * @details A change notification request is posted to the server if none is
+ * outstanding, and kept outstanding when the timeout expires, so that no
+ * change is missed between two calls. While a request is outstanding, the
+ * session must not be used for anything else than smb_watch_wait() and
+ * smb_watch_close() on this watch: use a dedicated session to watch while
+ * doing other operations. Oplock breaks arriving meanwhile are handled
+ * within the timeout.
+ *
+ * @param s The session object
+ * @param watch A watch object returned by smb_watch_open()
+ * @param timeout How long to wait in ms, -1 to wait forever
+ * @param cb The callback called for each change
+ * @param opaque An opaque pointer given to the callback
+ *
+ * @return The number of changes reported to the callback, 0 on timeout, or a
+ * DSM error code in case of error
+ */
+int             smb_watch_wait(smb_session *s, smb_watch *watch, int timeout,
+                               smb_watch_cb cb, void *opaque);
+
+/**
+ * @brief Stop watching a directory
+ * @details The outstanding request, if any, is cancelled and the directory
+ * is closed.
+ *
+ * @param s The session object
+ * @param watch The watch object to destroy
+ */
+void            smb_watch_close(smb_session *s, smb_watch *watch);
+
+#endif
@@ -54,6 +54,7 @@
 #define NETBIOS_FLAG_TRUNCATED  (1 << 9)
 #define NETBIOS_FLAG_RECURSIVE  (1 << 8)
 #define NETBIOS_FLAG_BROADCAST  (1 << 4)
+#define NETBIOS_FLAG_RCODE      0x000f  // Mask of the response code
 
 // Name Service Query
 #define NETBIOS_OP_NAME_QUERY         0x00
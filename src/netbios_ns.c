@@ -38,6 +38,7 @@
 #include <string.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <time.h>
 #ifdef HAVE_SYS_TIME_H
 #include <sys/time.h>
 #endif
@@ -60,6 +61,13 @@
 #ifdef HAVE_SYS_SOCKET_H
 # include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+# include <sys/epoll.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+# include <poll.h>
+#endif
 
 #ifndef _WIN32
 # include <sys/types.h>
@@ -86,6 +94,10 @@ enum ns_entry_flag {
     NS_ENTRY_FLAG_INVALID = 0x00,
     NS_ENTRY_FLAG_VALID_IP = 0x01,
     NS_ENTRY_FLAG_VALID_NAME = 0x02,
+    // Loaded from the cache file, not seen on the network yet
+    NS_ENTRY_FLAG_CACHED = 0x04,
+    // Loaded from the cache file, but answered a lookup since
+    NS_ENTRY_FLAG_CHECKED = 0x08,
 };
 
 struct netbios_ns_entry
@@ -100,8 +112,78 @@ struct netbios_ns_entry
 };
 typedef TAILQ_HEAD(, netbios_ns_entry) NS_ENTRY_QUEUE;
 
+// A query waiting for its reply. Whoever owns the socket at the time the
+// reply is received (the discovery thread or another resolver) fills it
+// and wakes up the waiting thread.
+typedef struct netbios_ns_pending netbios_ns_pending;
+struct netbios_ns_pending
+{
+    TAILQ_ENTRY(netbios_ns_pending) next;
+    uint16_t                      trn_id;
+    const uint32_t               *wait_ips; // Hosts the query was sent to,
+    size_t                        wait_count; // 0 if any host may reply
+    uint32_t                      replied_by; // Which one of them replied
+    uint32_t                      negatives; // Bit i: wait_ips[i] said no
+    bool                          done;
+    enum name_query_type          type;     // INVALID for a negative reply
+    uint32_t                      ip;
+    char                          name[NETBIOS_NAME_LENGTH + 1];
+    char                          group[NETBIOS_NAME_LENGTH + 1];
+    char                          name_type;
+};
+typedef TAILQ_HEAD(, netbios_ns_pending) NS_PENDING_QUEUE;
+
 #define RECV_BUFFER_SIZE 1500 // Max MTU frame size for ethernet
 
+// On-disk cache of the entries. It's a header followed by fixed size
+// records in host byte order, so that it can be mapped as is. The file
+// isn't meant to be shared between machines.
+#define NS_CACHE_MAGIC        0x4e534243  // 'NSBC'
+#define NS_CACHE_VERSION      1
+#define NS_CACHE_MAX_AGE      (24 * 3600) // Older entries aren't loaded
+
+SMB_PACKED_START typedef struct
+{
+    uint32_t            magic;
+    uint16_t            version;
+    uint16_t            record_size;
+    uint32_t            count;
+    uint32_t            reserved;
+} SMB_PACKED_END netbios_ns_cache_header;
+
+SMB_PACKED_START typedef struct
+{
+    int64_t             last_time_seen;
+    uint32_t            ip;         // Network byte order
+    char                name[NETBIOS_NAME_LENGTH + 1];
+    char                group[NETBIOS_NAME_LENGTH + 1];
+    char                type;
+    uint8_t             reserved;
+} SMB_PACKED_END netbios_ns_cache_record;
+
+// Retransmission timeouts, in microseconds. The initial value is the one
+// from RFC1002 (BCAST_REQ_RETRY_TIMEOUT), it is then computed from the
+// measured round trip time the same way TCP does (RFC6298).
+#define NS_RTO_INITIAL        250000
+#define NS_RTO_MIN            20000
+#define NS_RTO_MAX            1000000
+#define NS_RTT_SLOTS          16
+
+// Default overall time to wait for a reply, in milliseconds
+#define NS_RESOLVE_TIMEOUT    2000
+#define NS_INVERSE_TIMEOUT    1500
+
+// Round trip time estimation for one destination (0 for broadcast)
+typedef struct
+{
+    uint32_t            ip;
+    bool                used;
+    bool                valid;      // At least one sample was taken
+    long                srtt;       // Smoothed round trip time
+    long                rttvar;     // Round trip time variation
+    unsigned int        last_use;
+} netbios_ns_rtt;
+
 struct netbios_ns
 {
     int                 socket;
@@ -109,15 +191,39 @@ struct netbios_ns
     uint16_t            last_trn_id;  // Last transaction id used;
     NS_ENTRY_QUEUE      entry_queue;
     uint8_t             buffer[RECV_BUFFER_SIZE];
-#ifdef HAVE_PIPE
+    // Protects last_trn_id, entry_queue, pending_queue, receiving, rtt, wins,
+    // discover_started, discover_attached and discover_running
+    pthread_mutex_t     lock;
+    pthread_cond_t      reply_cond;
+    NS_PENDING_QUEUE    pending_queue;
+    bool                receiving;    // A resolver is reading the socket
+    netbios_ns_rtt      rtt[NS_RTT_SLOTS];
+    unsigned int        rtt_clock;
+    unsigned int        resolve_timeout;
+    unsigned int        inverse_timeout;
+    uint32_t            wins[NETBIOS_NS_WINS_MAX];
+    size_t              wins_count;
+    char               *cache_path;
+#if defined(HAVE_SYS_EVENTFD_H)
+    int                 abort_fd;
+#elif defined(HAVE_PIPE)
     int                 abort_pipe[2];
 #else
     pthread_mutex_t     abort_lock;
     bool                aborted;
+#endif
+#ifdef HAVE_SYS_EPOLL_H
+    int                 epoll_fd;     // Watches the socket and abort_fd
 #endif
     unsigned int        discover_broadcast_timeout;
     pthread_t           discover_thread;
     bool                discover_started;
+    // Driven by netbios_ns_discover_process() instead of discover_thread
+    bool                discover_attached;
+    // discover_thread is reading the socket, until it exits
+    bool                discover_running;
+    time_t              discover_started_at;
+    time_t              discover_next_broadcast; // 0 before the first one
     netbios_ns_discover_callbacks discover_callbacks;
 };
 
@@ -125,9 +231,12 @@ typedef struct netbios_ns_name_query netbios_ns_name_query;
 struct netbios_ns_name_query
 {
     enum name_query_type type;
+    uint16_t trn_id;
+    uint32_t src_ip;
     union {
         struct {
-            uint32_t ip;
+            uint32_t ip;      // The host that replied
+            uint32_t addr;    // The address in the answer
         } nb;
         struct {
             const char *name;
@@ -167,7 +276,55 @@ error:
     return 0;
 }
 
-#ifdef HAVE_PIPE
+#if defined(HAVE_SYS_EVENTFD_H)
+
+static int    ns_open_abort_pipe(netbios_ns *ns)
+{
+    ns->abort_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    return ns->abort_fd == -1 ? -1 : 0;
+}
+
+static void   ns_close_abort_pipe(netbios_ns *ns)
+{
+    if (ns->abort_fd != -1)
+    {
+        close(ns->abort_fd);
+        ns->abort_fd = -1;
+    }
+}
+
+// The fd that becomes readable when aborted, -1 if there is none
+static int    ns_abort_fd(netbios_ns *ns)
+{
+    return ns->abort_fd;
+}
+
+static bool   netbios_ns_is_aborted(netbios_ns *ns)
+{
+    struct pollfd pfd = { ns->abort_fd, POLLIN, 0 };
+
+    return poll(&pfd, 1, 0) != 0;
+}
+
+static void netbios_ns_abort(netbios_ns *ns)
+{
+    uint64_t value = 1;
+
+    if (write(ns->abort_fd, &value, sizeof(value)) == -1)
+        BDSM_perror("netbios_ns_abort: ");
+}
+
+static void netbios_ns_abort_reset(netbios_ns *ns)
+{
+    uint64_t value;
+
+    // Reading an eventfd resets its counter
+    if (read(ns->abort_fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+        BDSM_perror("netbios_ns_abort_reset: ");
+}
+
+#elif defined(HAVE_PIPE)
 
 static int    ns_open_abort_pipe(netbios_ns *ns)
 {
@@ -197,6 +354,11 @@ static void   ns_close_abort_pipe(netbios_ns *ns)
     }
 }
 
+static int    ns_abort_fd(netbios_ns *ns)
+{
+    return ns->abort_pipe[0];
+}
+
 static bool   netbios_ns_is_aborted(netbios_ns *ns)
 {
     fd_set        read_fds;
@@ -217,6 +379,16 @@ static void netbios_ns_abort(netbios_ns *ns)
     write(ns->abort_pipe[1], &buf, sizeof(uint8_t));
 }
 
+static void netbios_ns_abort_reset(netbios_ns *ns)
+{
+    uint8_t buf;
+
+    // Don't rely on O_NONBLOCK, it isn't available everywhere
+    while (netbios_ns_is_aborted(ns))
+        if (read(ns->abort_pipe[0], &buf, sizeof(uint8_t)) <= 0)
+            break;
+}
+
 #else
 
 static int    ns_open_abort_pipe(netbios_ns *ns)
@@ -229,6 +401,12 @@ static void   ns_close_abort_pipe(netbios_ns *ns)
     pthread_mutex_destroy(&ns->abort_lock);
 }
 
+static int    ns_abort_fd(netbios_ns *ns)
+{
+    (void)ns;
+    return -1;
+}
+
 static bool   netbios_ns_is_aborted(netbios_ns *ns)
 {
     pthread_mutex_lock(&ns->abort_lock);
@@ -244,6 +422,128 @@ static void netbios_ns_abort(netbios_ns *ns)
     pthread_mutex_unlock(&ns->abort_lock);
 }
 
+static void netbios_ns_abort_reset(netbios_ns *ns)
+{
+    pthread_mutex_lock(&ns->abort_lock);
+    ns->aborted = false;
+    pthread_mutex_unlock(&ns->abort_lock);
+}
+
+#endif
+
+#ifdef HAVE_SYS_EPOLL_H
+
+static int    ns_open_epoll(netbios_ns *ns)
+{
+    const int fds[2] = { ns->socket, ns_abort_fd(ns) };
+
+    if ((ns->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return -1;
+
+    for (int i = 0; i < 2; i++)
+    {
+        struct epoll_event event;
+
+        if (fds[i] == -1)
+            continue;
+        memset(&event, 0, sizeof(event));
+        event.events  = EPOLLIN;
+        event.data.fd = fds[i];
+        if (epoll_ctl(ns->epoll_fd, EPOLL_CTL_ADD, fds[i], &event) == -1)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void   ns_close_epoll(netbios_ns *ns)
+{
+    if (ns->epoll_fd != -1)
+    {
+        close(ns->epoll_fd);
+        ns->epoll_fd = -1;
+    }
+}
+
+// Wait for the socket to be readable. Returns 1 if it is, 0 on timeout and
+// -1 on error or abort.
+static int    netbios_ns_wait(netbios_ns *ns, struct timeval *timeout)
+{
+    struct epoll_event  events[2];
+    int                 res, timeout_ms = -1;
+    bool                readable = false;
+
+    if (timeout != NULL)
+        timeout_ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+
+    res = epoll_wait(ns->epoll_fd, events, 2, timeout_ms);
+    if (res < 0)
+        goto error;
+
+    for (int i = 0; i < res; i++)
+    {
+        if (events[i].data.fd != ns->socket)
+            return -1;
+        if (events[i].events & EPOLLERR)
+            goto error;
+        readable = true;
+    }
+
+    return readable ? 1 : 0;
+
+error:
+    BDSM_perror("netbios_ns_wait: ");
+    return -1;
+}
+
+#else
+
+static int    ns_open_epoll(netbios_ns *ns)
+{
+    (void)ns;
+    return 0;
+}
+
+static void   ns_close_epoll(netbios_ns *ns)
+{
+    (void)ns;
+}
+
+// Wait for the socket to be readable. Returns 1 if it is, 0 on timeout and
+// -1 on error or abort.
+static int    netbios_ns_wait(netbios_ns *ns, struct timeval *timeout)
+{
+    fd_set  read_fds, error_fds;
+    int     res, nfds;
+    int     sock = ns->socket;
+    int     abort_fd = ns_abort_fd(ns);
+
+    FD_ZERO(&read_fds);
+    FD_ZERO(&error_fds);
+    FD_SET(sock, &read_fds);
+    if (abort_fd != -1)
+        FD_SET(abort_fd, &read_fds);
+    FD_SET(sock, &error_fds);
+    nfds = (sock > abort_fd ? sock : abort_fd) + 1;
+
+    res = select(nfds, &read_fds, 0, &error_fds, timeout);
+
+    if (res < 0)
+        goto error;
+    if (FD_ISSET(sock, &error_fds))
+        goto error;
+
+    if (abort_fd != -1 ? FD_ISSET(abort_fd, &read_fds)
+                       : netbios_ns_is_aborted(ns))
+        return -1;
+
+    return FD_ISSET(sock, &read_fds) ? 1 : 0;
+
+error:
+    BDSM_perror("netbios_ns_wait: ");
+    return -1;
+}
+
 #endif
 
 static uint16_t query_type_nb = 0x2000;
@@ -323,11 +623,24 @@ static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
 
 #endif
 
+// Get a new transaction id, not to reuse them
+static uint16_t netbios_ns_next_trn_id(netbios_ns *ns)
+{
+    uint16_t trn_id;
+
+    pthread_mutex_lock(&ns->lock);
+    trn_id = ++ns->last_trn_id;
+    pthread_mutex_unlock(&ns->lock);
+
+    return trn_id;
+}
+
 static int netbios_ns_send_name_query(netbios_ns *ns,
                                       uint32_t ip,
                                       enum name_query_type type,
                                       const char *name,
-                                      uint16_t query_flag)
+                                      uint16_t query_flag,
+                                      uint16_t trn_id)
 {
     uint16_t            query_type;
     netbios_query       *q;
@@ -360,8 +673,7 @@ static int netbios_ns_send_name_query(netbios_ns *ns,
     netbios_query_append(q, (const char *)&query_class_in, 2);
     q->packet->queries = htons(1);
 
-    // Increment transaction ID, not to reuse them
-    q->packet->trn_id = htons(ns->last_trn_id + 1);
+    q->packet->trn_id = htons(trn_id);
 
     if (ip != 0)
     {
@@ -382,12 +694,11 @@ static int netbios_ns_send_name_query(netbios_ns *ns,
 
     netbios_query_destroy(q);
 
-    ns->last_trn_id++; // Remember the last transaction id.
     return 0;
 }
 
-static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
-                                   bool check_trn_id, uint32_t recv_ip,
+static int netbios_ns_handle_query(uint8_t *buffer, size_t size,
+                                   uint32_t recv_ip,
                                    netbios_ns_name_query *out_name_query)
 {
     netbios_query_packet *q;
@@ -403,20 +714,14 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
         return -1;
     }
 
-    q = (netbios_query_packet *)ns->buffer;
-    if (check_trn_id)
-    {
-        // check if trn_id corresponds
-        if (ntohs(q->trn_id) != ns->last_trn_id) {
-            BDSM_dbg("netbios_ns_handle_query, invalid trn_id: %d vs %d\n",
-                     ntohs(q->trn_id), ns->last_trn_id);
-            return -1;
-        }
-    }
+    q = (netbios_query_packet *)buffer;
 
     if (!out_name_query)
         return 0;
 
+    out_name_query->trn_id = ntohs(q->trn_id);
+    out_name_query->src_ip = recv_ip;
+
     // get Name size, should be 0x20
     if (size < sizeof(netbios_query_packet) + 1)
         return -1;
@@ -436,9 +741,19 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
         return -1;
     p_data = q->payload + name_size + 12;
 
+    // Negative response, typically from a WINS server
+    if (ntohs(q->flags) & NETBIOS_FLAG_RCODE)
+        return 0;
+
     if (type == query_type_nb) {
         out_name_query->type = NAME_QUERY_TYPE_NB;
         out_name_query->u.nb.ip = recv_ip;
+        // NB_FLAGS (2 bytes) followed by NB_ADDRESS. WINS servers answer
+        // for other hosts, so the sender isn't always the one we look for.
+        if (data_length >= 6)
+            memcpy(&out_name_query->u.nb.addr, p_data + 2, 4);
+        else
+            out_name_query->u.nb.addr = recv_ip;
     } else if (type == query_type_nbstat) {
         uint8_t name_count;
         const char *names = NULL;
@@ -493,95 +808,46 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
     return 0;
 }
 
+// Receive a reply in buffer (RECV_BUFFER_SIZE long). The names returned in
+// out_name_query point into it.
 static ssize_t netbios_ns_recv(netbios_ns *ns,
+                               uint8_t *buffer,
                                struct timeval *timeout,
                                struct sockaddr_in *out_addr,
-                               bool check_trn_id,
-                               uint32_t wait_ip,
                                netbios_ns_name_query *out_name_query)
 {
-    int sock;
-
     assert(ns != NULL);
 
-    sock = ns->socket;
-#ifdef HAVE_PIPE
-    int abort_fd =  ns->abort_pipe[0];
-#else
-    int abort_fd = -1;
-#endif
-
     if (out_name_query)
         out_name_query->type = NAME_QUERY_TYPE_INVALID;
 
     while (true)
     {
-        fd_set read_fds, error_fds;
-        int res, nfds;
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof(struct sockaddr_in);
+        ssize_t size;
+        int res;
 
-        FD_ZERO(&read_fds);
-        FD_ZERO(&error_fds);
-        FD_SET(sock, &read_fds);
-#ifdef HAVE_PIPE
-        FD_SET(abort_fd, &read_fds);
-#endif
-        FD_SET(sock, &error_fds);
-        nfds = (sock > abort_fd ? sock : abort_fd) + 1;
+        if ((res = netbios_ns_wait(ns, timeout)) <= 0)
+            return res;
 
-        res = select(nfds, &read_fds, 0, &error_fds, timeout);
-
-        if (res < 0)
-            goto error;
-        if (FD_ISSET(sock, &error_fds))
-            goto error;
-
-#ifdef HAVE_PIPE
-        if (FD_ISSET(abort_fd, &read_fds))
-            return -1;
-#else
-        if (netbios_ns_is_aborted(ns))
+        size = recvfrom(ns->socket, buffer, RECV_BUFFER_SIZE, 0,
+                        (struct sockaddr *)&addr, &addr_len);
+        if (size < 0)
             return -1;
-#endif
 
-        else if (FD_ISSET(sock, &read_fds))
+        if (netbios_ns_handle_query(buffer, (size_t)size,
+                                    addr.sin_addr.s_addr,
+                                    out_name_query) == -1)
         {
-            struct sockaddr_in addr;
-            socklen_t addr_len = sizeof(struct sockaddr_in);
-            ssize_t size;
-
-            size = recvfrom(sock, ns->buffer, RECV_BUFFER_SIZE, 0,
-                           (struct sockaddr *)&addr, &addr_len);
-            if (size < 0)
-                return -1;
-            if (wait_ip != 0 && addr_len >= sizeof(struct sockaddr_in))
-            {
-                // wait for a reply from a specific ip
-                if (wait_ip != addr.sin_addr.s_addr)
-                {
-                    BDSM_dbg("netbios_ns_recv, invalid ip");
-                    continue;
-                }
-            }
-
-            if (netbios_ns_handle_query(ns, (size_t)size, check_trn_id,
-                                        addr.sin_addr.s_addr,
-                                        out_name_query) == -1)
-            {
-                BDSM_dbg("netbios_ns_recv, invalid query\n");
-                continue;
-            }
-
-            if (out_addr)
-                *out_addr = addr;
-            return size;
+            BDSM_dbg("netbios_ns_recv, invalid query\n");
+            continue;
         }
-        else
-            return 0;
-    }
 
-error:
-    BDSM_perror("netbios_ns_recv: ");
-    return -1;
+        if (out_addr)
+            *out_addr = addr;
+        return size;
+    }
 }
 
 static void netbios_ns_copy_name(char *dest, const char *src)
@@ -650,6 +916,13 @@ static netbios_ns_entry *netbios_ns_entry_find(netbios_ns *ns, const char *by_na
     return NULL;
 }
 
+// Entries loaded from the cache file are only used once the host answered
+static bool netbios_ns_entry_current(const netbios_ns_entry *entry)
+{
+    return !(entry->flag & NS_ENTRY_FLAG_CACHED)
+           || entry->flag & NS_ENTRY_FLAG_CHECKED;
+}
+
 static void netbios_ns_entry_clear(netbios_ns *ns)
 {
     netbios_ns_entry  *entry, *entry_next;
@@ -665,6 +938,436 @@ static void netbios_ns_entry_clear(netbios_ns *ns)
     }
 }
 
+static void netbios_ns_deadline(struct timespec *deadline, unsigned int ms)
+{
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_sec  += ms / 1000;
+    deadline->tv_nsec += (ms % 1000) * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L)
+    {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Compute the time left until deadline. Returns false if it has passed.
+static bool netbios_ns_time_left(const struct timespec *deadline,
+                                 struct timeval *timeout)
+{
+    struct timespec now;
+    long long       left_us;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    left_us = (long long)(deadline->tv_sec - now.tv_sec) * 1000000
+              + (deadline->tv_nsec - now.tv_nsec) / 1000;
+    if (left_us <= 0)
+        return false;
+
+    timeout->tv_sec  = left_us / 1000000;
+    timeout->tv_usec = left_us % 1000000;
+    return true;
+}
+
+// Hand a received reply over to the resolver waiting for it, if any.
+// ns->lock must be held. Returns true if the reply was consumed.
+static bool netbios_ns_dispatch_reply(netbios_ns *ns,
+                                      const netbios_ns_name_query *name_query)
+{
+    netbios_ns_pending *pending;
+
+    TAILQ_FOREACH(pending, &ns->pending_queue, next)
+    {
+        size_t i;
+
+        if (pending->done || pending->trn_id != name_query->trn_id)
+            continue;
+        for (i = 0; i < pending->wait_count; i++)
+            if (pending->wait_ips[i] == 0
+                || pending->wait_ips[i] == name_query->src_ip)
+                break;
+        if (pending->wait_count > 0 && i == pending->wait_count)
+            continue;
+
+        // A server that doesn't know the name doesn't mean that the others
+        // don't, wait for all of them. Negative answers to a broadcast
+        // can't be counted, they are ignored.
+        if (name_query->type == NAME_QUERY_TYPE_INVALID)
+        {
+            if (pending->wait_count == 0 || pending->wait_ips[i] == 0)
+                return true;
+            pending->negatives |= 1u << i;
+            if (pending->negatives != (1u << pending->wait_count) - 1)
+                return true;
+        }
+
+        pending->replied_by = pending->wait_count > 0 ? pending->wait_ips[i]
+                                                      : name_query->src_ip;
+        pending->type = name_query->type;
+        pending->ip   = name_query->type == NAME_QUERY_TYPE_NB
+                        ? name_query->u.nb.addr : name_query->src_ip;
+        if (name_query->type == NAME_QUERY_TYPE_NBSTAT)
+        {
+            netbios_ns_copy_name(pending->name, name_query->u.nbstat.name);
+            if (name_query->u.nbstat.group != NULL)
+                netbios_ns_copy_name(pending->group,
+                                     name_query->u.nbstat.group);
+            pending->name_type = name_query->u.nbstat.type;
+        }
+        pending->done = true;
+        pthread_cond_broadcast(&ns->reply_cond);
+        return true;
+    }
+
+    return false;
+}
+
+// Register a query that is about to be sent to the count hosts in ips.
+// ns->lock must be held.
+static void netbios_ns_pending_add(netbios_ns *ns, netbios_ns_pending *pending,
+                                   uint16_t trn_id, const uint32_t *ips,
+                                   size_t count)
+{
+    memset(pending, 0, sizeof(*pending));
+    pending->trn_id     = trn_id;
+    pending->wait_ips   = ips;
+    pending->wait_count = count;
+    TAILQ_INSERT_TAIL(&ns->pending_queue, pending, next);
+}
+
+static int netbios_ns_discover_handle(netbios_ns *ns,
+                                      const netbios_ns_name_query *name_query,
+                                      const struct sockaddr_in *recv_addr);
+
+// Wait until the reply to pending is received or deadline is reached.
+// If nobody else is reading the socket, the caller becomes the receiver
+// and dispatches every reply it gets, including the ones that belong to
+// other resolvers. An attached discovery only reads the socket from
+// netbios_ns_discover_process(), so its answers are handled here too.
+// ns->lock must be held. Returns 1 if the reply was
+// received, 0 on timeout and -1 if the socket couldn't be read or the name
+// service was aborted.
+static int  netbios_ns_pending_wait(netbios_ns *ns, netbios_ns_pending *pending,
+                                    const struct timespec *deadline)
+{
+    while (!pending->done)
+    {
+        if (ns->discover_running || ns->receiving)
+        {
+            if (pthread_cond_timedwait(&ns->reply_cond, &ns->lock,
+                                       deadline) == ETIMEDOUT)
+                break;
+        }
+        else
+        {
+            // The discovery thread may start while we are receiving, don't
+            // share its buffer.
+            uint8_t               buffer[RECV_BUFFER_SIZE];
+            struct timeval        timeout;
+            struct sockaddr_in    recv_addr;
+            netbios_ns_name_query name_query;
+            ssize_t               res;
+            bool                  attached = ns->discover_attached;
+
+            if (!netbios_ns_time_left(deadline, &timeout))
+                break;
+
+            ns->receiving = true;
+            pthread_mutex_unlock(&ns->lock);
+            res = netbios_ns_recv(ns, buffer, &timeout, &recv_addr,
+                                  &name_query);
+            if (res > 0 && attached)
+                netbios_ns_discover_handle(ns, &name_query, &recv_addr);
+            pthread_mutex_lock(&ns->lock);
+            ns->receiving = false;
+
+            if (res > 0 && !attached)
+                netbios_ns_dispatch_reply(ns, &name_query);
+            // Let another waiting resolver take over the socket
+            pthread_cond_broadcast(&ns->reply_cond);
+            if (res < 0 && !pending->done)
+                return -1;
+        }
+    }
+
+    return pending->done ? 1 : 0;
+}
+
+static long netbios_ns_elapsed_us(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000000L
+           + (now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+// Get the round trip time estimator of a destination, recycling the least
+// recently used one if needed. ns->lock must be held.
+static netbios_ns_rtt *netbios_ns_rtt_get(netbios_ns *ns, uint32_t ip)
+{
+    netbios_ns_rtt *rtt = NULL;
+
+    for (int i = 0; i < NS_RTT_SLOTS; i++)
+    {
+        if (ns->rtt[i].used && ns->rtt[i].ip == ip)
+        {
+            rtt = &ns->rtt[i];
+            break;
+        }
+        if (rtt == NULL || !ns->rtt[i].used
+            || (rtt->used && ns->rtt[i].last_use < rtt->last_use))
+            rtt = &ns->rtt[i];
+    }
+    if (!rtt->used || rtt->ip != ip)
+    {
+        memset(rtt, 0, sizeof(*rtt));
+        rtt->ip   = ip;
+        rtt->used = true;
+    }
+    rtt->last_use = ++ns->rtt_clock;
+
+    return rtt;
+}
+
+static long netbios_ns_rtt_rto(const netbios_ns_rtt *rtt)
+{
+    long rto;
+
+    if (!rtt->valid)
+        return NS_RTO_INITIAL;
+
+    rto = rtt->srtt + 4 * rtt->rttvar;
+    if (rto < NS_RTO_MIN)
+        rto = NS_RTO_MIN;
+    if (rto > NS_RTO_MAX)
+        rto = NS_RTO_MAX;
+    return rto;
+}
+
+static void netbios_ns_rtt_update(netbios_ns_rtt *rtt, long sample)
+{
+    if (!rtt->valid)
+    {
+        rtt->srtt   = sample;
+        rtt->rttvar = sample / 2;
+        rtt->valid  = true;
+    }
+    else
+    {
+        long delta = rtt->srtt - sample;
+
+        rtt->rttvar = (3 * rtt->rttvar + (delta < 0 ? -delta : delta)) / 4;
+        rtt->srtt   = (7 * rtt->srtt + sample) / 8;
+    }
+}
+
+// Send a name query to the count hosts in ips (0 to broadcast it) and wait
+// for the first reply, retransmitting it with an exponential backoff until
+// timeout_ms is elapsed. The reply is stored in pending.
+static bool netbios_ns_query(netbios_ns *ns, netbios_ns_pending *pending,
+                             const uint32_t *ips, size_t count,
+                             enum name_query_type type,
+                             const char *name, uint16_t query_flag,
+                             unsigned int timeout_ms)
+{
+    struct timespec     deadline, retransmit, sent_at;
+    unsigned int        sent = 0;
+    uint16_t            trn_id;
+    long                rto = NS_RTO_MAX;
+    int                 res;
+
+    assert(count > 0);
+
+    pthread_mutex_lock(&ns->lock);
+    // Hosts are raced against each other, so start from the fastest one.
+    for (size_t i = 0; i < count; i++)
+    {
+        long host_rto = netbios_ns_rtt_rto(netbios_ns_rtt_get(ns, ips[i]));
+        if (host_rto < rto)
+            rto = host_rto;
+    }
+    trn_id = ++ns->last_trn_id;
+    netbios_ns_pending_add(ns, pending, trn_id, ips, count);
+    pthread_mutex_unlock(&ns->lock);
+
+    netbios_ns_deadline(&deadline, timeout_ms);
+    clock_gettime(CLOCK_MONOTONIC, &sent_at);
+
+    while (true)
+    {
+        bool sent_one = false;
+
+        // Retransmissions keep the same transaction id, so a late reply to
+        // a previous transmission is accepted as well.
+        for (size_t i = 0; i < count; i++)
+            if (netbios_ns_send_name_query(ns, ips[i], type, name, query_flag,
+                                           trn_id) == 0)
+                sent_one = true;
+        if (!sent_one)
+        {
+            pthread_mutex_lock(&ns->lock);
+            break;
+        }
+        sent++;
+
+        netbios_ns_deadline(&retransmit, rto / 1000);
+        if (retransmit.tv_sec > deadline.tv_sec
+            || (retransmit.tv_sec == deadline.tv_sec
+                && retransmit.tv_nsec > deadline.tv_nsec))
+            retransmit = deadline;
+
+        // Sending again won't help if the socket can't be read
+        pthread_mutex_lock(&ns->lock);
+        res = netbios_ns_pending_wait(ns, pending, &retransmit);
+        if (res != 0
+            || (retransmit.tv_sec == deadline.tv_sec
+                && retransmit.tv_nsec == deadline.tv_nsec))
+            break;
+        pthread_mutex_unlock(&ns->lock);
+
+        BDSM_dbg("netbios_ns_query, no reply after %ld ms, retransmitting\n",
+                 rto / 1000);
+        rto = rto * 2 > NS_RTO_MAX ? NS_RTO_MAX : rto * 2;
+    }
+    TAILQ_REMOVE(&ns->pending_queue, pending, next);
+    // Only the replies to an unique transmission are used as samples, since
+    // there is no way to know which transmission a reply belongs to.
+    if (pending->done && sent == 1)
+        netbios_ns_rtt_update(netbios_ns_rtt_get(ns, pending->replied_by),
+                              netbios_ns_elapsed_us(&sent_at));
+    pthread_mutex_unlock(&ns->lock);
+
+    return pending->done;
+}
+
+static int netbios_ns_cache_load(netbios_ns *ns)
+{
+    netbios_ns_cache_header header;
+    netbios_ns_cache_record record;
+    time_t                  now = time(NULL);
+    FILE                    *f;
+
+    if ((f = fopen(ns->cache_path, "rb")) == NULL)
+        return errno == ENOENT ? 0 : -1;
+
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || header.magic != NS_CACHE_MAGIC
+        || header.version != NS_CACHE_VERSION
+        || header.record_size != sizeof(record))
+    {
+        BDSM_dbg("netbios_ns_cache_load, ignoring invalid cache file\n");
+        fclose(f);
+        return -1;
+    }
+
+    pthread_mutex_lock(&ns->lock);
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        netbios_ns_entry *entry;
+
+        if (fread(&record, sizeof(record), 1, f) != 1)
+            break;
+        if (now - (time_t)record.last_time_seen > NS_CACHE_MAX_AGE
+            || netbios_ns_entry_find(ns, NULL, record.ip) != NULL)
+            continue;
+
+        record.name[NETBIOS_NAME_LENGTH] = 0;
+        record.group[NETBIOS_NAME_LENGTH] = 0;
+        if ((entry = netbios_ns_entry_add(ns, record.ip)) == NULL)
+            break;
+        netbios_ns_entry_set_name(entry, record.name,
+                                  record.group[0] ? record.group : NULL,
+                                  record.type);
+        entry->flag |= NS_ENTRY_FLAG_CACHED;
+        entry->last_time_seen = (time_t)record.last_time_seen;
+    }
+    pthread_mutex_unlock(&ns->lock);
+
+    fclose(f);
+    return 0;
+}
+
+static int netbios_ns_cache_save(netbios_ns *ns)
+{
+    netbios_ns_cache_header header;
+    netbios_ns_cache_record *records;
+    netbios_ns_entry        *entry;
+    size_t                  count = 0, tmp_len;
+    char                    *tmp_path;
+    FILE                    *f;
+    int                     ret = -1;
+#ifdef HAVE_MKSTEMP
+    int                     fd;
+#endif
+
+    pthread_mutex_lock(&ns->lock);
+    TAILQ_FOREACH(entry, &ns->entry_queue, next)
+        count++;
+    records = calloc(count ? count : 1, sizeof(*records));
+    if (records == NULL)
+    {
+        pthread_mutex_unlock(&ns->lock);
+        return -1;
+    }
+    count = 0;
+    TAILQ_FOREACH(entry, &ns->entry_queue, next)
+    {
+        if (!(entry->flag & NS_ENTRY_FLAG_VALID_NAME))
+            continue;
+        records[count].last_time_seen = entry->last_time_seen;
+        records[count].ip             = entry->address.s_addr;
+        memcpy(records[count].name, entry->name, sizeof(entry->name));
+        memcpy(records[count].group, entry->group, sizeof(entry->group));
+        records[count].type           = entry->type;
+        count++;
+    }
+    pthread_mutex_unlock(&ns->lock);
+
+    memset(&header, 0, sizeof(header));
+    header.magic       = NS_CACHE_MAGIC;
+    header.version     = NS_CACHE_VERSION;
+    header.record_size = sizeof(*records);
+    header.count       = count;
+
+    // Write a temporary file and rename it, so that concurrent readers never
+    // see a partial cache. Its name is unique, so that concurrent writers
+    // don't write in the same one either.
+    tmp_len = strlen(ns->cache_path) + 8;
+    if ((tmp_path = malloc(tmp_len)) == NULL)
+        goto end;
+#ifdef HAVE_MKSTEMP
+    snprintf(tmp_path, tmp_len, "%s.XXXXXX", ns->cache_path);
+    if ((fd = mkstemp(tmp_path)) == -1)
+        goto end;
+    if ((f = fdopen(fd, "wb")) == NULL)
+    {
+        close(fd);
+        remove(tmp_path);
+        goto end;
+    }
+#else
+    snprintf(tmp_path, tmp_len, "%s.tmp", ns->cache_path);
+    if ((f = fopen(tmp_path, "wb")) == NULL)
+        goto end;
+#endif
+    if (fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(records, sizeof(*records), count, f) == count)
+        ret = 0;
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret == 0 && rename(tmp_path, ns->cache_path) != 0)
+        ret = -1;
+    if (ret == -1)
+        remove(tmp_path);
+
+end:
+    if (ret == -1)
+        BDSM_perror("netbios_ns_cache_save: ");
+    free(tmp_path);
+    free(records);
+    return ret;
+}
+
 netbios_ns  *netbios_ns_new()
 {
     netbios_ns  *ns;
@@ -673,20 +1376,32 @@ netbios_ns  *netbios_ns_new()
     if (!ns)
         return NULL;
 
-#ifdef HAVE_PIPE
+    pthread_mutex_init(&ns->lock, NULL);
+    pthread_cond_init(&ns->reply_cond, NULL);
+    TAILQ_INIT(&ns->entry_queue);
+    TAILQ_INIT(&ns->pending_queue);
+
     // Don't initialize this in ns_open_abort_pipe, as it would lead to
     // fd 0 to be closed (twice) in case of ns_open_socket error
+#if defined(HAVE_SYS_EVENTFD_H)
+    ns->abort_fd = -1;
+#elif defined(HAVE_PIPE)
     ns->abort_pipe[0] = ns->abort_pipe[1] = -1;
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+    ns->epoll_fd = -1;
+#endif
 
-    if (!ns_open_socket(ns) || ns_open_abort_pipe(ns) == -1)
+    if (!ns_open_socket(ns) || ns_open_abort_pipe(ns) == -1
+        || ns_open_epoll(ns) == -1)
     {
         netbios_ns_destroy(ns);
         return NULL;
     }
 
-    TAILQ_INIT(&ns->entry_queue);
-    ns->last_trn_id   = rand();
+    ns->last_trn_id     = rand();
+    ns->resolve_timeout = NS_RESOLVE_TIMEOUT;
+    ns->inverse_timeout = NS_INVERSE_TIMEOUT;
 
     return ns;
 }
@@ -696,57 +1411,214 @@ void          netbios_ns_destroy(netbios_ns *ns)
     if (!ns)
         return;
 
+    if (ns->cache_path != NULL)
+    {
+        netbios_ns_cache_save(ns);
+        free(ns->cache_path);
+    }
+
     netbios_ns_entry_clear(ns);
 
     if (ns->socket != -1)
         closesocket(ns->socket);
 
+    ns_close_epoll(ns);
     ns_close_abort_pipe(ns);
 
+    pthread_cond_destroy(&ns->reply_cond);
+    pthread_mutex_destroy(&ns->lock);
+
     free(ns);
 }
 
+void          netbios_ns_set_timeout(netbios_ns *ns, unsigned int timeout)
+{
+    assert(ns != NULL);
+
+    pthread_mutex_lock(&ns->lock);
+    ns->resolve_timeout = timeout ? timeout : NS_RESOLVE_TIMEOUT;
+    ns->inverse_timeout = timeout ? timeout : NS_INVERSE_TIMEOUT;
+    pthread_mutex_unlock(&ns->lock);
+}
+
+int           netbios_ns_set_cache_file(netbios_ns *ns, const char *path)
+{
+    assert(ns != NULL && path != NULL);
+
+    free(ns->cache_path);
+    if ((ns->cache_path = strdup(path)) == NULL)
+        return -1;
+
+    return netbios_ns_cache_load(ns);
+}
+
+int           netbios_ns_set_wins(netbios_ns *ns, const uint32_t *servers,
+                                  size_t count)
+{
+    assert(ns != NULL && (servers != NULL || count == 0));
+
+    if (count > NETBIOS_NS_WINS_MAX)
+        return -1;
+
+    pthread_mutex_lock(&ns->lock);
+    if (count > 0)
+        memcpy(ns->wins, servers, count * sizeof(*servers));
+    ns->wins_count = count;
+    pthread_mutex_unlock(&ns->lock);
+
+    return 0;
+}
+
+// Ask ip for its names with a NBSTAT query and copy the file server one in
+// name_out (NETBIOS_NAME_LENGTH + 1 long). The entry of ip is updated, or
+// dropped if it came from the cache file and the host doesn't answer.
+static bool netbios_ns_nbstat(netbios_ns *ns, uint32_t ip, unsigned int timeout,
+                              char *name_out)
+{
+    netbios_ns_entry    *entry;
+    netbios_ns_pending  pending;
+
+    if (!netbios_ns_query(ns, &pending, &ip, 1, NAME_QUERY_TYPE_NBSTAT,
+                          name_query_broadcast, 0, timeout)
+        || pending.type != NAME_QUERY_TYPE_NBSTAT)
+    {
+        BDSM_dbg("netbios_ns_nbstat, no name received from '%s'\n",
+                 inet_ntoa(*(struct in_addr *)&ip));
+        pthread_mutex_lock(&ns->lock);
+        entry = netbios_ns_entry_find(ns, NULL, ip);
+        if (entry != NULL && !netbios_ns_entry_current(entry))
+        {
+            TAILQ_REMOVE(&ns->entry_queue, entry, next);
+            free(entry);
+        }
+        pthread_mutex_unlock(&ns->lock);
+        return false;
+    }
+    BDSM_dbg("netbios_ns_nbstat, received a reply for '%s' !\n",
+             inet_ntoa(*(struct in_addr *)&ip));
+
+    // The discovery thread may have added this host in the meantime
+    pthread_mutex_lock(&ns->lock);
+    entry = netbios_ns_entry_find(ns, NULL, ip);
+    if (!entry)
+        entry = netbios_ns_entry_add(ns, ip);
+    if (entry)
+    {
+        netbios_ns_entry_set_name(entry, pending.name,
+                                  pending.group[0] ? pending.group : NULL,
+                                  pending.name_type);
+        entry->flag |= NS_ENTRY_FLAG_CHECKED;
+        entry->last_time_seen = time(NULL);
+    }
+    memcpy(name_out, pending.name, NETBIOS_NAME_LENGTH + 1);
+    pthread_mutex_unlock(&ns->lock);
+    return true;
+}
+
+// Time left out of timeout ms since start
+static unsigned int netbios_ns_ms_left(const struct timespec *start,
+                                       unsigned int timeout)
+{
+    long elapsed_ms = netbios_ns_elapsed_us(start) / 1000;
+
+    return elapsed_ms >= (long)timeout ? 0 : timeout - elapsed_ms;
+}
+
 int      netbios_ns_resolve(netbios_ns *ns, const char *name, char type, uint32_t *addr)
 {
     netbios_ns_entry    *cached;
-    struct timeval      timeout;
+    netbios_ns_pending  pending;
     char                *encoded_name;
-    ssize_t             recv;
-    netbios_ns_name_query name_query;
+    char                found[NETBIOS_NAME_LENGTH + 1];
+    uint32_t            wins[NETBIOS_NS_WINS_MAX];
+    const uint32_t      broadcast = 0;
+    uint32_t            stale_ip = 0;
+    size_t              wins_count;
+    unsigned int        timeout;
+    struct timespec     start;
+    bool                replied;
 
-    assert(ns != NULL && !ns->discover_started);
+    assert(ns != NULL);
 
+    pthread_mutex_lock(&ns->lock);
     if ((cached = netbios_ns_entry_find(ns, name, 0)) != NULL)
     {
-        *addr = cached->address.s_addr;
-        return 0;
+        if (netbios_ns_entry_current(cached))
+        {
+            *addr = cached->address.s_addr;
+            pthread_mutex_unlock(&ns->lock);
+            return 0;
+        }
+        stale_ip = cached->address.s_addr;
+    }
+    wins_count = ns->wins_count;
+    memcpy(wins, ns->wins, wins_count * sizeof(*wins));
+    timeout = ns->resolve_timeout;
+    pthread_mutex_unlock(&ns->lock);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // Entries from the cache file may be outdated (the address may have been
+    // given to another host since), check that the host still has this name
+    if (stale_ip != 0)
+    {
+        if (netbios_ns_nbstat(ns, stale_ip, timeout > 1 ? timeout / 2 : timeout,
+                              found)
+            && !strncmp(name, found, NETBIOS_NAME_LENGTH))
+        {
+            *addr = stale_ip;
+            BDSM_dbg("netbios_ns_resolve, cached '%s' revalidated, ip: 0x%X!\n",
+                     name, *addr);
+            return 0;
+        }
+        if ((timeout = netbios_ns_ms_left(&start, timeout)) == 0)
+            return -1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
     }
 
     if ((encoded_name = netbios_name_encode(name, 0, type)) == NULL)
         return -1;
 
-    if (netbios_ns_send_name_query(ns, 0, NAME_QUERY_TYPE_NB, encoded_name,
-                                   NETBIOS_FLAG_RECURSIVE |
-                                   NETBIOS_FLAG_BROADCAST) == -1)
+    // Ask the WINS servers first, the broadcast is only a fallback. Both
+    // share the deadline, the WINS servers get at most half of it
+    if (wins_count > 0)
     {
-        free(encoded_name);
-        return -1;
+        replied = netbios_ns_query(ns, &pending, wins, wins_count,
+                                   NAME_QUERY_TYPE_NB, encoded_name,
+                                   NETBIOS_FLAG_RECURSIVE,
+                                   timeout > 1 ? timeout / 2 : timeout);
+        if (replied && pending.type == NAME_QUERY_TYPE_NB)
+        {
+            free(encoded_name);
+            *addr = pending.ip;
+            BDSM_dbg("netbios_ns_resolve, WINS server 0x%X resolved '%s', ip: 0x%X!\n",
+                     pending.replied_by, name, *addr);
+            return 0;
+        }
+        BDSM_dbg("netbios_ns_resolve, WINS lookup failed for '%s', broadcasting\n",
+                 name);
 
+        if ((timeout = netbios_ns_ms_left(&start, timeout)) == 0)
+        {
+            free(encoded_name);
+            return -1;
+        }
     }
-    free(encoded_name);
 
-    // Now wait for a reply and pray
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 420;
-    recv = netbios_ns_recv(ns, &timeout, NULL, true, 0, &name_query);
+    // Now send the query, wait for a reply and pray
+    replied = netbios_ns_query(ns, &pending, &broadcast, 1,
+                               NAME_QUERY_TYPE_NB, encoded_name,
+                               NETBIOS_FLAG_RECURSIVE | NETBIOS_FLAG_BROADCAST,
+                               timeout);
+    free(encoded_name);
 
-    if (recv < 0)
-        BDSM_perror("netbios_ns_resolve:");
+    if (!replied)
+        BDSM_dbg("netbios_ns_resolve, no reply received for '%s'\n", name);
     else
     {
-        if (name_query.type == NAME_QUERY_TYPE_NB)
+        if (pending.type == NAME_QUERY_TYPE_NB)
         {
-            *addr = name_query.u.nb.ip;
+            *addr = pending.ip;
             BDSM_dbg("netbios_ns_resolve, received a reply for '%s', ip: 0x%X!\n", name, *addr);
             return 0;
         } else
@@ -756,56 +1628,43 @@ int      netbios_ns_resolve(netbios_ns *ns, const char *name, char type, uint32_
     return -1;
 }
 
-// Perform inverse name resolution. Grap an IP and return the first <20> field
-// returned by the host
-static netbios_ns_entry *netbios_ns_inverse_internal(netbios_ns *ns, uint32_t ip)
+// Perform inverse name resolution. Grap an IP and copy the first <20> field
+// returned by the host in name, which can hold NETBIOS_NAME_LENGTH + 1 bytes:
+// the entries may be freed by the discovery as soon as ns->lock is released
+static bool netbios_ns_inverse_internal(netbios_ns *ns, uint32_t ip,
+                                        char *name)
 {
-    netbios_ns_entry  *cached;
-    struct timeval      timeout;
-    ssize_t             recv;
-    netbios_ns_name_query name_query;
-    netbios_ns_entry *entry;
-
-    if ((cached = netbios_ns_entry_find(ns, NULL, ip)) != NULL)
-        return cached;
-
-    if (netbios_ns_send_name_query(ns, ip, NAME_QUERY_TYPE_NBSTAT,
-                                   name_query_broadcast, 0) == -1)
-        goto error;
+    netbios_ns_entry    *entry;
+    unsigned int        timeout;
 
-    // Now wait for a reply and pray
-    timeout.tv_sec = 1;
-    timeout.tv_usec = 500;
-    recv = netbios_ns_recv(ns, &timeout, NULL, true, ip, &name_query);
-
-    if (recv <= 0)
-        goto error;
+    pthread_mutex_lock(&ns->lock);
+    entry = netbios_ns_entry_find(ns, NULL, ip);
+    if (entry != NULL && entry->flag & NS_ENTRY_FLAG_VALID_NAME
+        && netbios_ns_entry_current(entry))
+    {
+        memcpy(name, entry->name, NETBIOS_NAME_LENGTH + 1);
+        pthread_mutex_unlock(&ns->lock);
+        return true;
+    }
 
-    if (name_query.type != NAME_QUERY_TYPE_NBSTAT)
+    // Now send the query, wait for a reply and pray
+    timeout = ns->inverse_timeout;
+    pthread_mutex_unlock(&ns->lock);
+    if (!netbios_ns_nbstat(ns, ip, timeout, name))
     {
-        BDSM_dbg("netbios_ns_inverse, wrong query type received\n");
-        goto error;
+        BDSM_perror("netbios_ns_inverse: ");
+        return false;
     }
-    else
-        BDSM_dbg("netbios_ns_inverse, received a reply for '%s' !\n",
-                 inet_ntoa(*(struct in_addr *)&ip));
 
-    entry = netbios_ns_entry_add(ns, ip);
-    if (entry)
-        netbios_ns_entry_set_name(entry, name_query.u.nbstat.name,
-                                  name_query.u.nbstat.group,
-                                  name_query.u.nbstat.type);
-    return entry;
-error:
-    BDSM_perror("netbios_ns_inverse: ");
-    return NULL;
+    return true;
 }
 
-const char *netbios_ns_inverse(netbios_ns *ns, uint32_t ip)
+char *netbios_ns_inverse(netbios_ns *ns, uint32_t ip)
 {
-    assert(ns != NULL && ip != 0 && !ns->discover_started);
-    netbios_ns_entry *entry = netbios_ns_inverse_internal(ns, ip);
-    return entry ? entry->name : NULL;
+    char name[NETBIOS_NAME_LENGTH + 1];
+
+    assert(ns != NULL && ip != 0);
+    return netbios_ns_inverse_internal(ns, ip, name) ? strdup(name) : NULL;
 }
 
 const char *netbios_ns_entry_name(netbios_ns_entry *entry)
@@ -828,143 +1687,365 @@ char netbios_ns_entry_type(netbios_ns_entry *entry)
     return entry ? entry->type : -1;
 }
 
-static void *netbios_ns_discover_thread(void *opaque)
+// Ask every entry loaded from the cache file for its names, so that they
+// are revalidated without waiting for them to answer a broadcast.
+static int netbios_ns_discover_revalidate(netbios_ns *ns)
 {
-    netbios_ns *ns = (netbios_ns *) opaque;
-    while (true)
+    netbios_ns_entry  *entry;
+    uint32_t          *ips;
+    size_t            count = 0;
+    int               ret = 0;
+
+    pthread_mutex_lock(&ns->lock);
+    TAILQ_FOREACH(entry, &ns->entry_queue, next)
+        if (entry->flag & NS_ENTRY_FLAG_CACHED)
+            count++;
+    if (count == 0 || (ips = malloc(count * sizeof(*ips))) == NULL)
     {
-        const int remove_timeout = 5 * ns->discover_broadcast_timeout;
-        netbios_ns_entry  *entry, *entry_next;
+        pthread_mutex_unlock(&ns->lock);
+        return 0;
+    }
+    count = 0;
+    TAILQ_FOREACH(entry, &ns->entry_queue, next)
+        if (entry->flag & NS_ENTRY_FLAG_CACHED)
+            ips[count++] = entry->address.s_addr;
+    pthread_mutex_unlock(&ns->lock);
+
+    for (size_t i = 0; i < count && ret == 0; i++)
+        ret = netbios_ns_send_name_query(ns, ips[i], NAME_QUERY_TYPE_NBSTAT,
+                                         name_query_broadcast, 0,
+                                         netbios_ns_next_trn_id(ns));
+    free(ips);
+    return ret;
+}
+
+// Current time in seconds. time() may lag behind the clock the time left
+// before the next broadcast is computed with, by a few milliseconds.
+static time_t netbios_ns_discover_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec;
+}
+
+// Expire the entries that weren't seen for a while and broadcast a new name
+// query, if it's time to.
+static int netbios_ns_discover_timer(netbios_ns *ns)
+{
+    const int remove_timeout = 5 * ns->discover_broadcast_timeout;
+    netbios_ns_entry  *entry, *entry_next;
+    time_t now = netbios_ns_discover_now();
 
-        if (netbios_ns_is_aborted(ns))
-            return NULL;
+    if (ns->discover_next_broadcast == 0)
+    {
+        if (netbios_ns_discover_revalidate(ns) == -1)
+            return -1;
+    }
+    // A 0 timeout means a single broadcast
+    else if (ns->discover_broadcast_timeout == 0
+             || now < ns->discover_next_broadcast)
+        return 0;
 
-        // check if cached entries timeout, the timeout value is 5 times the
-        // broadcast timeout.
-        time_t now = time(NULL);
-        for (entry = TAILQ_FIRST(&ns->entry_queue);
-             entry != NULL; entry = entry_next)
+    // check if cached entries timeout, the timeout value is 5 times the
+    // broadcast timeout. Entries from the cache file have this long to show
+    // up again once the discovery is started.
+    pthread_mutex_lock(&ns->lock);
+    for (entry = TAILQ_FIRST(&ns->entry_queue);
+         entry != NULL; entry = entry_next)
+    {
+        bool cached = entry->flag & NS_ENTRY_FLAG_CACHED;
+        time_t seen = entry->last_time_seen;
+
+        // Unless a lookup revalidated it after the discovery started
+        if (cached && seen < ns->discover_started_at)
+            seen = ns->discover_started_at;
+
+        entry_next = TAILQ_NEXT(entry, next);
+        if (now - seen > remove_timeout)
         {
-            entry_next = TAILQ_NEXT(entry, next);
-            if (now - entry->last_time_seen > remove_timeout)
+            TAILQ_REMOVE(&ns->entry_queue, entry, next);
+            // Cached entries were never reported as added
+            if (entry->flag & NS_ENTRY_FLAG_VALID_NAME && !cached)
             {
-                if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
-                {
-                    BDSM_dbg("Discover: on_entry_removed: %s\n", entry->name);
-                    ns->discover_callbacks.pf_on_entry_removed(
-                            ns->discover_callbacks.p_opaque, entry);
-                }
-                TAILQ_REMOVE(&ns->entry_queue, entry, next);
-                free(entry);
+                BDSM_dbg("Discover: on_entry_removed: %s\n", entry->name);
+                pthread_mutex_unlock(&ns->lock);
+                ns->discover_callbacks.pf_on_entry_removed(
+                        ns->discover_callbacks.p_opaque, entry);
+                pthread_mutex_lock(&ns->lock);
+                // The queue may have changed while unlocked
+                entry_next = TAILQ_FIRST(&ns->entry_queue);
             }
+            free(entry);
         }
+    }
+    pthread_mutex_unlock(&ns->lock);
 
-        // send broadbast
-        if (netbios_ns_send_name_query(ns, 0, NAME_QUERY_TYPE_NB,
-                                       name_query_broadcast, 0) == -1)
-            return NULL;
+    // send broadbast
+    if (netbios_ns_send_name_query(ns, 0, NAME_QUERY_TYPE_NB,
+                                   name_query_broadcast, 0,
+                                   netbios_ns_next_trn_id(ns)) == -1)
+        return -1;
+    ns->discover_next_broadcast = now + ns->discover_broadcast_timeout;
 
-        while (true)
-        {
-            struct timeval      timeout;
-            struct sockaddr_in  recv_addr;
-            int                 res;
-            netbios_ns_name_query name_query;
+    return 0;
+}
 
-            timeout.tv_sec = ns->discover_broadcast_timeout;
-            timeout.tv_usec = 0;
+// Time left before the next broadcast, NULL if there won't be any
+static struct timeval *netbios_ns_discover_timeout(netbios_ns *ns,
+                                                   struct timeval *timeout)
+{
+    struct timespec now;
+    long long       left_us;
 
-            // receive NB or NBSTAT answers
-            res = netbios_ns_recv(ns, ns->discover_broadcast_timeout == 0 ?
-                                  NULL : &timeout,
-                                  &recv_addr,
-                                  false, 0, &name_query);
-            // error or abort
-            if (res == -1)
-                return NULL;
+    if (ns->discover_broadcast_timeout == 0)
+        return NULL;
 
-            // timeout reached, broadcast again
-            if (res == 0)
-                break;
+    // Rounded down to the second, waits shorter than one would be 0
+    clock_gettime(CLOCK_REALTIME, &now);
+    left_us = (long long)(ns->discover_next_broadcast - now.tv_sec) * 1000000
+              - now.tv_nsec / 1000;
+    if (left_us < 0)
+        left_us = 0;
+    timeout->tv_sec  = left_us / 1000000;
+    timeout->tv_usec = left_us % 1000000;
+    return timeout;
+}
 
-            time_t now = time(NULL);
+// Handle a NB or NBSTAT answer
+static int netbios_ns_discover_handle(netbios_ns *ns,
+                                      const netbios_ns_name_query *name_query,
+                                      const struct sockaddr_in *recv_addr)
+{
+    netbios_ns_entry  *entry;
+    time_t            now = time(NULL);
 
-            if (name_query.type == NAME_QUERY_TYPE_NB)
-            {
-                uint32_t ip = name_query.u.nb.ip;
-                entry = netbios_ns_entry_find(ns, NULL, ip);
-
-                if (!entry)
-                {
-                    entry = netbios_ns_entry_add(ns, ip);
-                    if (!entry)
-                        return NULL;
-                }
-                entry->last_time_seen = now;
-
-                // if entry is already valid, don't send NBSTAT query
-                if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
-                    continue;
-
-                // send NBSTAT query
-                if (netbios_ns_send_name_query(ns, ip, NAME_QUERY_TYPE_NBSTAT,
-                                               name_query_broadcast, 0) == -1)
-                    return NULL;
+    pthread_mutex_lock(&ns->lock);
 
-            }
-            else if (name_query.type == NAME_QUERY_TYPE_NBSTAT)
-            {
-                bool send_callback;
+    // A netbios_ns_resolve() or netbios_ns_inverse() call is waiting for
+    // this one.
+    if (netbios_ns_dispatch_reply(ns, name_query))
+    {
+        pthread_mutex_unlock(&ns->lock);
+        return 0;
+    }
 
-                entry = netbios_ns_entry_find(ns, NULL,
-                                              recv_addr.sin_addr.s_addr);
+    if (name_query->type == NAME_QUERY_TYPE_NB)
+    {
+        uint32_t ip = name_query->u.nb.ip;
+        entry = netbios_ns_entry_find(ns, NULL, ip);
 
-                // ignore NBSTAT answers that didn't answered to NB query first.
-                if (!entry)
-                    continue;
+        if (!entry)
+        {
+            entry = netbios_ns_entry_add(ns, ip);
+            if (!entry)
+            {
+                pthread_mutex_unlock(&ns->lock);
+                return -1;
+            }
+        }
+        entry->last_time_seen = now;
 
-                entry->last_time_seen = now;
+        // if entry is already valid, don't send NBSTAT query
+        if (entry->flag & NS_ENTRY_FLAG_VALID_NAME
+            && !(entry->flag & NS_ENTRY_FLAG_CACHED))
+        {
+            pthread_mutex_unlock(&ns->lock);
+            return 0;
+        }
+        pthread_mutex_unlock(&ns->lock);
+
+        // send NBSTAT query
+        if (netbios_ns_send_name_query(ns, ip, NAME_QUERY_TYPE_NBSTAT,
+                                       name_query_broadcast, 0,
+                                       netbios_ns_next_trn_id(ns)) == -1)
+            return -1;
+    }
+    else if (name_query->type == NAME_QUERY_TYPE_NBSTAT)
+    {
+        bool send_callback;
 
-                send_callback = !(entry->flag & NS_ENTRY_FLAG_VALID_NAME);
+        entry = netbios_ns_entry_find(ns, NULL,
+                                      recv_addr->sin_addr.s_addr);
 
-                netbios_ns_entry_set_name(entry, name_query.u.nbstat.name,
-                                          name_query.u.nbstat.group,
-                                          name_query.u.nbstat.type);
-                if (send_callback)
-                    ns->discover_callbacks.pf_on_entry_added(
-                            ns->discover_callbacks.p_opaque, entry);
-            }
+        // ignore NBSTAT answers that didn't answered to NB query first.
+        if (!entry)
+        {
+            pthread_mutex_unlock(&ns->lock);
+            return 0;
         }
-        if (ns->discover_broadcast_timeout == 0)
+
+        entry->last_time_seen = now;
+
+        send_callback = !(entry->flag & NS_ENTRY_FLAG_VALID_NAME)
+                        || entry->flag & NS_ENTRY_FLAG_CACHED;
+        entry->flag &= ~NS_ENTRY_FLAG_CACHED;
+
+        netbios_ns_entry_set_name(entry, name_query->u.nbstat.name,
+                                  name_query->u.nbstat.group,
+                                  name_query->u.nbstat.type);
+        pthread_mutex_unlock(&ns->lock);
+        if (send_callback)
+            ns->discover_callbacks.pf_on_entry_added(
+                    ns->discover_callbacks.p_opaque, entry);
+    }
+    else
+        pthread_mutex_unlock(&ns->lock);
+
+    return 0;
+}
+
+static void *netbios_ns_discover_thread(void *opaque)
+{
+    netbios_ns *ns = (netbios_ns *) opaque;
+
+    while (!netbios_ns_is_aborted(ns))
+    {
+        struct timeval      timeout;
+        struct sockaddr_in  recv_addr;
+        ssize_t             res;
+        netbios_ns_name_query name_query;
+
+        if (netbios_ns_discover_timer(ns) == -1)
+            break;
+
+        // receive NB or NBSTAT answers until the next broadcast
+        res = netbios_ns_recv(ns, ns->buffer,
+                              netbios_ns_discover_timeout(ns, &timeout),
+                              &recv_addr,
+                              &name_query);
+        // error or abort
+        if (res == -1)
+            break;
+
+        if (res > 0
+            && netbios_ns_discover_handle(ns, &name_query, &recv_addr) == -1)
             break;
     }
+
+    // Nobody reads the socket anymore: wake up resolvers, one of them will
+    pthread_mutex_lock(&ns->lock);
+    ns->discover_running = false;
+    pthread_cond_broadcast(&ns->reply_cond);
+    pthread_mutex_unlock(&ns->lock);
     return NULL;
 }
 
-int netbios_ns_discover_start(netbios_ns *ns,
-                              unsigned int broadcast_timeout,
-                              netbios_ns_discover_callbacks *callbacks)
+static int netbios_ns_discover_init(netbios_ns *ns,
+                                    unsigned int broadcast_timeout,
+                                    netbios_ns_discover_callbacks *callbacks,
+                                    bool attached)
 {
     if (ns->discover_started || !callbacks)
         return -1;
 
     ns->discover_callbacks = *callbacks;
     ns->discover_broadcast_timeout = broadcast_timeout;
+    ns->discover_started_at = time(NULL);
+    ns->discover_next_broadcast = 0;
+
+    // Resolvers waiting on the socket will hand it over to the discovery
+    pthread_mutex_lock(&ns->lock);
+    ns->discover_started = true;
+    ns->discover_attached = attached;
+    ns->discover_running = !attached;
+    pthread_mutex_unlock(&ns->lock);
+
+    return 0;
+}
+
+int netbios_ns_discover_start(netbios_ns *ns,
+                              unsigned int broadcast_timeout,
+                              netbios_ns_discover_callbacks *callbacks)
+{
+    if (netbios_ns_discover_init(ns, broadcast_timeout, callbacks,
+                                 false) == -1)
+        return -1;
+
     if (pthread_create(&ns->discover_thread, NULL,
                        netbios_ns_discover_thread, ns) != 0)
+    {
+        pthread_mutex_lock(&ns->lock);
+        ns->discover_started = false;
+        ns->discover_running = false;
+        pthread_cond_broadcast(&ns->reply_cond);
+        pthread_mutex_unlock(&ns->lock);
         return -1;
-    ns->discover_started = true;
+    }
 
     return 0;
 }
 
+int netbios_ns_discover_attach(netbios_ns *ns,
+                               unsigned int broadcast_timeout,
+                               netbios_ns_discover_callbacks *callbacks)
+{
+    return netbios_ns_discover_init(ns, broadcast_timeout, callbacks, true);
+}
+
+int netbios_ns_discover_process(netbios_ns *ns, int *timeout)
+{
+    struct timeval  next;
+
+    if (!ns->discover_attached)
+        return -1;
+
+    if (netbios_ns_discover_timer(ns) == -1)
+        return -1;
+
+    // Handle everything that is already there, without blocking
+    while (true)
+    {
+        struct timeval      now = { 0, 0 };
+        struct sockaddr_in  recv_addr;
+        ssize_t             res;
+        netbios_ns_name_query name_query;
+
+        res = netbios_ns_recv(ns, ns->buffer, &now, &recv_addr, &name_query);
+        if (res == -1)
+            return -1;
+        if (res == 0)
+            break;
+        if (netbios_ns_discover_handle(ns, &name_query, &recv_addr) == -1)
+            return -1;
+    }
+
+    if (timeout != NULL)
+        *timeout = netbios_ns_discover_timeout(ns, &next) != NULL
+                   ? (int)(next.tv_sec * 1000 + (next.tv_usec + 999) / 1000)
+                   : -1;
+    return 0;
+}
+
+int netbios_ns_get_fd(netbios_ns *ns)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    return ns->epoll_fd;
+#else
+    return ns->socket;
+#endif
+}
+
 int netbios_ns_discover_stop(netbios_ns *ns)
 {
     if (ns->discover_started)
     {
-        netbios_ns_abort(ns);
-        pthread_join(ns->discover_thread, NULL);
+        if (!ns->discover_attached)
+        {
+            netbios_ns_abort(ns);
+            pthread_join(ns->discover_thread, NULL);
+            netbios_ns_abort_reset(ns);
+        }
+
+        pthread_mutex_lock(&ns->lock);
         ns->discover_started = false;
+        ns->discover_attached = false;
+        // Wake up resolvers, one of them will now read the socket
+        pthread_cond_broadcast(&ns->reply_cond);
+        pthread_mutex_unlock(&ns->lock);
+
+        if (ns->cache_path != NULL)
+            netbios_ns_cache_save(ns);
 
         return 0;
     }
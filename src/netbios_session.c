@@ -45,6 +45,9 @@
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#ifdef HAVE_SYS_TIME_H
+#include <sys/time.h>
+#endif
 #include <errno.h>
 
 #include "smb_defs.h"
@@ -84,7 +87,7 @@ static int        session_buffer_realloc(netbios_session *s, size_t new_size)
     /* BDSM_dbg("session_buffer_realloc: from %ld bytes to %ld bytes\n", */
     /*          s->packet_payload_size, new_size); */
 
-    new_ptr  = realloc(s->packet, new_size);
+    new_ptr  = realloc(s->packet, sizeof(netbios_session_packet) + new_size);
     if (new_ptr != NULL)
     {
         s->packet_payload_size = new_size;
@@ -229,6 +232,28 @@ int               netbios_session_packet_append(netbios_session *s,
     return 1;
 }
 
+void             *netbios_session_packet_reserve(netbios_session *s,
+                                                 size_t size, size_t *capacity)
+{
+    assert(s && s->packet);
+
+    if (s->packet_payload_size < size)
+        if (!session_buffer_realloc(s, size))
+            return NULL;
+
+    if (capacity != NULL)
+        *capacity = s->packet_payload_size;
+    return s->packet->payload;
+}
+
+void              netbios_session_packet_commit(netbios_session *s, size_t size)
+{
+    assert(s && s->packet && size <= s->packet_payload_size);
+
+    netbios_session_packet_init(s);
+    s->packet_cursor = size;
+}
+
 int               netbios_session_packet_send(netbios_session *s)
 {
     ssize_t         to_send;
@@ -305,6 +330,34 @@ static ssize_t    netbios_session_get_next_packet(netbios_session *s)
     return sofar;
 }
 
+int               netbios_session_wait(netbios_session *s, int timeout)
+{
+    fd_set          read_fds;
+    struct timeval  tv, *ptv = NULL;
+    int             res;
+
+    assert(s != NULL && s->socket >= 0);
+
+    if (timeout >= 0)
+    {
+        tv.tv_sec  = timeout / 1000;
+        tv.tv_usec = (timeout % 1000) * 1000;
+        ptv        = &tv;
+    }
+
+    do
+    {
+        FD_ZERO(&read_fds);
+        FD_SET(s->socket, &read_fds);
+        res = select(s->socket + 1, &read_fds, NULL, NULL, ptv);
+    } while (res < 0 && errno == EINTR);
+
+    if (res < 0)
+        BDSM_perror("netbios_session_wait: ");
+
+    return res;
+}
+
 ssize_t           netbios_session_packet_recv(netbios_session *s, void **data)
 {
     ssize_t         size;
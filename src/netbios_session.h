@@ -75,7 +75,18 @@ int               netbios_session_connect(uint32_t ip,
 void              netbios_session_packet_init(netbios_session *s);
 int               netbios_session_packet_append(netbios_session *s,
         const char *data, size_t size);
+// Get the payload of the packet, to write size bytes in it directly.
+// The packet may move when a larger size is reserved. capacity is set to the
+// actual payload size. Returns NULL on error.
+void             *netbios_session_packet_reserve(netbios_session *s,
+        size_t size, size_t *capacity);
+// Start a new packet whose payload has already been written
+void              netbios_session_packet_commit(netbios_session *s,
+        size_t size);
 int               netbios_session_packet_send(netbios_session *s);
+// Wait up to timeout ms (-1: forever) for data to receive.
+// Returns > 0 if there is, 0 on timeout, -1 on error
+int               netbios_session_wait(netbios_session *s, int timeout);
 ssize_t           netbios_session_packet_recv(netbios_session *s, void **data);
 
 #endif
@@ -0,0 +1,420 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bdsm_debug.h"
+#include "smb_block_cache.h"
+#include "smb_fd.h"
+#include "smb_stat_cache.h"
+
+#define BLOCK_CACHE_FILES   256
+#define BLOCK_CACHE_BUCKETS 1024
+
+typedef struct block_cache_block block_cache_block;
+
+// The cached blocks of a path, valid as long as the file last write time and
+// size are the ones it had when they were read
+typedef struct block_cache_file block_cache_file;
+struct block_cache_file
+{
+    block_cache_file    *next;
+    uint32_t            hash;
+    uint64_t            written;
+    uint64_t            size;
+    size_t              blocks;         // The entry goes with its last block
+    char                key[];          // Normalized '\share\path'
+};
+
+struct block_cache_block
+{
+    block_cache_block   *next;          // In its bucket
+    block_cache_block   *lru_prev;      // More recently used
+    block_cache_block   *lru_next;      // Less recently used
+    block_cache_file    *file;
+    uint64_t            index;          // Offset / SMB_BLOCK_CACHE_BLOCK
+    size_t              len;
+    uint8_t             data[];
+};
+
+struct smb_block_cache
+{
+    size_t              budget;         // In bytes, bookkeeping included
+    size_t              used;
+    uint64_t            hits;
+    uint64_t            misses;
+    block_cache_file    *files[BLOCK_CACHE_FILES];
+    block_cache_block   *buckets[BLOCK_CACHE_BUCKETS];
+    block_cache_block   *lru_head;
+    block_cache_block   *lru_tail;
+};
+
+// FNV-1a
+static uint32_t block_cache_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++)
+        h = (h ^ (uint8_t)*key) * 16777619u;
+    return h;
+}
+
+static size_t block_cache_bucket(const block_cache_file *f, uint64_t index)
+{
+    uint64_t h = (f->hash ^ index) * 0x9e3779b97f4a7c15ull;
+
+    return (h >> 32) % BLOCK_CACHE_BUCKETS;
+}
+
+static char *block_cache_key(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_share   *share;
+
+    if ((share = smb_session_share_get(s, tid)) == NULL || share->name == NULL)
+        return NULL;
+    return smb_stat_cache_key(share->name, path);
+}
+
+static block_cache_file **block_cache_find(smb_block_cache *c,
+                                           const char *key, uint32_t hash)
+{
+    block_cache_file **iter = &c->files[hash % BLOCK_CACHE_FILES];
+
+    while (*iter != NULL && ((*iter)->hash != hash || strcmp((*iter)->key, key)))
+        iter = &(*iter)->next;
+    return iter;
+}
+
+static block_cache_block *block_cache_block_find(smb_block_cache *c,
+                                                 block_cache_file *f,
+                                                 uint64_t index)
+{
+    block_cache_block *b = c->buckets[block_cache_bucket(f, index)];
+
+    while (b != NULL && (b->file != f || b->index != index))
+        b = b->next;
+    return b;
+}
+
+static void block_cache_lru_unlink(smb_block_cache *c, block_cache_block *b)
+{
+    if (b->lru_prev != NULL)
+        b->lru_prev->lru_next = b->lru_next;
+    else
+        c->lru_head = b->lru_next;
+    if (b->lru_next != NULL)
+        b->lru_next->lru_prev = b->lru_prev;
+    else
+        c->lru_tail = b->lru_prev;
+}
+
+static void block_cache_lru_push(smb_block_cache *c, block_cache_block *b)
+{
+    b->lru_prev = NULL;
+    b->lru_next = c->lru_head;
+    if (c->lru_head != NULL)
+        c->lru_head->lru_prev = b;
+    else
+        c->lru_tail = b;
+    c->lru_head = b;
+}
+
+static void block_cache_file_free(smb_block_cache *c, block_cache_file *f)
+{
+    block_cache_file **iter = block_cache_find(c, f->key, f->hash);
+
+    assert(*iter == f);
+    *iter = f->next;
+    c->used -= sizeof(block_cache_file) + strlen(f->key) + 1;
+    free(f);
+}
+
+static void block_cache_remove(smb_block_cache *c, block_cache_block *b)
+{
+    block_cache_block   **iter;
+    block_cache_file    *f = b->file;
+
+    iter = &c->buckets[block_cache_bucket(f, b->index)];
+    while (*iter != b)
+        iter = &(*iter)->next;
+    *iter = b->next;
+
+    block_cache_lru_unlink(c, b);
+    c->used -= sizeof(block_cache_block) + b->len;
+    free(b);
+
+    if (--f->blocks == 0)
+        block_cache_file_free(c, f);
+}
+
+// Drops every block of f, and f with the last one
+static void block_cache_drop(smb_block_cache *c, block_cache_file *f)
+{
+    block_cache_block   *b, *next;
+    size_t              remaining = f->blocks;
+
+    for (b = c->lru_head; remaining > 0; b = next)
+    {
+        next = b->lru_next;
+        if (b->file == f)
+        {
+            remaining--;
+            block_cache_remove(c, b);
+        }
+    }
+}
+
+static void block_cache_clear(smb_block_cache *c)
+{
+    while (c->lru_tail != NULL)
+        block_cache_remove(c, c->lru_tail);
+}
+
+static void block_cache_evict(smb_block_cache *c, size_t need)
+{
+    while (c->lru_tail != NULL && c->used + need > c->budget)
+        block_cache_remove(c, c->lru_tail);
+}
+
+// The entry of the file, if its blocks are still valid. Without an oplock,
+// changes made by others since the file was opened are not seen
+static block_cache_file *block_cache_file_get(smb_session *s,
+                                              smb_block_cache *c,
+                                              const smb_file *file,
+                                              bool create)
+{
+    block_cache_file    *f;
+    char                *key;
+    uint32_t            hash;
+    size_t              key_size;
+
+    if (file->name == NULL
+        || (key = block_cache_key(s, file->tid, file->name)) == NULL)
+        return NULL;
+    hash = block_cache_hash(key);
+
+    f = *block_cache_find(c, key, hash);
+    if (f != NULL && (f->written != file->written || f->size != file->size))
+    {
+        BDSM_dbg("block_cache: %s changed, dropping %zu blocks\n", key,
+                 f->blocks);
+        block_cache_drop(c, f);
+        f = NULL;
+    }
+
+    if (f == NULL && create)
+    {
+        key_size = strlen(key) + 1;
+        if ((f = malloc(sizeof(block_cache_file) + key_size)) != NULL)
+        {
+            memcpy(f->key, key, key_size);
+            f->hash    = hash;
+            f->written = file->written;
+            f->size    = file->size;
+            f->blocks  = 0;
+            f->next    = c->files[hash % BLOCK_CACHE_FILES];
+            c->files[hash % BLOCK_CACHE_FILES] = f;
+            c->used   += sizeof(block_cache_file) + key_size;
+        }
+    }
+
+    free(key);
+    return f;
+}
+
+void            smb_block_cache_destroy(smb_block_cache *c)
+{
+    if (c == NULL)
+        return;
+
+    block_cache_clear(c);
+    free(c);
+}
+
+ssize_t         smb_block_cache_read(smb_session *s, smb_file *file,
+                                     uint64_t offset, void **data)
+{
+    smb_block_cache     *c;
+    block_cache_file    *f;
+    block_cache_block   *b = NULL;
+    size_t              skip;
+
+    assert(s != NULL && file != NULL);
+
+    if ((c = s->block_cache) == NULL)
+        return -1;
+
+    if ((f = block_cache_file_get(s, c, file, false)) != NULL)
+        b = block_cache_block_find(c, f, offset / SMB_BLOCK_CACHE_BLOCK);
+    if (b == NULL)
+    {
+        c->misses++;
+        return -1;
+    }
+    c->hits++;
+
+    block_cache_lru_unlink(c, b);
+    block_cache_lru_push(c, b);
+
+    skip  = offset % SMB_BLOCK_CACHE_BLOCK;
+    skip  = skip < b->len ? skip : b->len;
+    *data = b->data + skip;
+    return b->len - skip;
+}
+
+void            smb_block_cache_store(smb_session *s, smb_file *file,
+                                      uint64_t offset, const void *data,
+                                      size_t len)
+{
+    smb_block_cache     *c;
+    block_cache_file    *f;
+    block_cache_block   *b;
+    uint64_t            index = offset / SMB_BLOCK_CACHE_BLOCK;
+    size_t              need = sizeof(block_cache_block) + len;
+
+    assert(s != NULL && file != NULL);
+    assert(offset % SMB_BLOCK_CACHE_BLOCK == 0);
+
+    if ((c = s->block_cache) == NULL || len > SMB_BLOCK_CACHE_BLOCK
+        || need > c->budget)
+        return;
+    if ((f = block_cache_file_get(s, c, file, true)) == NULL)
+        return;
+
+    // Keep the entry while making room, this block will be counted in it
+    f->blocks++;
+    if ((b = block_cache_block_find(c, f, index)) != NULL)
+        block_cache_remove(c, b);
+    block_cache_evict(c, need);
+
+    if ((b = malloc(need)) == NULL)
+    {
+        if (--f->blocks == 0)
+            block_cache_file_free(c, f);
+        return;
+    }
+    b->file  = f;
+    b->index = index;
+    b->len   = len;
+    memcpy(b->data, data, len);
+
+    b->next = c->buckets[block_cache_bucket(f, index)];
+    c->buckets[block_cache_bucket(f, index)] = b;
+    block_cache_lru_push(c, b);
+    c->used += need;
+}
+
+void            smb_block_cache_invalidate(smb_session *s, smb_tid tid,
+                                           const char *path, bool recursive)
+{
+    smb_block_cache     *c;
+    block_cache_file    *f, *next;
+    char                *key;
+    size_t              key_len;
+
+    assert(s != NULL && path != NULL);
+
+    if ((c = s->block_cache) == NULL || c->lru_head == NULL)
+        return;
+    if ((key = block_cache_key(s, tid, path)) == NULL)
+    {
+        block_cache_clear(c);
+        return;
+    }
+
+    if ((f = *block_cache_find(c, key, block_cache_hash(key))) != NULL)
+        block_cache_drop(c, f);
+
+    key_len = strlen(key);
+    for (size_t i = 0; recursive && i < BLOCK_CACHE_FILES; i++)
+    {
+        for (f = c->files[i]; f != NULL; f = next)
+        {
+            next = f->next;
+            if (!strncmp(f->key, key, key_len) && f->key[key_len] == '\\')
+                block_cache_drop(c, f);
+        }
+    }
+
+    free(key);
+}
+
+int             smb_block_cache_enable(smb_session *s, size_t budget)
+{
+    assert(s != NULL);
+
+    if (budget == 0)
+    {
+        smb_block_cache_destroy(s->block_cache);
+        s->block_cache = NULL;
+        return DSM_SUCCESS;
+    }
+
+    if (s->block_cache == NULL)
+    {
+        s->block_cache = calloc(1, sizeof(smb_block_cache));
+        if (s->block_cache == NULL)
+            return DSM_ERROR_GENERIC;
+    }
+    s->block_cache->budget = budget;
+    block_cache_evict(s->block_cache, 0);
+
+    return DSM_SUCCESS;
+}
+
+void            smb_block_cache_flush(smb_session *s)
+{
+    assert(s != NULL);
+
+    if (s->block_cache != NULL)
+        block_cache_clear(s->block_cache);
+}
+
+void            smb_block_cache_counters(smb_session *s, uint64_t *hits,
+                                         uint64_t *misses, size_t *used)
+{
+    smb_block_cache *c;
+
+    assert(s != NULL);
+
+    c = s->block_cache;
+    if (hits != NULL)
+        *hits = c ? c->hits : 0;
+    if (misses != NULL)
+        *misses = c ? c->misses : 0;
+    if (used != NULL)
+        *used = c ? c->used : 0;
+}
@@ -0,0 +1,68 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @internal
+ * @file smb_block_cache.h
+ * @brief Per-session cache of file data, used by smb_fread()
+ */
+
+#ifndef _SMB_BLOCK_CACHE_H_
+#define _SMB_BLOCK_CACHE_H_
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "smb_types.h"
+
+// Data is cached by aligned blocks of that size, each read in one request
+#define SMB_BLOCK_CACHE_BLOCK   0xf000
+
+typedef struct smb_block_cache smb_block_cache;
+
+void            smb_block_cache_destroy(smb_block_cache *c);
+
+// Points data to what the cache holds of file at offset, valid until the
+// next call. Returns the number of bytes up to the end of the block (0 at the
+// end of the file) or -1 if the block is not cached
+ssize_t         smb_block_cache_read(smb_session *s, smb_file *file,
+                                     uint64_t offset, void **data);
+// Stores the data read from the block of file starting at offset, which must
+// be a multiple of SMB_BLOCK_CACHE_BLOCK. Less than a block means the end of
+// the file
+void            smb_block_cache_store(smb_session *s, smb_file *file,
+                                      uint64_t offset, const void *data,
+                                      size_t len);
+// Drops the blocks of path. If recursive is true, the ones of every file
+// below path are dropped as well
+void            smb_block_cache_invalidate(smb_session *s, smb_tid tid,
+                                           const char *path, bool recursive);
+
+#endif
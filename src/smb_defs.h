@@ -78,7 +78,7 @@
 //#define SMB_CMD_CHECK_DIRECTORY 0x10
 /* 0x11 - 0x1F are all obsolescent, deprecated or obsolete */
 /* 0x10 - 0x23 are deprecated */
-//#define SMB_CMD_LOCKING         0x24 // Locking AndX
+#define SMB_CMD_LOCKING         0x24 // Locking AndX
 #define SMD_CMD_TRANS           0x25
 //#define SMD_CMD_TRANS_SECONDARY 0x26
 /* 0x27 - 0x2A are all obsolescent, deprecated or obsolete */
@@ -100,10 +100,10 @@
 #define SMB_CMD_TREE_CONNECT    0x75 // Tree Connect AndX
 /* 0x76 - 0x7D are unused, 0x7E is obsolete, 0x7F is unused */
 /* 0x8* - 0x9* are  deprecated or unused */
-//#define SMB_CMD_NT_TRANSACT     0xA0
+#define SMB_CMD_NT_TRANSACT     0xA0
 //#define SMB_CMD_NT_TRANSACT_SECONDARY     0xA1
 #define SMB_CMD_CREATE          0xA2 // NT Create AndX
-//#define SMB_CMD_CANCEL          0xA4
+#define SMB_CMD_CANCEL          0xA4 // NT Cancel
 /* 0xA3 is unused, 0xA5 is obsolete, 0xA6 - 0xBF are unused */
 //#define SMB_CMD_PRINT_FILE      0xC0
 /* 0xC1 - 0xFD are all obsolete or deprecated */
@@ -122,8 +122,14 @@
 #define SMB_TR2_FIND_FIRST        0x0001
 #define SMB_TR2_FIND_NEXT         0x0002
 #define SMB_TR2_QUERY_PATH        0x0005
+#define SMB_TR2_SET_FILE          0x0008
 #define SMB_TR2_CREATE_DIRECTORY  0x000d
 
+//-----------------------------------------------------------------------------/
+// SMB NT_TRANSACT SubCommands
+//-----------------------------------------------------------------------------/
+#define SMB_NT_TRANS_NOTIFY_CHANGE  0x0004
+
 
 //-----------------------------------------------------------------------------/
 // SMB TRANS2 FIND interest values
@@ -146,6 +152,12 @@
 #define SMB_FIND2_QUERY_FILE_STREAM_INFO      0x0109
 #define SMB_FIND2_QUERY_FILE_COMPRESSION_INFO 0x010B
 
+//-----------------------------------------------------------------------------/
+// SMB TRANS2 SET_FILE interest values
+//-----------------------------------------------------------------------------/
+#define SMB_TR2_SET_FILE_ALLOCATION_INFO      0x0103
+#define SMB_TR2_SET_FILE_END_OF_FILE_INFO     0x0104
+
 //-----------------------------------------------------------------------------/
 // SMB CMD CREATE Impersonation level values
 //-----------------------------------------------------------------------------/
@@ -188,6 +200,7 @@
 #define SMB_CAPS_NTSMB          (1 << 4)
 #define SMB_CAPS_RPC            (1 << 5)
 #define SMB_CAPS_NTFIND         (1 << 9)
+#define SMB_CAPS_LARGE_READX    (1 << 14)
 #define SMB_CAPS_XSEC           (1 << 31)
 
 // File creation/open flags
@@ -197,15 +210,6 @@
 #define SMB_CREATE_EXT_RESP     (1 << 4)
 #define SMB_CREATE_DEFAULTS     (0)
 
-// File attributes
-#define SMB_ATTR_NORMAL         0
-#define SMB_ATTR_RO             (1 << 0)
-#define SMB_ATTR_HIDDEN         (1 << 1)
-#define SMB_ATTR_SYS            (1 << 2)
-#define SMB_ATTR_VOLID          (1 << 3)  // Volume ID
-#define SMB_ATTR_DIR            (1 << 4)
-#define SMB_ATTR_ARCHIVE        (1 << 5)  // Modified since last archive (!?)
-
 // Share access flags
 #define SMB_SHARE_READ          (1 << 0)
 #define SMB_SHARE_WRITE         (1 << 1)
@@ -219,26 +223,12 @@
 #define SMB_DISPOSITION_FILE_OVERWRITE      (1 << 3)
 #define SMB_DISPOSITION_FILE_OVERWRITE_IF   (1 << 4)
 
-// Create options flags
-#define SMB_CREATEOPT_DIRECTORY_FILE             (1 << 0)
-#define SMB_CREATEOPT_WRITE_THROUGH              (1 << 1)
-#define SMB_CREATEOPT_SEQUENTIAL_ONLY            (1 << 2)
-#define SMB_CREATEOPT_NO_INTERMEDIATE_BUFFERING  (1 << 3)
-#define SMB_CREATEOPT_SYNCHRONOUS_IO_ALERT       (1 << 3)
-#define SMB_CREATEOPT_SYNCHRONOUS_IO_NONALERTIF  (1 << 4)
-#define SMB_CREATEOPT_NON_DIRECTORY_FILE         (1 << 5)
-#define SMB_CREATEOPT_CREATE_TREE_CONNECTION     (1 << 6)
-#define SMB_CREATEOPT_COMPLETE_IF_OPLOCKED       (1 << 7)
-#define SMB_CREATEOPT_NO_EA_KNOWLEDGE            (1 << 8)
-#define SMB_CREATEOPT_OPEN_FOR_RECOVERY          (1 << 9)
-#define SMB_CREATEOPT_RANDOM_ACCESS              (1 << 10)
-#define SMB_CREATEOPT_DELETE_ON_CLOSE            (1 << 11)
-#define SMB_CREATEOPT_OPEN_BY_FILE_ID            (1 << 12)
-#define SMB_CREATEOPT_OPEN_FOR_BACKUP_INTENT     (1 << 13)
-#define SMB_CREATEOPT_NO_COMPRESSION             (1 << 14)
-#define SMB_CREATEOPT_RESERVE_OPFILTER           (1 << 15)
-#define SMB_CREATEOPT_OPEN_NO_RECALL             (1 << 16)
-#define SMB_CREATEOPT_OPEN_FOR_FREE_SPACE_QUERY  (1 << 17)
+// Locking AndX type flags
+#define SMB_LOCKING_SHARED          (1 << 0)
+#define SMB_LOCKING_OPLOCK_RELEASE  (1 << 1)
+
+// Mux id of the oplock breaks sent by the server
+#define SMB_OPLOCK_BREAK_MUX        0xffff
 
 // Security flags
 #define SMB_SECURITY_NO_TRACKING            0
@@ -42,27 +42,28 @@
 #include "smb_fd.h"
 #include "smb_utils.h"
 #include "smb_dir.h"
+#include "smb_file.h"
+#include "smb_stat.h"
+#include "smb_stat_cache.h"
 #include "bdsm_debug.h"
 
-int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
+smb_message *smb_directory_rm_msg(smb_session *s, smb_tid tid,
+                                  const char *path)
 {
-    smb_message           *req_msg, resp_msg;
+    smb_message           *req_msg;
     smb_directory_rm_req  req;
-    smb_directory_rm_resp *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
 
-    assert(s != NULL && path != NULL);
-
     utf_pattern_len = smb_to_utf16(path, strlen(path) + 1, &utf_pattern);
     if (utf_pattern_len == 0)
-        return DSM_ERROR_CHARSET;
+        return NULL;
 
-    req_msg = smb_message_new(SMB_CMD_RMDIR);
+    req_msg = smb_message_new(s, SMB_CMD_RMDIR);
     if (!req_msg)
     {
         free(utf_pattern);
-        return DSM_ERROR_GENERIC;
+        return NULL;
     }
 
     req_msg->packet->header.tid = (uint16_t)tid;
@@ -74,10 +75,24 @@ int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
     SMB_MSG_PUT_PKT(req_msg, req);
     smb_message_append(req_msg, utf_pattern, utf_pattern_len);
 
+    free(utf_pattern);
+    return req_msg;
+}
+
+int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_message           *req_msg, resp_msg;
+    smb_directory_rm_resp *resp;
+
+    assert(s != NULL && path != NULL);
+
+    req_msg = smb_directory_rm_msg(s, tid, path);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
-
-    free(utf_pattern);
+    smb_stat_cache_invalidate(s, tid, path, true);
 
     if (!smb_session_recv_msg(s, &resp_msg))
         return DSM_ERROR_NETWORK;
@@ -98,6 +113,152 @@ int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
     return DSM_SUCCESS;
 }
 
+int smb_directory_rm_many(smb_session *s, smb_tid tid,
+                          const char *const *paths, size_t count,
+                          uint32_t *status)
+{
+    smb_file_bulk   bulk;
+
+    assert(s != NULL && (paths != NULL || count == 0));
+
+    bulk.cmd        = SMB_CMD_RMDIR;
+    bulk.tid        = tid;
+    bulk.paths      = paths;
+    bulk.new_paths  = NULL;
+    bulk.status     = status;
+
+    return smb_file_bulk_run(s, &bulk, count);
+}
+
+typedef struct
+{
+    char        **paths;
+    size_t      count;
+    size_t      size;
+} rm_tree_vec;
+
+static bool rm_tree_push(rm_tree_vec *v, const char *dir, const char *name)
+{
+    char        **paths;
+    size_t      len;
+
+    if (v->count == v->size)
+    {
+        v->size = v->size ? v->size * 2 : 64;
+        if ((paths = realloc(v->paths, v->size * sizeof(*paths))) == NULL)
+            return false;
+        v->paths = paths;
+    }
+
+    len = strlen(dir) + strlen(name) + 2;
+    if ((v->paths[v->count] = malloc(len)) == NULL)
+        return false;
+    snprintf(v->paths[v->count++], len, "%s\\%s", dir, name);
+
+    return true;
+}
+
+static void rm_tree_clear(rm_tree_vec *v)
+{
+    for (size_t i = 0; i < v->count; i++)
+        free(v->paths[i]);
+    free(v->paths);
+}
+
+// Empties 'path'. Only one listing is held at a time: the files of a
+// directory are deleted, then its subdirectories are emptied and deleted
+static int rm_tree_empty(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_stat_list   list;
+    smb_stat        st;
+    rm_tree_vec     files = { NULL, 0, 0 }, dirs = { NULL, 0, 0 };
+    rm_tree_vec     links = { NULL, 0, 0 }, *vec;
+    char            *pattern;
+    size_t          len;
+    int             res = DSM_SUCCESS, sub;
+
+    len = strlen(path) + 3;
+    if ((pattern = malloc(len)) == NULL)
+        return DSM_ERROR_GENERIC;
+    snprintf(pattern, len, "%s\\*", path);
+    list = smb_find_info(s, tid, pattern, SMB_FIND_INFO_DIRECTORY);
+    free(pattern);
+
+    // Even an empty directory lists '.' and '..'
+    if (list == NULL)
+    {
+        BDSM_dbg("smb_directory_rm_tree: Unable to list %s\n", path);
+        return DSM_ERROR_NT;
+    }
+
+    for (st = list; st != NULL; st = smb_stat_list_next(st))
+    {
+        const char *name = smb_stat_name(st);
+
+        if (name == NULL || !strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        // A reparse point (junction, symlink) is removed without touching
+        // its target: it is not listed, as it could loop back to a parent
+        if (!smb_stat_get(st, SMB_STAT_ISDIR))
+            vec = &files;
+        else if (st->attr & SMB_ATTR_REPARSE_POINT)
+            vec = &links;
+        else
+            vec = &dirs;
+        if (!rm_tree_push(vec, path, name))
+        {
+            res = DSM_ERROR_GENERIC;
+            break;
+        }
+    }
+    smb_stat_list_destroy(list);
+
+    if (res == DSM_SUCCESS)
+        res = smb_file_rm_many(s, tid, (const char *const *)files.paths,
+                               files.count, NULL);
+    rm_tree_clear(&files);
+
+    for (size_t i = 0; i < dirs.count && res != DSM_ERROR_NETWORK; i++)
+    {
+        sub = rm_tree_empty(s, tid, dirs.paths[i]);
+        if (sub != DSM_SUCCESS)
+            res = sub;
+    }
+    if (res != DSM_ERROR_NETWORK && res != DSM_ERROR_GENERIC)
+    {
+        sub = smb_directory_rm_many(s, tid, (const char *const *)dirs.paths,
+                                    dirs.count, NULL);
+        if (sub != DSM_SUCCESS)
+            res = sub;
+    }
+    rm_tree_clear(&dirs);
+
+    if (res != DSM_ERROR_NETWORK && res != DSM_ERROR_GENERIC)
+    {
+        sub = smb_directory_rm_many(s, tid, (const char *const *)links.paths,
+                                    links.count, NULL);
+        if (sub != DSM_SUCCESS)
+            res = sub;
+    }
+    rm_tree_clear(&links);
+
+    return res;
+}
+
+int smb_directory_rm_tree(smb_session *s, smb_tid tid, const char *path)
+{
+    int     res, sub;
+
+    assert(s != NULL && path != NULL);
+
+    res = rm_tree_empty(s, tid, path);
+    if (res == DSM_ERROR_NETWORK || res == DSM_ERROR_GENERIC)
+        return res;
+
+    sub = smb_directory_rm(s, tid, path);
+    return res != DSM_SUCCESS ? res : sub;
+}
+
 int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
 {
     smb_message           *req_msg, resp_msg;
@@ -112,7 +273,7 @@ int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
     if (utf_pattern_len == 0)
         return DSM_ERROR_CHARSET;
 
-    req_msg = smb_message_new(SMB_CMD_MKDIR);
+    req_msg = smb_message_new(s, SMB_CMD_MKDIR);
     if (!req_msg)
     {
         free(utf_pattern);
@@ -130,6 +291,7 @@ int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
 
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
+    smb_stat_cache_invalidate(s, tid, path, false);
 
     free(utf_pattern);
 
@@ -37,5 +37,10 @@
 #define _SMB_DIR_H_
 
 #include "bdsm/smb_dir.h"
+#include "smb_types.h"
+
+// Builds a RMDIR request for 'path', ready to be sent
+smb_message     *smb_directory_rm_msg(smb_session *s, smb_tid tid,
+                                      const char *path);
 
 #endif
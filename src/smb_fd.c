@@ -35,6 +35,7 @@
 #include <assert.h>
 
 #include "smb_fd.h"
+#include "smb_stat_cache.h"
 
 void        smb_session_share_add(smb_session *s, smb_share *share)
 {
@@ -42,6 +43,12 @@ void        smb_session_share_add(smb_session *s, smb_share *share)
 
     assert(s != NULL && share != NULL);
 
+    // The server may hand out again, after a reconnection, a tid the user
+    // still knows as another share's
+    share->tid = share->srv_tid;
+    while (smb_session_share_get(s, share->tid) != NULL)
+        share->tid++;
+
     if (s->shares == NULL)
     {
         s->shares = share;
@@ -117,6 +124,8 @@ void            smb_session_share_clear(smb_session *s)
 
         tmp = iter;
         iter = iter->next;
+        smb_stat_cache_destroy(tmp->stat_cache);
+        free(tmp->name);
         free(tmp);
     }
 }
@@ -131,6 +140,19 @@ int         smb_session_file_add(smb_session *s, smb_tid tid, smb_file *f)
     if ((share = smb_session_share_get(s, tid)) == NULL)
         return 0;
 
+    // Same as tids in smb_session_share_add()
+    f->fid = f->srv_fid;
+    for (iter = share->files; iter != NULL; )
+    {
+        if (iter->fid == f->fid)
+        {
+            f->fid++;
+            iter = share->files;
+        }
+        else
+            iter = iter->next;
+    }
+
     if (share->files == NULL)
         share->files = f;
     else
@@ -192,3 +214,45 @@ smb_file  *smb_session_file_remove(smb_session *s, smb_fd fd)
     else
         return NULL;
 }
+
+smb_file  *smb_session_file_find_srv(smb_session *s, smb_tid srv_tid,
+                                     smb_fid srv_fid)
+{
+    smb_share *share;
+    smb_file  *iter;
+
+    assert(s != NULL);
+
+    for (share = s->shares; share != NULL; share = share->next)
+    {
+        if (share->srv_tid != srv_tid)
+            continue;
+        for (iter = share->files; iter != NULL; iter = iter->next)
+            if (iter->srv_fid == srv_fid)
+                return iter;
+    }
+
+    return NULL;
+}
+
+smb_tid     smb_session_srv_tid(smb_session *s, smb_tid tid)
+{
+    smb_share *share;
+
+    assert(s != NULL);
+
+    if ((share = smb_session_share_get(s, tid)) == NULL)
+        return tid;
+
+    return share->srv_tid;
+}
+
+smb_fid     smb_session_srv_fid(smb_session *s, smb_fd fd)
+{
+    smb_file  *file;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return SMB_FD_FID(fd);
+
+    return file->srv_fid;
+}
@@ -38,9 +38,16 @@ void            smb_session_share_add(smb_session *s, smb_share *share);
 smb_share       *smb_session_share_get(smb_session *s, smb_tid tid);
 smb_share       *smb_session_share_remove(smb_session *s, smb_tid tid);
 void            smb_session_share_clear(smb_session *s);
+// The tid the server knows a share as, which changes on reconnection
+smb_tid         smb_session_srv_tid(smb_session *s, smb_tid tid);
 
 int             smb_session_file_add(smb_session *s, smb_tid tid, smb_file *f);
 smb_file        *smb_session_file_get(smb_session *s, smb_fd fd);
 smb_file        *smb_session_file_remove(smb_session *s, smb_fd fd);
+// The fid the server knows a file as, which changes on reconnection
+smb_fid         smb_session_srv_fid(smb_session *s, smb_fd fd);
+// The file the server knows by these ids, as in its unsolicited messages
+smb_file        *smb_session_file_find_srv(smb_session *s, smb_tid srv_tid,
+                                           smb_fid srv_fid);
 
 #endif
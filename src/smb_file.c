@@ -41,14 +41,60 @@
 #include "smb_session_msg.h"
 #include "smb_fd.h"
 #include "smb_utils.h"
+#include "smb_dir.h"
 #include "smb_file.h"
+#include "smb_block_cache.h"
+#include "smb_hash.h"
+#include "smb_stat_cache.h"
 #include "bdsm_debug.h"
 
 int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
                       uint32_t o_flags, smb_fd *fd)
 {
-    smb_share       *share;
-    smb_file        *file;
+    return smb_fopen_ex(s, tid, path, o_flags, NULL, fd);
+}
+
+int         smb_fopen_ex(smb_session *s, smb_tid tid, const char *path,
+                         uint32_t o_flags, const smb_fopen_opts *opts,
+                         smb_fd *fd)
+{
+    smb_fopen_opts  options;
+
+    assert(s != NULL && path != NULL && fd != NULL);
+
+    if (opts != NULL)
+        options = *opts;
+    else
+        memset(&options, 0, sizeof(options));
+    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW && !options.no_write_through)
+        options.create_opts |= SMB_CREATEOPT_WRITE_THROUGH;
+    opts = &options;
+
+    // The server refuses it without the right to delete
+    if (opts->create_opts & SMB_CREATEOPT_DELETE_ON_CLOSE)
+        o_flags |= SMB_MOD_RM;
+
+    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
+        // Create if doesn't exist
+        return smb_file_open(s, tid, path, o_flags,
+                             SMB_DISPOSITION_FILE_SUPERSEDE, opts, fd);
+
+    if (smb_stat_cache_absent(s, tid, path))
+    {
+        s->nt_status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+        return DSM_ERROR_NT;
+    }
+
+    // Open and fails if doesn't exist
+    return smb_file_open(s, tid, path, o_flags, SMB_DISPOSITION_FILE_OPEN,
+                         opts, fd);
+}
+
+// Sends the NT Create AndX and fills the server side fid and attributes of
+// 'file'. Its alloc_size and attr are used if the file gets created
+static int  smb_file_create(smb_session *s, smb_tid tid, const char *path,
+                            uint32_t disposition, smb_file *file)
+{
     smb_message     *req_msg, resp_msg;
     smb_create_req req;
     smb_create_resp *resp;
@@ -56,16 +102,11 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     int              res;
     char            *utf_path;
 
-    assert(s != NULL && path != NULL && fd != NULL);
-
-    if ((share = smb_session_share_get(s, tid)) == NULL)
-        return DSM_ERROR_GENERIC;
-
     path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
     if (path_len == 0)
         return DSM_ERROR_CHARSET;
 
-    req_msg = smb_message_new(SMB_CMD_CREATE);
+    req_msg = smb_message_new(s, SMB_CMD_CREATE);
     if (!req_msg) {
         free(utf_path);
         return DSM_ERROR_GENERIC;
@@ -78,21 +119,17 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     SMB_MSG_INIT_PKT_ANDX(req);
     req.wct            = 24;
     req.flags          = 0;
+    if (file->oplock_req == SMB_OPLOCK_EXCLUSIVE)
+        req.flags      = SMB_CREATE_OPLOCK;
+    else if (file->oplock_req == SMB_OPLOCK_BATCH)
+        req.flags      = SMB_CREATE_OPLOCK | SMB_CREATE_BATCH_OPLOCK;
     req.root_fid       = 0;
-    req.access_mask    = o_flags;
-    req.alloc_size     = 0;
-    req.file_attr      = 0;
+    req.access_mask    = file->access;
+    req.alloc_size     = file->alloc_size;
+    req.file_attr      = file->attr;
     req.share_access   = SMB_SHARE_READ | SMB_SHARE_WRITE;
-    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
-    {
-        req.disposition    = SMB_DISPOSITION_FILE_SUPERSEDE; // Create if doesn't exist
-        req.create_opts    = SMB_CREATEOPT_WRITE_THROUGH;
-    }
-    else
-    {
-        req.disposition    = SMB_DISPOSITION_FILE_OPEN;  // Open and fails if doesn't exist
-        req.create_opts    = 0;                          // We dont't support create
-    }
+    req.disposition    = disposition;
+    req.create_opts    = file->create_opts;
     req.impersonation  = SMB_IMPERSONATION_SEC_IMPERSONATE;
     req.security_flags = SMB_SECURITY_NO_TRACKING;
     req.path_length    = path_len;
@@ -111,6 +148,10 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     if (!res)
         return DSM_ERROR_NETWORK;
 
+    // Anything but a plain open may create or truncate the file
+    if (disposition != SMB_DISPOSITION_FILE_OPEN)
+        smb_stat_cache_invalidate(s, tid, path, false);
+
     if (!smb_session_recv_msg(s, &resp_msg))
         return DSM_ERROR_NETWORK;
     if (!smb_session_check_nt_status(s, &resp_msg))
@@ -123,13 +164,8 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     }
 
     resp = (smb_create_resp *)resp_msg.packet->payload;
-    file = calloc(1, sizeof(smb_file));
-    if (!file)
-        return DSM_ERROR_GENERIC;
-
 
-    file->fid           = resp->fid;
-    file->tid           = tid;
+    file->srv_fid       = resp->fid;
     file->created       = resp->created;
     file->accessed      = resp->accessed;
     file->written       = resp->written;
@@ -138,6 +174,43 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     file->size          = resp->size;
     file->attr          = resp->attr;
     file->is_dir        = resp->is_dir;
+    file->oplock        = resp->oplock_level;
+
+    return DSM_SUCCESS;
+}
+
+int         smb_file_open(smb_session *s, smb_tid tid, const char *path,
+                          uint32_t access, uint32_t disposition,
+                          const smb_fopen_opts *opts, smb_fd *fd)
+{
+    smb_file        *file;
+    int              res;
+
+    assert(s != NULL && path != NULL && opts != NULL && fd != NULL);
+
+    if (smb_session_share_get(s, tid) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    file = calloc(1, sizeof(smb_file));
+    if (!file)
+        return DSM_ERROR_GENERIC;
+    file->tid           = tid;
+    file->access        = access;
+    file->create_opts   = opts->create_opts;
+    file->alloc_size    = opts->alloc_size;
+    file->attr          = opts->attributes;
+    file->oplock_req    = opts->oplock;
+
+    if ((res = smb_file_create(s, tid, path, disposition, file)) != DSM_SUCCESS)
+    {
+        free(file);
+        return res;
+    }
+
+    // Keep the path, to invalidate the cached attributes on write and to
+    // open it again after a reconnection
+    file->name          = strdup(path);
+    file->name_len      = strlen(path);
 
     smb_session_file_add(s, tid, file); // XXX Check return
 
@@ -145,6 +218,18 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
     return DSM_SUCCESS;
 }
 
+int         smb_file_reopen(smb_session *s, smb_file *file)
+{
+    assert(s != NULL && file != NULL);
+
+    if (file->name == NULL)
+        return DSM_ERROR_GENERIC;
+
+    // Never truncate nor create it again
+    return smb_file_create(s, file->tid, file->name,
+                           SMB_DISPOSITION_FILE_OPEN, file);
+}
+
 void        smb_fclose(smb_session *s, smb_fd fd)
 {
     smb_file        *file;
@@ -159,7 +244,7 @@ void        smb_fclose(smb_session *s, smb_fd fd)
     if ((file = smb_session_file_remove(s, fd)) == NULL)
         return;
 
-    msg = smb_message_new(SMB_CMD_CLOSE);
+    msg = smb_message_new(s, SMB_CMD_CLOSE);
     if (!msg) {
         free(file->name);
         free(file);
@@ -170,7 +255,7 @@ void        smb_fclose(smb_session *s, smb_fd fd)
 
     SMB_MSG_INIT_PKT(req);
     req.wct        = 3;
-    req.fid        = SMB_FD_FID(fd);
+    req.fid        = file->srv_fid;
     req.last_write = ~0;
     req.bct        = 0;
     SMB_MSG_PUT_PKT(msg, req);
@@ -178,20 +263,72 @@ void        smb_fclose(smb_session *s, smb_fd fd)
     // We don't check for succes or failure, since we actually don't really
     // care about creating a potentiel leak server side.
     smb_session_send_msg(s, msg);
-    smb_session_recv_msg(s, 0);
     smb_message_destroy(msg);
+    // The server deletes it now, drop what we know of it
+    if (file->create_opts & SMB_CREATEOPT_DELETE_ON_CLOSE)
+        smb_stat_cache_invalidate(s, file->tid, file->name, false);
+    smb_session_recv_msg(s, 0);
 
     free(file->name);
     free(file);
 }
 
-ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+smb_message *smb_file_read_msg(smb_session *s, smb_file *file,
+                               uint64_t offset, size_t size)
 {
-    smb_file        *file;
-    smb_message     *req_msg, resp_msg;
+    smb_message     *req_msg;
     smb_read_req    req;
+
+    req_msg = smb_message_new(s, SMB_CMD_READ);
+    if (!req_msg)
+        return NULL;
+    req_msg->packet->header.tid = file->tid;
+
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct              = 12;
+    req.fid              = file->srv_fid;
+    req.offset           = offset & 0xffffffff;
+    req.max_count        = size & 0xffff;
+    req.min_count        = size & 0xffff;
+    req.max_count_high   = size >> 16;
+    req.remaining        = 0;
+    req.offset_high      = (offset >> 32) & 0xffffffff;
+    req.bct              = 0;
+    SMB_MSG_PUT_PKT(req_msg, req);
+
+    return req_msg;
+}
+
+ssize_t     smb_file_read_data(smb_message *resp_msg, void **data)
+{
     smb_read_resp   *resp;
-    size_t          max_read;
+    size_t          len;
+
+    if (resp_msg->payload_size < sizeof(smb_read_resp))
+        return -1;
+
+    resp = (smb_read_resp *)resp_msg->packet->payload;
+    len  = resp->data_len | ((size_t)(resp->data_len_high & 0xffff) << 16);
+
+    if (resp_msg->packet->payload + resp_msg->payload_size <
+        (uint8_t *)resp_msg->packet + resp->data_offset + len)
+        return -1;
+
+    *data = (uint8_t *)resp_msg->packet + resp->data_offset;
+    return len;
+}
+
+// 'lost' tells whether it failed because the connection was lost
+static ssize_t smb_fread_once(smb_session *s, smb_fd fd, void *buf,
+                              size_t buf_size, bool *lost)
+{
+    smb_file        *file;
+    smb_message     *req_msg, resp_msg;
+    void            *data;
+    ssize_t         len;
+    size_t          max_read, skip = 0;
+    uint64_t        offset;
+    bool            cached;
     int             res;
 
     assert(s != NULL);
@@ -199,64 +336,130 @@ ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
     if ((file = smb_session_file_get(s, fd)) == NULL)
         return -1;
 
-    req_msg = smb_message_new(SMB_CMD_READ);
-    if (!req_msg)
-        return -1;
-    req_msg->packet->header.tid = file->tid;
-
     max_read = 0xffff;
     max_read = max_read < buf_size ? max_read : buf_size;
+    offset   = file->offset;
 
-    SMB_MSG_INIT_PKT_ANDX(req);
-    req.wct              = 12;
-    req.fid              = file->fid;
-    req.offset           = file->offset;
-    req.max_count        = max_read;
-    req.min_count        = max_read;
-    req.max_count_high   = 0;
-    req.remaining        = 0;
-    req.offset_high      = (file->offset >> 32) & 0xffffffff;
-    req.bct              = 0;
-    SMB_MSG_PUT_PKT(req_msg, req);
+    // Through the cache, the whole block is read to be kept
+    cached = s->block_cache != NULL && file->name != NULL;
+    if (cached)
+    {
+        if ((len = smb_block_cache_read(s, file, offset, &data)) >= 0)
+            goto copy;
+        skip     = offset % SMB_BLOCK_CACHE_BLOCK;
+        offset  -= skip;
+        max_read = SMB_BLOCK_CACHE_BLOCK;
+    }
 
-    res = smb_session_send_msg(s, req_msg);
-    smb_message_destroy(req_msg);
-    if (!res)
+    req_msg = smb_file_read_msg(s, file, offset, max_read);
+    if (!req_msg)
         return -1;
 
-    if (!smb_session_recv_msg(s, &resp_msg))
+    res = smb_session_send_msg(s, req_msg);
+    smb_message_destroy(req_msg);
+    if (!res || !smb_session_recv_msg(s, &resp_msg))
+    {
+        *lost = true;
         return -1;
+    }
     if (!smb_session_check_nt_status(s, &resp_msg))
         return -1;
 
-    if (resp_msg.payload_size < sizeof(smb_read_resp))
+    if ((len = smb_file_read_data(&resp_msg, &data)) < 0)
     {
         BDSM_dbg("[smb_fread]Malformed message.\n");
         return DSM_ERROR_NETWORK;
     }
 
-    resp = (smb_read_resp *)resp_msg.packet->payload;
-
-    if (resp_msg.packet->payload + resp_msg.payload_size <
-        (uint8_t *)resp_msg.packet + resp->data_offset + resp->data_len)
+    if (cached)
     {
-        BDSM_dbg("[smb_fread]Malformed message.\n");
-        return DSM_ERROR_NETWORK;
+        smb_block_cache_store(s, file, offset, data, len);
+        skip = skip < (size_t)len ? skip : (size_t)len;
+        data = (uint8_t *)data + skip;
+        len -= skip;
     }
 
+copy:
+    len = (size_t)len < buf_size ? (size_t)len : buf_size;
     if (buf)
-        memcpy(buf, (char *)resp_msg.packet + resp->data_offset, resp->data_len);
-    smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+        memcpy(buf, data, len);
+    if (file->hash != NULL)
+        smb_hash_feed(file->hash, file->offset, data, len);
+    smb_fseek(s, fd, len, SEEK_CUR);
+
+    return len;
+}
+
+ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+{
+    ssize_t         res;
+    unsigned        attempts = 0;
+    bool            lost;
+
+    assert(s != NULL);
+
+    // The read restarts from the file offset, which only moves on success
+    do
+    {
+        lost = false;
+        res  = smb_fread_once(s, fd, buf, buf_size, &lost);
+    }
+    while (res < 0 && lost && smb_session_retry(s, fd, &attempts));
+
+    return res;
+}
+
+smb_message *smb_file_write_msg(smb_session *s, smb_file *file,
+                                uint64_t offset, const void *buf,
+                                uint16_t size, uint16_t write_mode)
+{
+    smb_message    *req_msg;
+    smb_write_req   req;
+
+    req_msg = smb_message_new(s, SMB_CMD_WRITE);
+    if (!req_msg)
+        return NULL;
+    req_msg->packet->header.tid = (uint16_t)file->tid;
+
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct              = 14; // Must be 14
+    req.fid              = file->srv_fid;
+    req.offset           = offset & 0xffffffff;
+    req.timeout          = 0;
+    req.write_mode       = write_mode;
+    req.remaining        = 0;
+    req.reserved         = 0;
+    req.data_len         = size;
+    req.data_offset      = sizeof(smb_packet) + sizeof(smb_write_req);
+    req.offset_high      = (offset >> 32) & 0xffffffff;
+    req.bct              = size;
+    SMB_MSG_PUT_PKT(req_msg, req);
+    if (!smb_message_append(req_msg, buf, size))
+    {
+        smb_message_destroy(req_msg);
+        return NULL;
+    }
+
+    return req_msg;
+}
 
+ssize_t     smb_file_write_count(smb_message *resp_msg)
+{
+    smb_write_resp *resp;
+
+    if (resp_msg->payload_size < sizeof(smb_write_resp))
+        return -1;
+
+    resp = (smb_write_resp *)resp_msg->packet->payload;
     return resp->data_len;
 }
 
-ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+static ssize_t smb_fwrite_once(smb_session *s, smb_fd fd, void *buf,
+                               size_t buf_size, bool *lost)
 {
     smb_file       *file;
     smb_message    *req_msg, resp_msg;
-    smb_write_req   req;
-    smb_write_resp *resp;
+    ssize_t         len;
     uint16_t        max_write;
     int             res;
 
@@ -266,51 +469,64 @@ ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
     if (file == NULL)
         return -1;
 
-    req_msg = smb_message_new(SMB_CMD_WRITE);
-    if (!req_msg)
-        return -1;
-    req_msg->packet->header.tid = (uint16_t)file->tid;
-
     // total size of SMB message shall not exceed maximum size of netbios data payload
-    max_write = UINT16_MAX - sizeof(smb_packet) - sizeof(smb_write_req);
+    max_write = SMB_FILE_MAX_WRITE;
     max_write = max_write < buf_size ? max_write : (uint16_t)buf_size;
 
-    SMB_MSG_INIT_PKT_ANDX(req);
-    req.wct              = 14; // Must be 14
-    req.fid              = file->fid;
-    req.offset           = file->offset & 0xffffffff;
-    req.timeout          = 0;
-    req.write_mode       = SMB_WRITEMODE_WRITETHROUGH;
-    req.remaining        = 0;
-    req.reserved         = 0;
-    req.data_len         = max_write;
-    req.data_offset      = sizeof(smb_packet) + sizeof(smb_write_req);
-    req.offset_high      = (file->offset >> 32) & 0xffffffff;
-    req.bct              = max_write;
-    SMB_MSG_PUT_PKT(req_msg, req);
-    smb_message_append(req_msg, buf, max_write);
+    req_msg = smb_file_write_msg(s, file, file->offset, buf, max_write,
+                                 SMB_WRITEMODE_WRITETHROUGH);
+    if (!req_msg)
+        return -1;
 
     res = smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
     if (!res)
+    {
+        *lost = true;
         return -1;
+    }
+
+    if (file->name != NULL)
+        smb_stat_cache_invalidate(s, file->tid, file->name, false);
 
     if (!smb_session_recv_msg(s, &resp_msg))
+    {
+        *lost = true;
         return -1;
+    }
     if (!smb_session_check_nt_status(s, &resp_msg))
         return -1;
 
-    if (resp_msg.payload_size < sizeof(smb_write_resp))
+    if ((len = smb_file_write_count(&resp_msg)) < 0)
     {
         BDSM_dbg("[smb_fwrite]Malformed message.\n");
         return DSM_ERROR_NETWORK;
     }
 
-    resp = (smb_write_resp *)resp_msg.packet->payload;
+    if (file->hash != NULL)
+        smb_hash_feed(file->hash, file->offset, buf, len);
+    smb_fseek(s, fd, len, SEEK_CUR);
+
+    return len;
+}
 
-    smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
+{
+    ssize_t         res;
+    unsigned        attempts = 0;
+    bool            lost;
 
-    return resp->data_len;
+    assert(s != NULL && buf != NULL);
+
+    // Writing the same bytes at the same offset again is harmless
+    do
+    {
+        lost = false;
+        res  = smb_fwrite_once(s, fd, buf, buf_size, &lost);
+    }
+    while (res < 0 && lost && smb_session_retry(s, fd, &attempts));
+
+    return res;
 }
 
 ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence)
@@ -330,25 +546,61 @@ ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence)
     return file->offset;
 }
 
-int  smb_file_rm(smb_session *s, smb_tid tid, const char *path)
+int       smb_fcache_rights(smb_session *s, smb_fd fd)
 {
-    smb_message           *req_msg, resp_msg;
+    smb_file  *file;
+
+    assert(s != NULL);
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return 0;
+
+    switch (file->oplock)
+    {
+        case SMB_OPLOCK_BATCH:
+            return SMB_CACHE_READ | SMB_CACHE_WRITE | SMB_CACHE_HANDLE;
+        case SMB_OPLOCK_EXCLUSIVE:
+            return SMB_CACHE_READ | SMB_CACHE_WRITE;
+        case SMB_OPLOCK_LEVEL_II:
+            return SMB_CACHE_READ;
+        default:
+            return 0;
+    }
+}
+
+int       smb_fhash(smb_session *s, smb_fd fd, smb_hash *hash)
+{
+    smb_file  *file;
+
+    assert(s != NULL);
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    file->hash = hash;
+    if (hash != NULL)
+        hash->next = file->offset;
+
+    return DSM_SUCCESS;
+}
+
+static smb_message *smb_file_rm_msg(smb_session *s, smb_tid tid,
+                                    const char *path)
+{
+    smb_message           *req_msg;
     smb_file_rm_req       req;
-    smb_file_rm_resp      *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
 
-    assert(s != NULL && path != NULL);
-
     utf_pattern_len = smb_to_utf16(path, strlen(path) + 1, &utf_pattern);
     if (utf_pattern_len == 0)
-        return DSM_ERROR_CHARSET;
+        return NULL;
 
-    req_msg = smb_message_new(SMB_CMD_RMFILE);
+    req_msg = smb_message_new(s, SMB_CMD_RMFILE);
     if (!req_msg)
     {
         free(utf_pattern);
-        return DSM_ERROR_GENERIC;
+        return NULL;
     }
 
     req_msg->packet->header.tid = (uint16_t)tid;
@@ -362,10 +614,24 @@ int  smb_file_rm(smb_session *s, smb_tid tid, const char *path)
     SMB_MSG_PUT_PKT(req_msg, req);
     smb_message_append(req_msg, utf_pattern, utf_pattern_len);
 
+    free(utf_pattern);
+    return req_msg;
+}
+
+int  smb_file_rm(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_message           *req_msg, resp_msg;
+    smb_file_rm_resp      *resp;
+
+    assert(s != NULL && path != NULL);
+
+    req_msg = smb_file_rm_msg(s, tid, path);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
     smb_session_send_msg(s, req_msg);
     smb_message_destroy(req_msg);
-
-    free(utf_pattern);
+    smb_stat_cache_invalidate(s, tid, path, false);
 
     if (!smb_session_recv_msg(s, &resp_msg))
         return DSM_ERROR_NETWORK;
@@ -385,33 +651,31 @@ int  smb_file_rm(smb_session *s, smb_tid tid, const char *path)
     return 0;
 }
 
-int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *new_path)
+static smb_message *smb_file_mv_msg(smb_session *s, smb_tid tid,
+                                    const char *old_path, const char *new_path)
 {
-    smb_message           *req_msg, resp_msg;
+    smb_message           *req_msg;
     smb_file_mv_req       req;
-    smb_file_mv_resp      *resp;
     size_t                utf_old_len,utf_new_len;
     char                  *utf_old_path,*utf_new_path;
 
-    assert(s != NULL && old_path != NULL && new_path != NULL);
-
     utf_old_len = smb_to_utf16(old_path, strlen(old_path) + 1, &utf_old_path);
     if (utf_old_len == 0)
-        return DSM_ERROR_CHARSET;
+        return NULL;
 
     utf_new_len = smb_to_utf16(new_path, strlen(new_path) + 1, &utf_new_path);
     if (utf_new_len == 0)
     {
         free(utf_old_path);
-        return DSM_ERROR_CHARSET;
+        return NULL;
     }
 
-    req_msg = smb_message_new(SMB_CMD_MOVE);
+    req_msg = smb_message_new(s, SMB_CMD_MOVE);
     if (!req_msg)
     {
         free(utf_old_path);
         free(utf_new_path);
-        return DSM_ERROR_GENERIC;
+        return NULL;
     }
 
     req_msg->packet->header.tid = (uint16_t)tid;
@@ -428,11 +692,26 @@ int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const c
     smb_message_put8(req_msg, 0x04); // Buffer format 2, must be 4
     smb_message_append(req_msg, utf_new_path, utf_new_len);
 
-    smb_session_send_msg(s, req_msg);
-    smb_message_destroy(req_msg);
-
     free(utf_old_path);
     free(utf_new_path);
+    return req_msg;
+}
+
+int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const char *new_path)
+{
+    smb_message           *req_msg, resp_msg;
+    smb_file_mv_resp      *resp;
+
+    assert(s != NULL && old_path != NULL && new_path != NULL);
+
+    req_msg = smb_file_mv_msg(s, tid, old_path, new_path);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
+    smb_session_send_msg(s, req_msg);
+    smb_message_destroy(req_msg);
+    smb_stat_cache_invalidate(s, tid, old_path, true);
+    smb_stat_cache_invalidate(s, tid, new_path, true);
 
     if (!smb_session_recv_msg(s, &resp_msg))
         return DSM_ERROR_NETWORK;
@@ -452,3 +731,108 @@ int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const c
 
     return DSM_SUCCESS;
 }
+
+/*
+ * Bulk operations
+ */
+
+static void smb_file_bulk_status(smb_session *s, smb_file_bulk *bulk,
+                                 size_t i, uint32_t status)
+{
+    if (bulk->status != NULL)
+        bulk->status[i] = status;
+    if (status != NT_STATUS_SUCCESS)
+    {
+        bulk->failed++;
+        s->nt_status = status;
+    }
+}
+
+static smb_message *smb_file_bulk_build(smb_session *s, size_t i, void *opaque)
+{
+    smb_file_bulk   *bulk = opaque;
+    smb_message     *msg;
+
+    switch (bulk->cmd)
+    {
+        case SMB_CMD_RMFILE:
+            msg = smb_file_rm_msg(s, bulk->tid, bulk->paths[i]);
+            smb_stat_cache_invalidate(s, bulk->tid, bulk->paths[i], false);
+            break;
+        case SMB_CMD_MOVE:
+            msg = smb_file_mv_msg(s, bulk->tid, bulk->paths[i],
+                                  bulk->new_paths[i]);
+            smb_stat_cache_invalidate(s, bulk->tid, bulk->paths[i], true);
+            smb_stat_cache_invalidate(s, bulk->tid, bulk->new_paths[i], true);
+            break;
+        default:
+            msg = smb_directory_rm_msg(s, bulk->tid, bulk->paths[i]);
+            smb_stat_cache_invalidate(s, bulk->tid, bulk->paths[i], true);
+    }
+
+    if (msg == NULL)
+        smb_file_bulk_status(s, bulk, i, NT_STATUS_OBJECT_NAME_INVALID);
+    return msg;
+}
+
+static bool smb_file_bulk_answer(smb_session *s, size_t i, smb_message *msg,
+                                 void *opaque)
+{
+    uint32_t    status = msg->packet->header.status;
+
+    // All these answers are empty
+    if (status == NT_STATUS_SUCCESS
+        && (msg->payload_size < 3 || msg->packet->payload[0] != 0
+            || msg->packet->payload[1] != 0 || msg->packet->payload[2] != 0))
+        status = NT_STATUS_INVALID_NETWORK_RESPONSE;
+
+    smb_file_bulk_status(s, opaque, i, status);
+    return true;
+}
+
+int             smb_file_bulk_run(smb_session *s, smb_file_bulk *bulk,
+                                  size_t count)
+{
+    bulk->failed = 0;
+    if (!smb_session_pipeline(s, count, smb_file_bulk_build,
+                              smb_file_bulk_answer, bulk))
+        return DSM_ERROR_NETWORK;
+
+    return bulk->failed ? DSM_ERROR_NT : DSM_SUCCESS;
+}
+
+int             smb_file_rm_many(smb_session *s, smb_tid tid,
+                                 const char *const *paths, size_t count,
+                                 uint32_t *status)
+{
+    smb_file_bulk   bulk;
+
+    assert(s != NULL && (paths != NULL || count == 0));
+
+    bulk.cmd        = SMB_CMD_RMFILE;
+    bulk.tid        = tid;
+    bulk.paths      = paths;
+    bulk.new_paths  = NULL;
+    bulk.status     = status;
+
+    return smb_file_bulk_run(s, &bulk, count);
+}
+
+int             smb_file_mv_many(smb_session *s, smb_tid tid,
+                                 const char *const *old_paths,
+                                 const char *const *new_paths, size_t count,
+                                 uint32_t *status)
+{
+    smb_file_bulk   bulk;
+
+    assert(s != NULL && ((old_paths != NULL && new_paths != NULL)
+                         || count == 0));
+
+    bulk.cmd        = SMB_CMD_MOVE;
+    bulk.tid        = tid;
+    bulk.paths      = old_paths;
+    bulk.new_paths  = new_paths;
+    bulk.status     = status;
+
+    return smb_file_bulk_run(s, &bulk, count);
+}
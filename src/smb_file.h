@@ -37,5 +37,45 @@
 #define _SMB_FILE_H_
 
 #include "bdsm/smb_file.h"
+#include "smb_types.h"
+
+// NT Create AndX with explicit disposition and options, registering the
+// opened file in the session. Returns 0 or a DSM error code
+int             smb_file_open(smb_session *s, smb_tid tid, const char *path,
+                              uint32_t access, uint32_t disposition,
+                              const smb_fopen_opts *opts, smb_fd *fd);
+
+// Opens again a file after a reconnection, it keeps its user side fid
+int             smb_file_reopen(smb_session *s, smb_file *file);
+
+// The largest write that fits in a 64k message
+#define SMB_FILE_MAX_WRITE  (UINT16_MAX - sizeof(smb_packet) \
+                             - sizeof(smb_write_req))
+
+// READ AndX / WRITE AndX requests, ready to be sent
+smb_message     *smb_file_read_msg(smb_session *s, smb_file *file,
+                                   uint64_t offset, size_t size);
+smb_message     *smb_file_write_msg(smb_session *s, smb_file *file,
+                                    uint64_t offset, const void *buf,
+                                    uint16_t size, uint16_t write_mode);
+// Data of a READ AndX answer. Returns its size, or -1 if malformed
+ssize_t         smb_file_read_data(smb_message *resp_msg, void **data);
+// Bytes written according to a WRITE AndX answer, or -1 if malformed
+ssize_t         smb_file_write_count(smb_message *resp_msg);
+
+// A pipelined batch of RMFILE, MOVE or RMDIR requests
+typedef struct
+{
+    uint8_t             cmd;
+    smb_tid             tid;
+    const char *const   *paths;
+    const char *const   *new_paths;     // MOVE only
+    uint32_t            *status;        // Can be NULL
+    size_t              failed;
+} smb_file_bulk;
+
+// Returns 0, DSM_ERROR_NT if some items failed, or DSM_ERROR_NETWORK
+int             smb_file_bulk_run(smb_session *s, smb_file_bulk *bulk,
+                                  size_t count);
 
 #endif
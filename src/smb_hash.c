@@ -0,0 +1,370 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mdx/md5.h>
+
+#include "smb_hash.h"
+
+static void     md5_init(void *ctx)
+{
+    MD5_Init(ctx);
+}
+
+static void     md5_update(void *ctx, const void *data, size_t size)
+{
+    MD5_Update(ctx, data, size);
+}
+
+static void     md5_final(void *ctx, uint8_t *digest)
+{
+    MD5_Final(digest, ctx);
+}
+
+static const smb_hash_algo md5_algo =
+{
+    "md5", sizeof(MD5_CTX), 16, md5_init, md5_update, md5_final
+};
+
+const smb_hash_algo *smb_hash_md5(void)
+{
+    return &md5_algo;
+}
+
+// CRC-32C, reflected polynomial 0x82f63b78
+static const uint32_t crc32c_table[256] =
+{
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+static void     crc32c_init(void *ctx)
+{
+    *(uint32_t *)ctx = 0xffffffff;
+}
+
+static void     crc32c_update(void *ctx, const void *data, size_t size)
+{
+    const uint8_t   *p = data;
+    uint32_t        crc = *(uint32_t *)ctx;
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    // The CPU does it 8 bytes at a time when we are built for it
+    uint64_t        crc64 = crc, v;
+
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        memcpy(&v, p, 8);
+        crc64 = __builtin_ia32_crc32di(crc64, v);
+    }
+    crc = crc64;
+#endif
+    while (size--)
+        crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    *(uint32_t *)ctx = crc;
+}
+
+static void     crc32c_final(void *ctx, uint8_t *digest)
+{
+    uint32_t        crc = ~*(uint32_t *)ctx;
+
+    digest[0] = crc >> 24;
+    digest[1] = crc >> 16;
+    digest[2] = crc >> 8;
+    digest[3] = crc;
+}
+
+static const smb_hash_algo crc32c_algo =
+{
+    "crc32c", sizeof(uint32_t), 4, crc32c_init, crc32c_update, crc32c_final
+};
+
+const smb_hash_algo *smb_hash_crc32c(void)
+{
+    return &crc32c_algo;
+}
+
+// XXH64, as specified by the reference xxHash implementation
+#define XXH_P1  0x9e3779b185ebca87ULL
+#define XXH_P2  0xc2b2ae3d27d4eb4fULL
+#define XXH_P3  0x165667b19e3779f9ULL
+#define XXH_P4  0x85ebca77c2b2ae63ULL
+#define XXH_P5  0x27d4eb2f165667c5ULL
+
+typedef struct
+{
+    uint64_t        v[4];
+    uint64_t        total;
+    uint8_t         buf[32];        // Input not making a whole stripe yet
+    size_t          buf_len;
+} xxh64_ctx;
+
+static inline uint64_t xxh_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little endian reads, whatever the host
+static inline uint64_t xxh_read64(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+           | (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32
+           | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48
+           | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t xxh_read32(const uint8_t *p)
+{
+    return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16
+           | (uint64_t)p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc  = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void     xxh64_stripe(xxh64_ctx *x, const uint8_t *p)
+{
+    x->v[0] = xxh_round(x->v[0], xxh_read64(p));
+    x->v[1] = xxh_round(x->v[1], xxh_read64(p + 8));
+    x->v[2] = xxh_round(x->v[2], xxh_read64(p + 16));
+    x->v[3] = xxh_round(x->v[3], xxh_read64(p + 24));
+}
+
+static void     xxh64_init(void *ctx)
+{
+    xxh64_ctx       *x = ctx;
+
+    memset(x, 0, sizeof(*x));
+    x->v[0] = XXH_P1 + XXH_P2;
+    x->v[1] = XXH_P2;
+    x->v[2] = 0;
+    x->v[3] = -XXH_P1;
+}
+
+static void     xxh64_update(void *ctx, const void *data, size_t size)
+{
+    xxh64_ctx       *x = ctx;
+    const uint8_t   *p = data;
+    size_t          fill;
+
+    x->total += size;
+
+    if (x->buf_len > 0)
+    {
+        fill = 32 - x->buf_len < size ? 32 - x->buf_len : size;
+        memcpy(x->buf + x->buf_len, p, fill);
+        x->buf_len += fill;
+        p          += fill;
+        size       -= fill;
+        if (x->buf_len < 32)
+            return;
+        xxh64_stripe(x, x->buf);
+        x->buf_len = 0;
+    }
+
+    for (; size >= 32; size -= 32, p += 32)
+        xxh64_stripe(x, p);
+
+    memcpy(x->buf, p, size);
+    x->buf_len = size;
+}
+
+static void     xxh64_final(void *ctx, uint8_t *digest)
+{
+    xxh64_ctx       *x = ctx;
+    const uint8_t   *p = x->buf;
+    size_t          left = x->buf_len;
+    uint64_t        h;
+    int             i;
+
+    if (x->total >= 32)
+    {
+        h = xxh_rotl(x->v[0], 1) + xxh_rotl(x->v[1], 7)
+            + xxh_rotl(x->v[2], 12) + xxh_rotl(x->v[3], 18);
+        for (i = 0; i < 4; i++)
+            h = xxh_merge(h, x->v[i]);
+    }
+    else
+        h = XXH_P5;
+    h += x->total;
+
+    for (; left >= 8; left -= 8, p += 8)
+    {
+        h ^= xxh_round(0, xxh_read64(p));
+        h  = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+    }
+    if (left >= 4)
+    {
+        h ^= xxh_read32(p) * XXH_P1;
+        h  = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        left -= 4;
+        p    += 4;
+    }
+    while (left--)
+    {
+        h ^= *p++ * XXH_P5;
+        h  = xxh_rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    for (i = 0; i < 8; i++)
+        digest[i] = h >> (56 - 8 * i);
+}
+
+static const smb_hash_algo xxh64_algo =
+{
+    "xxh64", sizeof(xxh64_ctx), 8, xxh64_init, xxh64_update, xxh64_final
+};
+
+const smb_hash_algo *smb_hash_xxh64(void)
+{
+    return &xxh64_algo;
+}
+
+smb_hash        *smb_hash_new(const smb_hash_algo *algo)
+{
+    smb_hash        *h;
+
+    assert(algo != NULL);
+
+    h = calloc(1, sizeof(smb_hash) + algo->ctx_size);
+    if (h == NULL)
+        return NULL;
+    h->algo = algo;
+    algo->init(h->ctx);
+
+    return h;
+}
+
+void            smb_hash_update(smb_hash *h, const void *data, size_t size)
+{
+    assert(h != NULL && (data != NULL || size == 0));
+
+    h->algo->update(h->ctx, data, size);
+    h->bytes += size;
+    h->next  += size;
+}
+
+bool            smb_hash_feed(smb_hash *h, uint64_t offset, const void *data,
+                              size_t size)
+{
+    if (offset != h->next)
+        return false;
+
+    smb_hash_update(h, data, size);
+    return true;
+}
+
+uint64_t        smb_hash_bytes(smb_hash *h)
+{
+    assert(h != NULL);
+
+    return h->bytes;
+}
+
+size_t          smb_hash_final(smb_hash *h, uint8_t *digest)
+{
+    assert(h != NULL && digest != NULL);
+
+    h->algo->final(h->ctx, digest);
+    h->algo->init(h->ctx);
+    h->bytes = 0;
+
+    return h->algo->digest_size;
+}
+
+void            smb_hash_destroy(smb_hash *h)
+{
+    free(h);
+}
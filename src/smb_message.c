@@ -45,13 +45,42 @@
 
 #define PAYLOAD_BLOCK_SIZE 256
 
+// Released messages are kept by their session to be reused, unless their
+// payload grew too much (big reads/writes).
+#define MSG_POOL_SIZE         8
+#define MSG_POOL_MAX_PAYLOAD  (64 * 1024)
+
+// Make sure the transport send buffer can hold payload_size bytes of payload,
+// it may move.
+static int     smb_message_reserve_direct(smb_message *msg, size_t payload_size)
+{
+    smb_transport *tr = &msg->session->transport;
+    size_t        capacity;
+    void          *packet;
+
+    packet = tr->pkt_reserve(tr->session, sizeof(smb_packet) + payload_size,
+                             &capacity);
+    if (!packet)
+        return 0;
+    msg->packet = packet;
+    msg->payload_size = capacity - sizeof(smb_packet);
+    return 1;
+}
+
 static int     smb_message_expand_payload(smb_message *msg, size_t cursor, size_t data_size)
 {
     if (data_size == 0 || data_size > msg->payload_size - cursor)
     {
-        size_t new_size = data_size + cursor - msg->payload_size;
-        size_t nb_blocks = (new_size / PAYLOAD_BLOCK_SIZE) + 1;
-        size_t new_payload_size = msg->payload_size + nb_blocks * PAYLOAD_BLOCK_SIZE;
+        // Grow geometrically, so that a message is only reallocated a few
+        // times before it settles in the pool.
+        size_t new_payload_size = msg->payload_size ? msg->payload_size * 2
+                                                    : PAYLOAD_BLOCK_SIZE;
+        while (new_payload_size < cursor + data_size)
+            new_payload_size *= 2;
+
+        if (msg->direct)
+            return smb_message_reserve_direct(msg, new_payload_size);
+
         void *new_packet = realloc(msg->packet, sizeof(smb_packet) + new_payload_size);
         if (!new_packet)
             return 0;
@@ -61,18 +90,42 @@ static int     smb_message_expand_payload(smb_message *msg, size_t cursor, size_
     return 1;
 }
 
-smb_message   *smb_message_new(uint8_t cmd)
+smb_message   *smb_message_new(smb_session *s, uint8_t cmd)
 {
     const uint8_t magic[4] = SMB_MAGIC;
     smb_message *msg;
 
-    msg = (smb_message *)calloc(1, sizeof(smb_message));
-    if (!msg)
-        return NULL;
-
-    if (smb_message_expand_payload(msg, msg->cursor, 0) == 0) {
-        free(msg);
-        return NULL;
+    // Requests are usually built and sent one at a time, the first one is
+    // built in place in the transport buffer, saving a copy.
+    if (s != NULL && s->transport.session != NULL && !s->msg_direct_busy)
+    {
+        msg = &s->msg_direct;
+        memset(msg, 0, sizeof(*msg));
+        msg->session = s;
+        msg->direct = true;
+        if (smb_message_reserve_direct(msg, PAYLOAD_BLOCK_SIZE) == 0)
+            return NULL;
+        s->msg_direct_busy = true;
+    }
+    else if (s != NULL && s->msg_pool != NULL)
+    {
+        msg = s->msg_pool;
+        s->msg_pool = msg->next_free;
+        s->msg_pool_count--;
+        msg->next_free = NULL;
+        msg->cursor = 0;
+    }
+    else
+    {
+        msg = (smb_message *)calloc(1, sizeof(smb_message));
+        if (!msg)
+            return NULL;
+
+        if (smb_message_expand_payload(msg, msg->cursor, 0) == 0) {
+            free(msg);
+            return NULL;
+        }
+        msg->session = s;
     }
     memset(msg->packet, 0, sizeof(smb_packet));
 
@@ -97,6 +150,9 @@ smb_message   *smb_message_grow(smb_message *msg, size_t size)
         return NULL;
     copy->cursor        = msg->cursor;
     copy->payload_size  = msg->payload_size + size;
+    copy->session       = NULL;
+    copy->next_free     = NULL;
+    copy->direct        = false;
 
     copy->packet = malloc(sizeof(smb_packet) + copy->payload_size);
     if (!copy->packet) {
@@ -111,12 +167,45 @@ smb_message   *smb_message_grow(smb_message *msg, size_t size)
 
 void            smb_message_destroy(smb_message *msg)
 {
+    smb_session *s;
+
     if (msg == NULL)
         return;
+
+    s = msg->session;
+    if (msg->direct)
+    {
+        // Otherwise already released by smb_session_send_msg()
+        if (msg->packet != NULL)
+            s->msg_direct_busy = false;
+        return;
+    }
+    if (s != NULL && s->msg_pool_count < MSG_POOL_SIZE
+        && msg->payload_size <= MSG_POOL_MAX_PAYLOAD)
+    {
+        msg->next_free = s->msg_pool;
+        s->msg_pool = msg;
+        s->msg_pool_count++;
+        return;
+    }
+
     free(msg->packet);
     free(msg);
 }
 
+void            smb_message_pool_clear(smb_session *s)
+{
+    while (s->msg_pool != NULL)
+    {
+        smb_message *msg = s->msg_pool;
+
+        s->msg_pool = msg->next_free;
+        msg->session = NULL;
+        smb_message_destroy(msg);
+    }
+    s->msg_pool_count = 0;
+}
+
 int             smb_message_append(smb_message *msg, const void *data,
                                    size_t data_size)
 {
@@ -185,20 +274,22 @@ int             smb_message_put64(smb_message *msg, uint64_t data)
 size_t          smb_message_put_utf16(smb_message *msg, const char *str,
                                       size_t str_len)
 {
-    char          *utf_str;
     size_t        utf_str_len;
-    int           res;
 
-    utf_str_len = smb_to_utf16(str, str_len, &utf_str);
-    res = smb_message_append(msg, utf_str, utf_str_len);
-    free(utf_str);
+    if (msg == NULL || str == NULL || str_len == 0)
+        return 0;
+
+    // Convert in place instead of going through a temporary string
+    if (smb_message_expand_payload(msg, msg->cursor, 2 * str_len) == 0)
+        return 0;
+    utf_str_len = smb_to_utf16_buf(str, str_len,
+                                   (char *)msg->packet->payload + msg->cursor);
+    msg->cursor += utf_str_len;
 
     // BDSM_dbg("put_utf16, adds %d bytes, cursor is at %d\n",
     //         utf_str_len, msg->cursor);
 
-    if (res)
-        return utf_str_len;
-    return 0;
+    return utf_str_len;
 }
 
 int             smb_message_put_uuid(smb_message *msg, uint32_t a, uint16_t b,
@@ -34,9 +34,10 @@
 #include "smb_defs.h"
 #include "smb_types.h"
 
-smb_message     *smb_message_new(uint8_t cmd);
+smb_message     *smb_message_new(smb_session *s, uint8_t cmd);
 smb_message     *smb_message_grow(smb_message *msg, size_t size);
 void            smb_message_destroy(smb_message *msg);
+void            smb_message_pool_clear(smb_session *s);
 int             smb_message_advance(smb_message *msg, size_t size);
 int             smb_message_append(smb_message *msg, const void *data,
                                    size_t data_size);
@@ -92,7 +92,8 @@ SMB_PACKED_START typedef struct
   uint8_t         wct;            /* +-17 :) */                                \
   uint16_t        dialect_index;                                               \
   uint8_t         security_mode;  /* Share/User. Plaintext/Challenge */        \
-  uint32_t        diplodocus;                                                  \
+  uint16_t        max_mpx;        /* Max pending requests */                   \
+  uint16_t        max_vcs;                                                     \
   uint32_t        max_bufsize;    /* Max buffer size requested by server. */   \
   uint32_t        max_rawbuffer;  /* Max raw buffer size requested by serv. */ \
   uint32_t        session_key;    /* 'MUST' be returned to server */           \
@@ -221,6 +222,20 @@ SMB_PACKED_START typedef struct
     uint8_t         path[];             // UTF16 Path, starting with '\'
 } SMB_PACKED_END   smb_create_req;
 
+//-> Locking AndX, also what the server sends to break an oplock
+SMB_PACKED_START typedef struct
+{
+    uint8_t         wct;                // 8
+    SMB_ANDX_MEMBERS
+    uint16_t        fid;
+    uint8_t         type;
+    uint8_t         oplock_level;       // Level the oplock is broken to
+    uint32_t        timeout;
+    uint16_t        unlock_count;
+    uint16_t        lock_count;
+    uint16_t        bct;
+} SMB_PACKED_END   smb_locking_req;
+
 //<- Create File
 SMB_PACKED_START typedef struct
 {
@@ -453,6 +468,14 @@ SMB_PACKED_START typedef struct
     uint8_t       path[];
 } SMB_PACKED_END   smb_tr2_query;
 
+//// -> Trans2|SetFileInfo
+SMB_PACKED_START typedef struct
+{
+    uint16_t      fid;
+    uint16_t      interest;
+    uint16_t      reserved;
+} SMB_PACKED_END   smb_tr2_set_file;
+
 //<- Trans2
 
 SMB_PACKED_START typedef struct
@@ -514,6 +537,15 @@ SMB_PACKED_START typedef struct
     uint8_t       name[];
 } SMB_PACKED_END   smb_tr2_find2_entry;
 
+//// <- Trans2|FindFirst2FileInfo, NAMES_INFO level
+SMB_PACKED_START typedef struct
+{
+    uint32_t      next_entry;
+    uint32_t      index;
+    uint32_t      name_len;
+    uint8_t       name[];
+} SMB_PACKED_END   smb_tr2_find2_names_entry;
+
 
 //// <- Trans2|QueryPathInfo
 SMB_PACKED_START typedef struct
@@ -535,6 +567,62 @@ SMB_PACKED_START typedef struct
     uint8_t       name[];
 } SMB_PACKED_END   smb_tr2_path_info;
 
+//-> NT Transact
+SMB_PACKED_START typedef struct
+{
+    uint8_t       wct;                // 19 + setup_count
+    uint8_t       max_setup_count;
+    uint16_t      reserved;
+    uint32_t      total_param_count;
+    uint32_t      total_data_count;
+    uint32_t      max_param_count;
+    uint32_t      max_data_count;
+    uint32_t      param_count;
+    uint32_t      param_offset;
+    uint32_t      data_count;
+    uint32_t      data_offset;
+    uint8_t       setup_count;
+    uint16_t      function;
+} SMB_PACKED_END   smb_nt_trans_req;
+
+//// -> NT Transact|NotifyChange setup words and byte count
+SMB_PACKED_START typedef struct
+{
+    uint32_t      filter;
+    uint16_t      fid;
+    uint8_t       watch_tree;
+    uint8_t       reserved;
+    uint16_t      bct;                // 0
+} SMB_PACKED_END   smb_nt_notify_req;
+
+//<- NT Transact
+SMB_PACKED_START typedef struct
+{
+    uint8_t       wct;                // 18 + setup_count
+    uint8_t       reserved[3];
+    uint32_t      total_param_count;
+    uint32_t      total_data_count;
+    uint32_t      param_count;
+    uint32_t      param_offset;       // From the start of the SMB header
+    uint32_t      param_displacement;
+    uint32_t      data_count;
+    uint32_t      data_offset;
+    uint32_t      data_displacement;
+    uint8_t       setup_count;
+} SMB_PACKED_END   smb_nt_trans_resp;
+
+//// <- NT Transact|NotifyChange parameters
+SMB_PACKED_START typedef struct
+{
+    uint32_t      next_entry;
+    uint32_t      action;
+    uint32_t      name_len;
+    uint8_t       name[];
+} SMB_PACKED_END   smb_nt_notify_info;
+
+//-> NT Cancel
+typedef smb_simple_struct smb_nt_cancel_req;
+
 //-> Example
 SMB_PACKED_START typedef struct
 {
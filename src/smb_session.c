@@ -39,10 +39,14 @@
 
 #include "bdsm_debug.h"
 #include "smb_session.h"
+#include "smb_block_cache.h"
 #include "smb_session_msg.h"
 #include "smb_fd.h"
+#include "smb_file.h"
+#include "smb_share.h"
 #include "smb_ntlm.h"
 #include "smb_spnego.h"
+#include "smb_stat.h"
 #include "smb_transport.h"
 
 static int        smb_negotiate(smb_session *s);
@@ -79,6 +83,7 @@ void            smb_session_destroy(smb_session *s)
     assert(s != NULL);
 
     smb_session_share_clear(s);
+    smb_block_cache_destroy(s->block_cache);
 
     // FIXME Free smb_share and smb_file
     if (s->transport.session != NULL)
@@ -91,6 +96,7 @@ void            smb_session_destroy(smb_session *s)
         asn1_delete_structure(&s->spnego_asn1);
 
     smb_buffer_free(&s->xsec_target);
+    smb_message_pool_clear(s);
 
     // Free stored credentials.
     free(s->creds.domain);
@@ -151,7 +157,9 @@ int             smb_session_connect(smb_session *s, const char *name,
     if (!s->transport.connect(ip, s->transport.session, name))
         return DSM_ERROR_NETWORK;
 
-    memcpy(s->srv.name, name, strlen(name) + 1);
+    memmove(s->srv.name, name, strlen(name) + 1);
+    s->srv_ip        = ip;
+    s->srv_transport = transport;
 
     return smb_negotiate(s);
 }
@@ -166,7 +174,7 @@ static int        smb_negotiate(smb_session *s)
 
     assert(s != NULL);
 
-    msg = smb_message_new(SMB_CMD_NEGOTIATE);
+    msg = smb_message_new(s, SMB_CMD_NEGOTIATE);
     if (!msg)
         return DSM_ERROR_GENERIC;
 
@@ -203,6 +211,8 @@ static int        smb_negotiate(smb_session *s)
     s->srv.dialect        = nego->dialect_index;
     s->srv.security_mode  = nego->security_mode;
     s->srv.caps           = nego->caps;
+    s->srv.max_bufsize    = nego->max_bufsize;
+    s->srv.max_mpx        = nego->max_mpx;
     s->srv.ts             = nego->ts;
     s->srv.session_key    = nego->session_key;
 
@@ -228,7 +238,7 @@ static int        smb_session_login_ntlm(smb_session *s, const char *domain,
 
     assert(s != NULL);
 
-    msg = smb_message_new(SMB_CMD_SETUP);
+    msg = smb_message_new(s, SMB_CMD_SETUP);
     if (!msg)
         return DSM_ERROR_GENERIC;
 
@@ -326,7 +336,7 @@ int        smb_session_logoff(smb_session *s)
 
     assert(s != NULL);
 
-    msg = smb_message_new(SMB_CMD_LOGOFF);
+    msg = smb_message_new(s, SMB_CMD_LOGOFF);
     if (!msg)
         return DSM_ERROR_GENERIC;
 
@@ -405,3 +415,99 @@ bool smb_session_check_nt_status(smb_session *s, smb_message *msg)
     }
     return true;
 }
+
+void            smb_session_set_reconnect(smb_session *s, unsigned retries)
+{
+    assert(s != NULL);
+
+    s->reconnect_retries = retries;
+}
+
+int             smb_session_reconnect(smb_session *s)
+{
+    char        name[sizeof(s->srv.name)];
+    smb_share   *share;
+    smb_file    *file;
+    int         res, ret = DSM_SUCCESS;
+
+    assert(s != NULL);
+
+    if (s->srv_transport == 0)
+        return DSM_ERROR_GENERIC;
+
+    BDSM_dbg("smb_session_reconnect: Reconnecting to %s\n", s->srv.name);
+
+    memcpy(name, s->srv.name, sizeof(name));
+    s->logged = false;
+    if ((res = smb_session_connect(s, name, s->srv_ip, s->srv_transport))
+        != DSM_SUCCESS)
+        return res;
+    smb_buffer_free(&s->xsec_target);
+    if ((res = smb_session_login(s)) != DSM_SUCCESS)
+        return res;
+    s->reconnects++;
+
+    // Shares and files keep the ids the user knows them by, only the server
+    // side ones change. What happened while disconnected is unknown
+    smb_block_cache_flush(s);
+    for (share = s->shares; share != NULL; share = share->next)
+    {
+        smb_stat_cache_flush(s, share->tid);
+
+        if ((res = smb_tree_reconnect(s, share)) != DSM_SUCCESS)
+        {
+            BDSM_dbg("smb_session_reconnect: Unable to connect %s\n",
+                     share->name);
+            if (res == DSM_ERROR_NETWORK)
+                return res;
+            ret = res;
+            continue;
+        }
+
+        for (file = share->files; file != NULL; file = file->next)
+        {
+            if ((res = smb_file_reopen(s, file)) == DSM_SUCCESS)
+                continue;
+            BDSM_dbg("smb_session_reconnect: Unable to reopen %s\n",
+                     file->name);
+            if (res == DSM_ERROR_NETWORK)
+                return res;
+            ret = res;
+        }
+    }
+
+    return ret;
+}
+
+void            smb_session_set_oplock_cb(smb_session *s, smb_oplock_cb cb,
+                                          void *opaque)
+{
+    assert(s != NULL);
+
+    s->oplock_cb     = cb;
+    s->oplock_opaque = opaque;
+}
+
+bool            smb_session_retry(smb_session *s, smb_fd fd, unsigned *attempts)
+{
+    smb_share   *share;
+    int         res;
+
+    assert(s != NULL && attempts != NULL);
+
+    // Named pipes lose their state with the connection
+    share = smb_session_share_get(s, SMB_FD_TID(fd));
+    if (share == NULL || share->name == NULL || !strcmp(share->name, "IPC$"))
+        return false;
+
+    while (*attempts < s->reconnect_retries)
+    {
+        (*attempts)++;
+        res = smb_session_reconnect(s);
+        // Other files failing to reopen is not our business
+        if (res == DSM_SUCCESS || res == DSM_ERROR_NT)
+            return true;
+    }
+
+    return false;
+}
@@ -69,4 +69,9 @@
 
 bool smb_session_check_nt_status(smb_session *s, smb_message *msg);
 
+// Called when a request on 'fd' failed because the connection was lost.
+// Reconnects if the session allows more attempts, counted in 'attempts', and
+// returns true if the request should be sent again
+bool smb_session_retry(smb_session *s, smb_fd fd, unsigned *attempts);
+
 #endif
@@ -33,9 +33,17 @@
 #endif
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
+#include "bdsm_debug.h"
+#include "smb_block_cache.h"
 #include "smb_session.h"
+#include "smb_session_msg.h"
 #include "smb_message.h"
+#include "smb_fd.h"
 
 int             smb_session_send_msg(smb_session *s, smb_message *msg)
 {
@@ -49,24 +57,41 @@ int             smb_session_send_msg(smb_session *s, smb_message *msg)
     msg->packet->header.flags2  = 0xc843;
     // msg->packet->header.flags2  = 0xc043; // w/o extended security;
     msg->packet->header.uid = s->srv.uid;
-
-    s->transport.pkt_init(s->transport.session);
+    msg->packet->header.tid = smb_session_srv_tid(s, msg->packet->header.tid);
 
     pkt_sz = sizeof(smb_packet) + msg->cursor;
-    if (!s->transport.pkt_append(s->transport.session, (void *)msg->packet, pkt_sz))
-        return 0;
+    if (msg->direct)
+    {
+        // Already in place
+        assert(msg->session == s && s->msg_direct_busy);
+        s->transport.pkt_commit(s->transport.session, pkt_sz);
+        // The reply lands in the same buffer: the message is spent, and the
+        // slot is free for the next one
+        msg->packet = NULL;
+        s->msg_direct_busy = false;
+    }
+    else
+    {
+        s->transport.pkt_init(s->transport.session);
+        if (!s->transport.pkt_append(s->transport.session, (void *)msg->packet,
+                                     pkt_sz))
+            return 0;
+    }
     if (!s->transport.send(s->transport.session))
         return 0;
 
     return 1;
 }
 
-size_t          smb_session_recv_msg(smb_session *s, smb_message *msg)
+// Receives one message, oplock breaks included
+static size_t   smb_session_recv_any(smb_session *s, smb_message *msg)
 {
     void                      *data;
     ssize_t                   payload_size;
 
     assert(s != NULL && s->transport.session != NULL);
+    // Receiving would overwrite a message still being built in place
+    assert(!s->msg_direct_busy);
 
     payload_size = s->transport.recv(s->transport.session, &data);
     if (payload_size <= 0)
@@ -75,12 +100,228 @@ size_t          smb_session_recv_msg(smb_session *s, smb_message *msg)
     if ((size_t)payload_size < sizeof(smb_header))
         return 0;
 
+    msg->packet = (smb_packet *)data;
+    msg->payload_size = payload_size - sizeof(smb_header);
+    msg->cursor       = 0;
+    msg->session      = NULL;
+    msg->next_free    = NULL;
+    msg->direct       = false;
+
+    return payload_size - sizeof(smb_header);
+}
+
+// Handles 'msg' if it is an oplock break sent by the server. Returns false
+// if it is anything else
+static bool     smb_session_oplock_break(smb_session *s, smb_message *msg)
+{
+    smb_locking_req           *brk, ack;
+    smb_message               *ack_msg;
+    smb_file                  *file;
+    uint8_t                   held, level;
+
+    if (msg->packet->header.command != SMB_CMD_LOCKING
+        || msg->packet->header.mux_id != SMB_OPLOCK_BREAK_MUX
+        || msg->payload_size < sizeof(smb_locking_req))
+        return false;
+    brk = (smb_locking_req *)msg->packet->payload;
+    if (!(brk->type & SMB_LOCKING_OPLOCK_RELEASE))
+        return false;
+
+    // Closing the file meanwhile acknowledged the break already
+    file = smb_session_file_find_srv(s, msg->packet->header.tid, brk->fid);
+    BDSM_dbg("smb_session_oplock_break: fid %u broken to level %u%s\n",
+             brk->fid, brk->oplock_level, file == NULL ? ", closed" : "");
+    if (file == NULL)
+        return true;
+
+    // The answer is in the transport buffer the acknowledgment is built in
+    level        = brk->oplock_level;
+    held         = file->oplock;
+    file->oplock = level ? SMB_OPLOCK_LEVEL_II : SMB_OPLOCK_NONE;
+    // Others may now write to it
+    if (file->oplock == SMB_OPLOCK_NONE && file->name != NULL)
+        smb_block_cache_invalidate(s, file->tid, file->name, false);
+    if (s->oplock_cb != NULL)
+        s->oplock_cb(s->oplock_opaque, SMB_FD(file->tid, file->fid),
+                     file->oplock);
+
+    // Level II oplocks are broken without acknowledgment
+    if (held != SMB_OPLOCK_EXCLUSIVE && held != SMB_OPLOCK_BATCH)
+        return true;
+
+    if ((ack_msg = smb_message_new(s, SMB_CMD_LOCKING)) == NULL)
+        return true;
+    ack_msg->packet->header.tid = file->tid;
+
+    SMB_MSG_INIT_PKT_ANDX(ack);
+    ack.wct            = 8;
+    ack.fid            = file->srv_fid;
+    ack.type           = SMB_LOCKING_OPLOCK_RELEASE;
+    ack.oplock_level   = level;
+    SMB_MSG_PUT_PKT(ack_msg, ack);
+
+    // Without any lock in it, the server does not answer it
+    if (!smb_session_send_msg(s, ack_msg))
+        BDSM_dbg("smb_session_oplock_break: Unable to acknowledge\n");
+    smb_message_destroy(ack_msg);
+
+    return true;
+}
+
+size_t          smb_session_recv_msg(smb_session *s, smb_message *msg)
+{
+    smb_message               recv;
+    size_t                    size;
+
+    // Oplock breaks may come before any answer
+    do
+    {
+        if ((size = smb_session_recv_any(s, &recv)) == 0)
+            return 0;
+    }
+    while (smb_session_oplock_break(s, &recv));
+
     if (msg != NULL)
+        *msg = recv;
+
+    return size;
+}
+
+int             smb_session_wait_msg(smb_session *s, smb_message *msg,
+                                     int timeout)
+{
+    struct timespec           start, now;
+    int                       left = timeout, res;
+
+    assert(s != NULL && s->transport.session != NULL && msg != NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;)
     {
-        msg->packet = (smb_packet *)data;
-        msg->payload_size = payload_size - sizeof(smb_header);
-        msg->cursor       = 0;
+        if ((res = s->transport.wait(s->transport.session, left)) <= 0)
+            return res < 0 ? -1 : 0;
+        if (!smb_session_recv_any(s, msg))
+            return -1;
+        if (!smb_session_oplock_break(s, msg))
+            return 1;
+
+        // The break took some of the time given for the answer
+        if (timeout < 0)
+            continue;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        left = timeout - (int)((now.tv_sec - start.tv_sec) * 1000
+                               + (now.tv_nsec - start.tv_nsec) / 1000000);
+        if (left < 0)
+            left = 0;
     }
+}
 
-    return payload_size - sizeof(smb_header);
+int             smb_session_poll(smb_session *s, int timeout)
+{
+    smb_message               msg;
+    int                       res, count = 0;
+
+    assert(s != NULL && s->transport.session != NULL);
+
+    // Then take whatever else already arrived
+    while ((res = s->transport.wait(s->transport.session,
+                                    count ? 0 : timeout)) > 0)
+    {
+        if (!smb_session_recv_any(s, &msg))
+            return DSM_ERROR_NETWORK;
+        if (smb_session_oplock_break(s, &msg))
+            count++;
+        else
+            BDSM_dbg("smb_session_poll: Dropping an unexpected message\n");
+    }
+
+    return res < 0 ? DSM_ERROR_NETWORK : count;
+}
+
+bool            smb_session_pipeline(smb_session *s, size_t count,
+                                     smb_pipeline_build build,
+                                     smb_pipeline_answer answer, void *opaque)
+{
+    smb_message     *msg, reply;
+    size_t          *pending, window, sent = 0, i;
+    uint16_t        *free_slots, nfree, slot;
+    uint8_t         *cmds;
+    bool            ok = false;
+
+    assert(s != NULL && build != NULL && answer != NULL);
+
+    // Requests are told apart by their mux id, which is their slot in the
+    // window. The window is what the server allows to be pending at once
+    window = s->srv.max_mpx ? s->srv.max_mpx : 1;
+    if (window > count)
+        window = count ? count : 1;
+
+    pending     = malloc(window * sizeof(*pending));
+    free_slots  = malloc(window * sizeof(*free_slots));
+    cmds        = malloc(window);
+    if (pending == NULL || free_slots == NULL || cmds == NULL)
+        goto end;
+    for (nfree = 0; nfree < window; nfree++)
+    {
+        free_slots[nfree] = window - 1 - nfree;
+        pending[nfree]    = SIZE_MAX;
+    }
+
+    for (;;)
+    {
+        // Fill the window
+        while (sent < count && nfree > 0)
+        {
+            if ((msg = build(s, sent, opaque)) == SMB_PIPELINE_LATER)
+                break;
+            i = sent++;
+            if (msg == NULL)
+                continue;
+
+            slot = free_slots[--nfree];
+            pending[slot] = i;
+            cmds[slot]    = msg->packet->header.command;
+            msg->packet->header.mux_id = slot + 1;
+
+            if (!smb_session_send_msg(s, msg))
+            {
+                BDSM_dbg("smb_session_pipeline: Unable to send request\n");
+                smb_message_destroy(msg);
+                goto end;
+            }
+            smb_message_destroy(msg);
+        }
+
+        // All answered, and nothing more can be sent
+        if (nfree == window)
+            break;
+
+        // Then collect one answer, in whatever order they come
+        if (!smb_session_recv_msg(s, &reply))
+        {
+            BDSM_dbg("smb_session_pipeline: Unable to recv msg\n");
+            goto end;
+        }
+        slot = reply.packet->header.mux_id - 1;
+        if (slot >= window || pending[slot] == SIZE_MAX
+            || reply.packet->header.command != cmds[slot])
+        {
+            BDSM_dbg("smb_session_pipeline: Unexpected answer, mux id %u\n",
+                     reply.packet->header.mux_id);
+            continue;
+        }
+        i = pending[slot];
+        pending[slot] = SIZE_MAX;
+        free_slots[nfree++] = slot;
+
+        if (!answer(s, i, &reply, opaque))
+            goto end;
+    }
+    ok = true;
+
+end:
+    free(pending);
+    free(free_slots);
+    free(cmds);
+    return ok;
 }
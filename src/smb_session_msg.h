@@ -40,5 +40,32 @@ int             smb_session_send_msg(smb_session *s, smb_message *msg);
 // memory. It'll be reused on next recv_msg
 size_t          smb_session_recv_msg(smb_session *s, smb_message *msg);
 
+// Waits up to 'timeout' ms (-1 for ever) for a message other than an oplock
+// break, handling the breaks that arrive meanwhile. Returns 1 once 'msg' is
+// received, 0 on timeout or -1 on error
+int             smb_session_wait_msg(smb_session *s, smb_message *msg,
+                                     int timeout);
+
+// Returned by a build callback when item 'i' can't be sent before more
+// answers came
+#define SMB_PIPELINE_LATER  ((smb_message *)-1)
+
+// Builds the request of item 'i', or returns NULL if the item was dealt with
+// without one, or SMB_PIPELINE_LATER
+typedef smb_message *(*smb_pipeline_build)(smb_session *s, size_t i,
+                                           void *opaque);
+// Handles the answer to the request of item 'i'. Returns false to abort
+typedef bool (*smb_pipeline_answer)(smb_session *s, size_t i,
+                                    smb_message *msg, void *opaque);
+
+// Sends the requests of 'count' items without waiting for each answer,
+// keeping as many pending as the server allows. Answers are matched by mux
+// id and may come in any order. Returns false if the connection failed or an
+// answer callback aborted. Returns true early if an item is to be sent later
+// while no answer is pending anymore
+bool            smb_session_pipeline(smb_session *s, size_t count,
+                                     smb_pipeline_build build,
+                                     smb_pipeline_answer answer, void *opaque);
+
 
 #endif
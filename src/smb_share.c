@@ -45,26 +45,24 @@
 #include "smb_share.h"
 #include "smb_file.h"
 
-int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
+// Connects the share 'share->name', setting its server side tid and rights
+static int smb_tree_connect_share(smb_session *s, smb_share *share)
 {
     smb_tree_connect_req  req;
     smb_tree_connect_resp *resp;
     smb_message            resp_msg;
     smb_message           *req_msg;
-    smb_share             *share;
     size_t                 path_len, utf_path_len;
     char                  *path, *utf_path;
 
-    assert(s != NULL && name != NULL && tid != NULL);
-
-    req_msg = smb_message_new(SMB_CMD_TREE_CONNECT);
+    req_msg = smb_message_new(s, SMB_CMD_TREE_CONNECT);
     if (!req_msg)
         return DSM_ERROR_GENERIC;
 
     // Build \\SERVER\Share path from name
-    path_len  = strlen(name) + strlen(s->srv.name) + 4;
+    path_len  = strlen(share->name) + strlen(s->srv.name) + 4;
     path      = alloca(path_len);
-    snprintf(path, path_len, "\\\\%s\\%s", s->srv.name, name);
+    snprintf(path, path_len, "\\\\%s\\%s", s->srv.name, share->name);
     utf_path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
 
     // Packet headers
@@ -105,31 +103,66 @@ int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
     }
 
     resp  = (smb_tree_connect_resp *)resp_msg.packet->payload;
-    share = calloc(1, sizeof(smb_share));
-    if (!share)
-        return DSM_ERROR_GENERIC;
 
-    share->tid          = resp_msg.packet->header.tid;
+    share->srv_tid      = resp_msg.packet->header.tid;
     share->opts         = resp->opt_support;
     share->rights       = resp->max_rights;
     share->guest_rights = resp->guest_rights;
 
+    return DSM_SUCCESS;
+}
+
+int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
+{
+    smb_share             *share;
+    int                    res;
+
+    assert(s != NULL && name != NULL && tid != NULL);
+
+    share = calloc(1, sizeof(smb_share));
+    if (!share)
+        return DSM_ERROR_GENERIC;
+    if ((share->name = strdup(name)) == NULL)
+    {
+        free(share);
+        return DSM_ERROR_GENERIC;
+    }
+
+    if ((res = smb_tree_connect_share(s, share)) != DSM_SUCCESS)
+    {
+        free(share->name);
+        free(share);
+        return res;
+    }
+
     smb_session_share_add(s, share);
 
     *tid = share->tid;
     return 0;
 }
 
+int smb_tree_reconnect(smb_session *s, smb_share *share)
+{
+    assert(s != NULL && share != NULL);
+
+    // Disconnected by the user
+    if (share->name == NULL)
+        return DSM_SUCCESS;
+
+    return smb_tree_connect_share(s, share);
+}
+
 int           smb_tree_disconnect(smb_session *s, smb_tid tid)
 {
     smb_tree_disconnect_req   req;
     smb_tree_disconnect_resp *resp;
+    smb_share                *share;
     smb_message              *req_msg;
     smb_message               resp_msg;
 
     assert(s != NULL);
 
-    req_msg = smb_message_new(SMB_CMD_TREE_DISCONNECT);
+    req_msg = smb_message_new(s, SMB_CMD_TREE_DISCONNECT);
     if (!req_msg)
         return DSM_ERROR_GENERIC;
 
@@ -163,6 +196,13 @@ int           smb_tree_disconnect(smb_session *s, smb_tid tid)
     if ((resp->wct != 0) || (resp->bct != 0))
         return DSM_ERROR_NETWORK;
 
+    // Not to be connected again by smb_session_reconnect()
+    if ((share = smb_session_share_get(s, tid)) != NULL)
+    {
+        free(share->name);
+        share->name = NULL;
+    }
+
     return DSM_SUCCESS;
 }
 
@@ -276,7 +316,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     //// Phase 1:
     // We bind a context or whatever for DCE/RPC
 
-    req = smb_message_new(SMD_CMD_TRANS);
+    req = smb_message_new(s, SMD_CMD_TRANS);
     if (!req)
     {
         ret = DSM_ERROR_GENERIC;
@@ -294,7 +334,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     trans.data_offset            = 84;
     trans.setup_count            = 2;
     trans.pipe_function          = 0x26;
-    trans.fid                    = SMB_FD_FID(srvscv_fd);
+    trans.fid                    = smb_session_srv_fid(s, srvscv_fd);
     trans.bct                    = 89;
     SMB_MSG_PUT_PKT(req, trans);
 
@@ -361,7 +401,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     // Now we have the 'bind' done (regarless of what it is), we'll call
     // NetShareEnumAll
 
-    req = smb_message_new(SMD_CMD_TRANS);
+    req = smb_message_new(s, SMD_CMD_TRANS);
     if (!req)
     {
         ret = DSM_ERROR_GENERIC;
@@ -417,7 +457,7 @@ int             smb_share_get_list(smb_session *s, smb_share_list *list, size_t
     trans.max_data_count   = 4280;
     trans.setup_count      = 2;
     trans.pipe_function    = 0x26; // TransactNmPipe;
-    trans.fid              = SMB_FD_FID(srvscv_fd);
+    trans.fid              = smb_session_srv_fid(s, srvscv_fd);
     trans.bct              = req->cursor - sizeof(smb_trans_req);
     trans.data_count       = trans.bct - 17; // 17 -> padding + \PIPE\ + padding
     trans.total_data_count = trans.data_count;
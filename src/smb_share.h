@@ -32,5 +32,9 @@
 #define _SMB_SHARE_H_
 
 #include "bdsm/smb_share.h"
+#include "smb_types.h"
+
+// Connects again a share after a reconnection, it keeps its user side tid
+int             smb_tree_reconnect(smb_session *s, smb_share *share);
 
 #endif
@@ -101,7 +101,7 @@ static int      negotiate(smb_session *s, const char *domain)
     int                   res, der_size = 128;
     char                  der[128], err_desc[ASN1_MAX_ERROR_DESCRIPTION_SIZE];
 
-    msg = smb_message_new(SMB_CMD_SETUP);
+    msg = smb_message_new(s, SMB_CMD_SETUP);
     if (!msg)
         return DSM_ERROR_GENERIC;
 
@@ -253,7 +253,7 @@ static int      auth(smb_session *s, const char *domain, const char *user,
     int                   res, der_size = 512;
     char                  der[512], err_desc[ASN1_MAX_ERROR_DESCRIPTION_SIZE];
 
-    msg = smb_message_new(SMB_CMD_SETUP);
+    msg = smb_message_new(s, SMB_CMD_SETUP);
     if (!msg)
         return DSM_ERROR_GENERIC;
 
@@ -33,10 +33,14 @@
 #endif
 
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "smb_stat.h"
 #include "smb_fd.h"
 
+#define SMB_STAT_CHUNK_SIZE     16384
+
 smb_stat        smb_stat_fd(smb_session *s, smb_fd fd)
 {
     assert(s != NULL && fd);
@@ -127,3 +131,83 @@ uint64_t          smb_stat_get(smb_stat info, int what)
             return 0;
     }
 }
+
+smb_stat_batch  *smb_stat_batch_new(size_t count)
+{
+    smb_stat_batch  *batch;
+
+    // One allocation for the fixed size part
+    if (count > (SIZE_MAX - sizeof(*batch))
+                / (sizeof(uint32_t) + sizeof(smb_file)))
+        return NULL;
+    batch = calloc(1, sizeof(*batch)
+                   + count * (sizeof(smb_file) + sizeof(uint32_t)));
+    if (batch == NULL)
+        return NULL;
+
+    batch->count  = count;
+    batch->files  = (smb_file *)(batch + 1);
+    batch->status = (uint32_t *)(batch->files + count);
+
+    return batch;
+}
+
+char            *smb_stat_batch_strdup(smb_stat_batch *batch, const char *name)
+{
+    smb_stat_chunk  *chunk;
+    size_t          len, size;
+    char            *copy;
+
+    assert(batch != NULL && name != NULL);
+
+    len   = strlen(name) + 1;
+    chunk = batch->chunks;
+    if (chunk == NULL || chunk->size - chunk->used < len)
+    {
+        size = len > SMB_STAT_CHUNK_SIZE ? len : SMB_STAT_CHUNK_SIZE;
+        if ((chunk = malloc(sizeof(*chunk) + size)) == NULL)
+            return NULL;
+        chunk->used   = 0;
+        chunk->size   = size;
+        chunk->next   = batch->chunks;
+        batch->chunks = chunk;
+    }
+
+    copy = chunk->data + chunk->used;
+    memcpy(copy, name, len);
+    chunk->used += len;
+
+    return copy;
+}
+
+uint32_t        smb_stat_batch_status(smb_stat_batch *batch, size_t index)
+{
+    if (batch == NULL || index >= batch->count)
+        return NT_STATUS_INVALID_PARAMETER;
+
+    return batch->status[index];
+}
+
+smb_stat        smb_stat_batch_at(smb_stat_batch *batch, size_t index)
+{
+    if (batch == NULL || index >= batch->count
+        || batch->status[index] != NT_STATUS_SUCCESS)
+        return NULL;
+
+    return &batch->files[index];
+}
+
+void            smb_stat_batch_destroy(smb_stat_batch *batch)
+{
+    smb_stat_chunk  *chunk;
+
+    if (batch == NULL)
+        return;
+
+    while ((chunk = batch->chunks) != NULL)
+    {
+        batch->chunks = chunk->next;
+        free(chunk);
+    }
+    free(batch);
+}
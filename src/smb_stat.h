@@ -38,4 +38,10 @@
 
 #include "bdsm/smb_stat.h"
 
+// Allocates a batch of 'count' results, all with a success status
+smb_stat_batch  *smb_stat_batch_new(size_t count);
+
+// Stores a copy of 'name' in the batch memory
+char            *smb_stat_batch_strdup(smb_stat_batch *batch, const char *name);
+
 #endif
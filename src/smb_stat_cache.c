@@ -0,0 +1,613 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bdsm_debug.h"
+#include "smb_block_cache.h"
+#include "smb_fd.h"
+#include "smb_stat.h"
+#include "smb_stat_cache.h"
+
+#define STAT_CACHE_BUCKETS  256
+#define STAT_CACHE_MAX      4096
+#define STAT_CACHE_LISTINGS 64
+
+typedef struct stat_cache_entry stat_cache_entry;
+struct stat_cache_entry
+{
+    stat_cache_entry    *next;
+    stat_cache_entry    *lru_prev;      // More recently used
+    stat_cache_entry    *lru_next;      // Less recently used
+    uint32_t            hash;
+    uint64_t            expires;        // Monotonic time in ms
+    smb_file            file;
+    char                key[];          // Normalized path
+};
+
+// A directory whose complete content is in the cache: any other name inside
+// of it is known not to exist until the listing expires
+typedef struct stat_cache_listing stat_cache_listing;
+struct stat_cache_listing
+{
+    stat_cache_listing  *next;
+    uint32_t            hash;
+    uint64_t            expires;        // Monotonic time in ms
+    char                key[];          // Normalized directory path
+};
+
+struct smb_stat_cache
+{
+    unsigned int        ttl;            // In ms
+    bool                negative;       // Answer from listings for absent names
+    size_t              count;
+    unsigned int        generation;     // Incremented each time entries are lost
+    uint64_t            hits;
+    uint64_t            misses;
+    stat_cache_entry    *buckets[STAT_CACHE_BUCKETS];
+    stat_cache_entry    *lru_head;
+    stat_cache_entry    *lru_tail;
+    stat_cache_listing  *listings;      // Most recent first
+    size_t              listing_count;
+};
+
+static uint64_t stat_cache_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+char            *smb_stat_cache_key(const char *dir, const char *name)
+{
+    char    *key, *out;
+    size_t  len;
+
+    len = strlen(dir) + (name ? strlen(name) + 1 : 0) + 2;
+    if ((key = malloc(len)) == NULL)
+        return NULL;
+
+    out = key;
+    *out++ = '\\';
+    for (int i = 0; i < 2; i++)
+    {
+        const char *in = i == 0 ? dir : name;
+
+        for (; in != NULL && *in; in++)
+        {
+            char c = *in == '/' ? '\\' : *in;
+
+            if (c == '\\')
+            {
+                if (out[-1] != '\\')
+                    *out++ = c;
+            }
+            else if (c >= 'A' && c <= 'Z')
+                *out++ = c - 'A' + 'a';
+            else
+                *out++ = c;
+        }
+        if (i == 0 && name != NULL && out[-1] != '\\')
+            *out++ = '\\';
+    }
+    if (out - key > 1 && out[-1] == '\\')
+        out--;
+    *out = 0;
+
+    return key;
+}
+
+// FNV-1a
+static uint32_t stat_cache_hash(const char *key)
+{
+    uint32_t h = 2166136261u;
+
+    for (; *key; key++)
+        h = (h ^ (uint8_t)*key) * 16777619u;
+    return h;
+}
+
+static smb_stat_cache *stat_cache_get(smb_session *s, smb_tid tid)
+{
+    smb_share *share;
+
+    if ((share = smb_session_share_get(s, tid)) == NULL)
+        return NULL;
+    return share->stat_cache;
+}
+
+static void stat_cache_entry_free(stat_cache_entry *e)
+{
+    free(e->file.name);
+    free(e);
+}
+
+static stat_cache_entry **stat_cache_find(smb_stat_cache *c, const char *key,
+                                          uint32_t hash)
+{
+    stat_cache_entry **iter;
+
+    iter = &c->buckets[hash % STAT_CACHE_BUCKETS];
+    while (*iter != NULL && ((*iter)->hash != hash || strcmp((*iter)->key, key)))
+        iter = &(*iter)->next;
+
+    return iter;
+}
+
+static void stat_cache_lru_unlink(smb_stat_cache *c, stat_cache_entry *e)
+{
+    if (e->lru_prev != NULL)
+        e->lru_prev->lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+    if (e->lru_next != NULL)
+        e->lru_next->lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+}
+
+static void stat_cache_lru_push(smb_stat_cache *c, stat_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = c->lru_head;
+    if (c->lru_head != NULL)
+        c->lru_head->lru_prev = e;
+    else
+        c->lru_tail = e;
+    c->lru_head = e;
+}
+
+static void stat_cache_remove(smb_stat_cache *c, stat_cache_entry **link)
+{
+    stat_cache_entry *e = *link;
+
+    *link = e->next;
+    stat_cache_lru_unlink(c, e);
+    stat_cache_entry_free(e);
+    c->count--;
+}
+
+static void stat_cache_unlist(smb_stat_cache *c, stat_cache_listing **link)
+{
+    stat_cache_listing *l = *link;
+
+    *link = l->next;
+    free(l);
+    c->listing_count--;
+}
+
+static void stat_cache_clear(smb_stat_cache *c)
+{
+    for (size_t i = 0; i < STAT_CACHE_BUCKETS; i++)
+        while (c->buckets[i] != NULL)
+            stat_cache_remove(c, &c->buckets[i]);
+    while (c->listings != NULL)
+        stat_cache_unlist(c, &c->listings);
+    c->generation++;
+}
+
+static void stat_cache_list(smb_stat_cache *c, const char *key, uint64_t now)
+{
+    stat_cache_listing  **iter, *l;
+    uint32_t            hash;
+    size_t              key_len;
+
+    hash = stat_cache_hash(key);
+    iter = &c->listings;
+    while (*iter != NULL)
+    {
+        if ((*iter)->hash == hash && !strcmp((*iter)->key, key))
+            stat_cache_unlist(c, iter);
+        else if ((*iter)->next == NULL && c->listing_count >= STAT_CACHE_LISTINGS)
+            stat_cache_unlist(c, iter);
+        else
+            iter = &(*iter)->next;
+    }
+
+    key_len = strlen(key);
+    if ((l = malloc(sizeof(*l) + key_len + 1)) == NULL)
+        return;
+    memcpy(l->key, key, key_len + 1);
+    l->hash     = hash;
+    l->expires  = now + c->ttl;
+    l->next     = c->listings;
+    c->listings = l;
+    c->listing_count++;
+}
+
+// Is the name designated by key (which has no entry) absent from a listing
+// of its parent directory ?
+static bool stat_cache_absent(smb_stat_cache *c, const char *key, uint64_t now)
+{
+    stat_cache_listing  **iter;
+    const char          *sep;
+    size_t              dir_len;
+    uint32_t            hash = 2166136261u;
+
+    if (!c->negative || (sep = strrchr(key, '\\')) == NULL || sep[1] == 0)
+        return false;
+
+    dir_len = sep == key ? 1 : (size_t)(sep - key);
+    for (size_t i = 0; i < dir_len; i++)
+        hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+
+    for (iter = &c->listings; *iter != NULL; iter = &(*iter)->next)
+    {
+        if ((*iter)->hash != hash || strncmp((*iter)->key, key, dir_len)
+            || (*iter)->key[dir_len] != 0)
+            continue;
+        if ((*iter)->expires > now)
+            return true;
+        stat_cache_unlist(c, iter);
+        break;
+    }
+
+    return false;
+}
+
+// Make room for one entry, dropping the least recently used ones
+static void stat_cache_evict(smb_stat_cache *c)
+{
+    stat_cache_entry *e;
+
+    while (c->count >= STAT_CACHE_MAX && (e = c->lru_tail) != NULL)
+        stat_cache_remove(c, stat_cache_find(c, e->key, e->hash));
+    c->generation++;
+}
+
+static bool stat_cache_insert(smb_stat_cache *c, char *key, const smb_file *f,
+                              uint64_t now)
+{
+    stat_cache_entry    **link, *e;
+    uint32_t            hash;
+    size_t              key_len;
+
+    hash = stat_cache_hash(key);
+    link = stat_cache_find(c, key, hash);
+    if (*link != NULL)
+        stat_cache_remove(c, link);
+
+    if (c->count >= STAT_CACHE_MAX)
+    {
+        stat_cache_evict(c);
+        link = &c->buckets[hash % STAT_CACHE_BUCKETS];
+    }
+
+    key_len = strlen(key);
+    if ((e = malloc(sizeof(*e) + key_len + 1)) == NULL)
+        return false;
+    memcpy(e->key, key, key_len + 1);
+    e->hash    = hash;
+    e->expires = now + c->ttl;
+    e->file    = *f;
+    e->file.next   = NULL;
+    e->file.fid    = 0;
+    e->file.tid    = 0;
+    e->file.offset = 0;
+    e->file.name   = f->name ? strdup(f->name) : NULL;
+    if (f->name && !e->file.name)
+    {
+        free(e);
+        return false;
+    }
+
+    e->next = *link;
+    *link   = e;
+    stat_cache_lru_push(c, e);
+    c->count++;
+
+    return true;
+}
+
+static void stat_cache_drop(smb_stat_cache *c, const char *key)
+{
+    stat_cache_entry **link;
+
+    link = stat_cache_find(c, key, stat_cache_hash(key));
+    if (*link != NULL)
+        stat_cache_remove(c, link);
+}
+
+void            smb_stat_cache_destroy(smb_stat_cache *c)
+{
+    if (c == NULL)
+        return;
+
+    stat_cache_clear(c);
+    free(c);
+}
+
+smb_file        *smb_stat_cache_lookup(smb_session *s, smb_tid tid,
+                                       const char *path, bool *absent)
+{
+    smb_stat_cache      *c;
+    stat_cache_entry    **link;
+    smb_file            *f;
+    char                *key;
+    uint64_t            now;
+
+    assert(s != NULL && path != NULL);
+
+    if (absent != NULL)
+        *absent = false;
+    if ((c = stat_cache_get(s, tid)) == NULL)
+        return NULL;
+    if ((key = smb_stat_cache_key(path, NULL)) == NULL)
+        return NULL;
+
+    now  = stat_cache_now();
+    link = stat_cache_find(c, key, stat_cache_hash(key));
+    if (*link != NULL && (*link)->expires <= now)
+    {
+        stat_cache_remove(c, link);
+        link = NULL;
+    }
+    if (link == NULL || *link == NULL)
+    {
+        if (absent != NULL && stat_cache_absent(c, key, now))
+        {
+            *absent = true;
+            c->hits++;
+        }
+        else
+            c->misses++;
+        free(key);
+        return NULL;
+    }
+    free(key);
+
+    stat_cache_lru_unlink(c, *link);
+    stat_cache_lru_push(c, *link);
+
+    if ((f = malloc(sizeof(*f))) == NULL)
+        return NULL;
+    *f = (*link)->file;
+    if (f->name != NULL && (f->name = strdup(f->name)) == NULL)
+    {
+        free(f);
+        return NULL;
+    }
+    c->hits++;
+
+    return f;
+}
+
+void            smb_stat_cache_store(smb_session *s, smb_tid tid,
+                                     const char *path, const smb_file *f)
+{
+    smb_stat_cache  *c;
+    char            *key;
+
+    assert(s != NULL && path != NULL && f != NULL);
+
+    if ((c = stat_cache_get(s, tid)) == NULL)
+        return;
+    if ((key = smb_stat_cache_key(path, NULL)) == NULL)
+        return;
+
+    stat_cache_insert(c, key, f, stat_cache_now());
+    free(key);
+}
+
+bool            smb_stat_cache_absent(smb_session *s, smb_tid tid,
+                                      const char *path)
+{
+    smb_file    *f;
+    bool        absent;
+
+    if ((f = smb_stat_cache_lookup(s, tid, path, &absent)) != NULL)
+        smb_stat_destroy(f);
+
+    return absent;
+}
+
+void            smb_stat_cache_store_list(smb_session *s, smb_tid tid,
+                                          const char *pattern,
+                                          const smb_file *list, bool complete)
+{
+    smb_stat_cache  *c;
+    const char      *sep;
+    char            *dir, *key;
+    uint64_t        now;
+    unsigned int    generation;
+
+    assert(s != NULL && pattern != NULL);
+
+    if ((c = stat_cache_get(s, tid)) == NULL)
+        return;
+
+    // Entries are named relatively to the directory part of the pattern
+    sep = strrchr(pattern, '\\');
+    if (strrchr(pattern, '/') > sep)
+        sep = strrchr(pattern, '/');
+    if ((dir = strndup(pattern, sep ? (size_t)(sep - pattern) : 0)) == NULL)
+        return;
+
+    // Only a whole directory listing tells which names do not exist
+    complete   = complete && !strcmp(sep ? sep + 1 : pattern, "*");
+    generation = c->generation;
+    now        = stat_cache_now();
+    for (; list != NULL; list = list->next)
+    {
+        if (list->name == NULL || !strcmp(list->name, ".")
+            || !strcmp(list->name, ".."))
+            continue;
+        if ((key = smb_stat_cache_key(dir, list->name)) == NULL
+            || !stat_cache_insert(c, key, list, now))
+            complete = false;
+        free(key);
+    }
+
+    // The listing is only usable if none of its entries got evicted meanwhile
+    if (complete && generation == c->generation
+        && (key = smb_stat_cache_key(dir, NULL)) != NULL)
+    {
+        stat_cache_list(c, key, now);
+        free(key);
+    }
+    free(dir);
+}
+
+void            smb_stat_cache_invalidate(smb_session *s, smb_tid tid,
+                                          const char *path, bool recursive)
+{
+    smb_stat_cache      *c;
+    stat_cache_entry    **iter;
+    stat_cache_listing  **iter_l;
+    char                *key, *sep;
+    size_t              key_len, parent_len;
+
+    assert(s != NULL && path != NULL);
+
+    // Every modification goes through here, file data included
+    smb_block_cache_invalidate(s, tid, path, recursive);
+
+    if ((c = stat_cache_get(s, tid)) == NULL)
+        return;
+    if ((key = smb_stat_cache_key(path, NULL)) == NULL)
+    {
+        stat_cache_clear(c);
+        return;
+    }
+
+    stat_cache_drop(c, key);
+    key_len = strlen(key);
+    if (recursive)
+    {
+        for (size_t i = 0; i < STAT_CACHE_BUCKETS; i++)
+        {
+            iter = &c->buckets[i];
+            while (*iter != NULL)
+            {
+                if (!strncmp((*iter)->key, key, key_len)
+                    && (*iter)->key[key_len] == '\\')
+                    stat_cache_remove(c, iter);
+                else
+                    iter = &(*iter)->next;
+            }
+        }
+    }
+
+    sep        = strrchr(key, '\\');
+    parent_len = sep == key ? 1 : (size_t)(sep - key);
+
+    // The listings of the parent and of path (and below) are outdated
+    iter_l = &c->listings;
+    while (*iter_l != NULL)
+    {
+        const char *lkey = (*iter_l)->key;
+
+        if ((!strncmp(lkey, key, parent_len) && lkey[parent_len] == 0)
+            || (!strncmp(lkey, key, key_len) && (lkey[key_len] == 0
+                || (recursive && lkey[key_len] == '\\'))))
+            stat_cache_unlist(c, iter_l);
+        else
+            iter_l = &(*iter_l)->next;
+    }
+
+    // The parent directory times change too
+    key[parent_len] = 0;
+    stat_cache_drop(c, key);
+    free(key);
+}
+
+int             smb_stat_cache_enable(smb_session *s, smb_tid tid,
+                                      unsigned int ttl)
+{
+    smb_share   *share;
+
+    assert(s != NULL);
+
+    if ((share = smb_session_share_get(s, tid)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (ttl == 0)
+    {
+        smb_stat_cache_destroy(share->stat_cache);
+        share->stat_cache = NULL;
+        return DSM_SUCCESS;
+    }
+
+    if (share->stat_cache == NULL)
+    {
+        share->stat_cache = calloc(1, sizeof(smb_stat_cache));
+        if (share->stat_cache == NULL)
+            return DSM_ERROR_GENERIC;
+    }
+    share->stat_cache->ttl = ttl;
+
+    return DSM_SUCCESS;
+}
+
+int             smb_stat_cache_negative(smb_session *s, smb_tid tid,
+                                        int enable)
+{
+    smb_stat_cache  *c;
+
+    assert(s != NULL);
+
+    if ((c = stat_cache_get(s, tid)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    c->negative = enable != 0;
+    return DSM_SUCCESS;
+}
+
+void            smb_stat_cache_flush(smb_session *s, smb_tid tid)
+{
+    smb_stat_cache  *c;
+
+    assert(s != NULL);
+
+    if ((c = stat_cache_get(s, tid)) != NULL)
+        stat_cache_clear(c);
+}
+
+void            smb_stat_cache_counters(smb_session *s, smb_tid tid,
+                                        uint64_t *hits, uint64_t *misses)
+{
+    smb_stat_cache  *c;
+
+    assert(s != NULL);
+
+    c = stat_cache_get(s, tid);
+    if (hits != NULL)
+        *hits = c ? c->hits : 0;
+    if (misses != NULL)
+        *misses = c ? c->misses : 0;
+}
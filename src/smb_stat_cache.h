@@ -0,0 +1,75 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @internal
+ * @file smb_stat_cache.h
+ * @brief Per-share cache of file attributes
+ */
+
+#ifndef _SMB_STAT_CACHE_H_
+#define _SMB_STAT_CACHE_H_
+
+#include <stdbool.h>
+
+#include "smb_types.h"
+
+typedef struct smb_stat_cache smb_stat_cache;
+
+void            smb_stat_cache_destroy(smb_stat_cache *c);
+
+// Paths are compared case insensitively, with '/' accepted as a separator,
+// duplicated and trailing separators removed and a leading one added. name
+// can be NULL, otherwise it is appended to dir. Returns a newly allocated
+// string or NULL
+char            *smb_stat_cache_key(const char *dir, const char *name);
+
+// Returns a copy of the cached attributes of path, or NULL. The caller owns
+// the returned smb_file and must free it with smb_stat_destroy(). If absent
+// is not NULL, it is set when path is known not to exist
+smb_file        *smb_stat_cache_lookup(smb_session *s, smb_tid tid,
+                                       const char *path, bool *absent);
+// Is path known not to exist ?
+bool            smb_stat_cache_absent(smb_session *s, smb_tid tid,
+                                      const char *path);
+void            smb_stat_cache_store(smb_session *s, smb_tid tid,
+                                     const char *path, const smb_file *f);
+// Stores every entry of a smb_find() result, pattern being the one used to
+// obtain the listing. complete tells the search ran until its end, in which
+// case a '*' pattern also records which names do not exist
+void            smb_stat_cache_store_list(smb_session *s, smb_tid tid,
+                                          const char *pattern,
+                                          const smb_file *list, bool complete);
+// Drops path and its parent directory. If recursive is true, everything
+// below path is dropped as well
+void            smb_stat_cache_invalidate(smb_session *s, smb_tid tid,
+                                          const char *path, bool recursive);
+
+#endif
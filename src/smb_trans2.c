@@ -33,6 +33,8 @@
 #endif
 
 #include <stdlib.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
@@ -42,8 +44,10 @@
 #include "smb_message.h"
 #include "smb_session.h"
 #include "smb_session_msg.h"
+#include "smb_fd.h"
 #include "smb_utils.h"
 #include "smb_stat.h"
+#include "smb_stat_cache.h"
 
 /*
  * Receive trans2 management
@@ -53,36 +57,61 @@ static smb_message *smb_tr2_recv(smb_session *s)
 {
     smb_message           recv, *res;
     smb_trans2_resp       *tr2;
-    size_t                growth;
-    int                   remaining;
+    size_t                total, received, base;
+    size_t                offset, count, displacement;
 
     if (!smb_session_recv_msg(s, &recv))
         return NULL;
     tr2         = (smb_trans2_resp *)recv.packet->payload;
-    growth      = tr2->total_data_count - tr2->data_count;
-    res         = smb_message_grow(&recv, growth);
+    total       = tr2->total_data_count;
+    if (tr2->data_count > total || tr2->data_count > recv.payload_size)
+        return NULL;
+
+    // The first fragment is copied once into a message already large enough
+    // to hold the whole data block; the following fragments are then placed
+    // at their displacement, without any further allocation.
+    res         = smb_message_grow(&recv, total - tr2->data_count);
     if (!res)
         return NULL;
-    res->cursor = recv.payload_size;
-    remaining   = (int)tr2->total_data_count -
-                  (tr2->data_displacement + tr2->data_count);
+    base        = recv.payload_size - tr2->data_count;
+    received    = tr2->data_count;
+    res->cursor = res->payload_size;
 
-    while (remaining > 0)
+    while (received < total)
     {
-        remaining = smb_session_recv_msg(s, &recv);
-        if (remaining)
+        if (!smb_session_recv_msg(s, &recv))
+            break;
+        tr2          = (smb_trans2_resp *)recv.packet->payload;
+        offset       = tr2->data_offset;
+        count        = tr2->data_count;
+        displacement = tr2->data_displacement;
+
+        // data_offset is relative to the start of the SMB header
+        if (offset < sizeof(smb_header)
+            || offset + count > sizeof(smb_header) + recv.payload_size
+            || displacement + count > total)
         {
-            tr2   = (smb_trans2_resp *)recv.packet->payload;
-            /*
-             * XXX: Why does padding was necessary and is not anymore, i.e.
-             * find a reproductible setup where it is
-             */
-            smb_message_append(res, tr2->payload /* + 2 pad */, tr2->data_count);
-            remaining = (int)tr2->total_data_count -
-                        (tr2->data_displacement + tr2->data_count);
+            BDSM_dbg("smb_tr2_recv: Invalid fragment (%zu@%zu)\n",
+                     count, displacement);
+            break;
         }
+
+        memcpy(res->packet->payload + base + displacement,
+               (uint8_t *)recv.packet + offset, count);
+        received += count;
+
+        // The server is allowed to lower the total count on later fragments
+        if (tr2->total_data_count < total)
+            total = tr2->total_data_count;
     }
 
+    if (received < total)
+    {
+        smb_message_destroy(res);
+        return NULL;
+    }
+    res->payload_size = base + total;
+
     return res;
 }
 
@@ -90,20 +119,55 @@ static smb_message *smb_tr2_recv(smb_session *s)
  * Find management
  */
 
-static void smb_tr2_find2_parse_entries(smb_file **files_p, smb_tr2_find2_entry *iter, size_t count, uint8_t *eod)
+static void smb_tr2_find2_parse_entries(smb_file **files_p, uint8_t *iter,
+                                        size_t count, uint8_t *eod,
+                                        uint16_t interest)
 {
-    smb_file *tmp = NULL;
-    size_t   i;
+    smb_tr2_find2_entry       *entry;
+    smb_tr2_find2_names_entry *names;
+    smb_file                  *tmp = NULL;
+    size_t                    i, name_offset, name_len, next;
+
+    // All levels but NAMES_INFO share their layout up to the name length
+    switch (interest)
+    {
+        case SMB_FIND2_INTEREST_NAMES_INFO:
+            name_offset = offsetof(smb_tr2_find2_names_entry, name);
+            break;
+        case SMB_FIND2_INTEREST_DIRECTORY_INFO:
+            name_offset = offsetof(smb_tr2_find2_entry, ea_list_len);
+            break;
+        case SMB_FIND2_INTEREST_FULL_DIRECTORY_INFO:
+            name_offset = offsetof(smb_tr2_find2_entry, short_name_len);
+            break;
+        default:
+            name_offset = offsetof(smb_tr2_find2_entry, name);
+    }
 
-    for (i = 0; i < count && (uint8_t *)iter < eod; i++)
+    for (i = 0; i < count && iter + name_offset <= eod; i++)
     {
+        entry = (smb_tr2_find2_entry *)iter;
+        names = (smb_tr2_find2_names_entry *)iter;
+        if (interest == SMB_FIND2_INTEREST_NAMES_INFO)
+        {
+            name_len = names->name_len;
+            next     = names->next_entry;
+        }
+        else
+        {
+            name_len = entry->name_len;
+            next     = entry->next_entry;
+        }
+        if (name_len > (size_t)(eod - iter) - name_offset)
+            return;
+
         // Create a smb_file and fill it
         tmp = calloc(1, sizeof(smb_file));
         if (!tmp)
             return;
 
-        tmp->name_len = smb_from_utf16((const char *)iter->name, iter->name_len,
-                                       &tmp->name);
+        tmp->name_len = smb_from_utf16((const char *)iter + name_offset,
+                                       name_len, &tmp->name);
         if (tmp->name_len == 0)
         {
             free(tmp);
@@ -111,29 +175,81 @@ static void smb_tr2_find2_parse_entries(smb_file **files_p, smb_tr2_find2_entry
         }
         tmp->name[tmp->name_len] = 0;
 
-        tmp->created    = iter->created;
-        tmp->accessed   = iter->accessed;
-        tmp->written    = iter->written;
-        tmp->changed    = iter->changed;
-        tmp->size       = iter->size;
-        tmp->alloc_size = iter->alloc_size;
-        tmp->attr       = iter->attr;
-        tmp->is_dir     = tmp->attr & SMB_ATTR_DIR;
+        if (interest != SMB_FIND2_INTEREST_NAMES_INFO)
+        {
+            tmp->created    = entry->created;
+            tmp->accessed   = entry->accessed;
+            tmp->written    = entry->written;
+            tmp->changed    = entry->changed;
+            tmp->size       = entry->size;
+            tmp->alloc_size = entry->alloc_size;
+            tmp->attr       = entry->attr;
+            tmp->is_dir     = tmp->attr & SMB_ATTR_DIR;
+        }
 
         tmp->next = *files_p;
         *files_p  = tmp;
 
-        iter = (smb_tr2_find2_entry *)(((char *)iter) + iter->next_entry);
+        if (next == 0)
+            break;
+        iter += next;
     }
 
     return;
 }
 
-static void smb_find_first_parse(smb_message *msg, smb_file **files_p)
+// How many entries, and how many bytes of them, to ask for in each FIND2
+// request. The data count is limited to 16 bits by the TRANS2 headers;
+// servers split larger replies in fragments, except old ones without large
+// read support which we keep within their negotiated buffer. The count is
+// set so that it is never the limit: the server fills the data count with
+// as many entries as fit.
+static void smb_find_batch(smb_session *s, uint16_t interest,
+                           uint16_t *count, uint16_t *data_count)
+{
+    size_t  min_entry, max_data = UINT16_MAX;
+
+    if (!(s->srv.caps & SMB_CAPS_LARGE_READX) && s->srv.max_bufsize != 0
+        && s->srv.max_bufsize < max_data + sizeof(smb_packet)
+                                + sizeof(smb_trans2_resp))
+        max_data = s->srv.max_bufsize - sizeof(smb_packet)
+                   - sizeof(smb_trans2_resp);
+
+    // Fixed part, one UTF-16 character and the 8 bytes alignment
+    switch (interest)
+    {
+        case SMB_FIND2_INTEREST_NAMES_INFO:
+            min_entry = sizeof(smb_tr2_find2_names_entry);
+            break;
+        case SMB_FIND2_INTEREST_DIRECTORY_INFO:
+            min_entry = offsetof(smb_tr2_find2_entry, ea_list_len);
+            break;
+        case SMB_FIND2_INTEREST_FULL_DIRECTORY_INFO:
+            min_entry = offsetof(smb_tr2_find2_entry, short_name_len);
+            break;
+        default:
+            min_entry = sizeof(smb_tr2_find2_entry);
+    }
+    min_entry = (min_entry + 2 + 7) & ~(size_t)7;
+
+    *data_count = max_data;
+    *count      = max_data / min_entry;
+}
+
+static void smb_find_account(smb_session *s, uint16_t entries)
+{
+    s->find_requests++;
+    s->find_entries += entries;
+    BDSM_dbg("FIND2 round trip %"PRIu64": %u entries (%"PRIu64" in total)\n",
+             s->find_requests, entries, s->find_entries);
+}
+
+static void smb_find_first_parse(smb_message *msg, smb_file **files_p,
+                                 uint16_t interest)
 {
     smb_trans2_resp       *tr2;
     smb_tr2_findfirst2_params  *params;
-    smb_tr2_find2_entry   *iter;
+    uint8_t               *iter;
     uint8_t               *eod;
     size_t                count;
 
@@ -142,19 +258,20 @@ static void smb_find_first_parse(smb_message *msg, smb_file **files_p)
     // Let's parse the answer we got from server
     tr2     = (smb_trans2_resp *)msg->packet->payload;
     params  = (smb_tr2_findfirst2_params *)tr2->payload;
-    iter    = (smb_tr2_find2_entry *)(tr2->payload + sizeof(smb_tr2_findfirst2_params));
+    iter    = tr2->payload + sizeof(smb_tr2_findfirst2_params);
     eod     = msg->packet->payload + msg->payload_size;
     count   = params->count;
 
-    smb_tr2_find2_parse_entries(files_p, iter, count, eod);
+    smb_tr2_find2_parse_entries(files_p, iter, count, eod, interest);
     return;
 }
 
-static void smb_find_next_parse(smb_message *msg, smb_file **files_p)
+static void smb_find_next_parse(smb_message *msg, smb_file **files_p,
+                                uint16_t interest)
 {
     smb_trans2_resp       *tr2;
     smb_tr2_findnext2_params  *params;
-    smb_tr2_find2_entry   *iter;
+    uint8_t               *iter;
     uint8_t               *eod;
     size_t                count;
 
@@ -163,14 +280,14 @@ static void smb_find_next_parse(smb_message *msg, smb_file **files_p)
     // Let's parse the answer we got from server
     tr2     = (smb_trans2_resp *)msg->packet->payload;
     params  = (smb_tr2_findnext2_params *)tr2->payload;
-    iter    = (smb_tr2_find2_entry *)(tr2->payload + sizeof(smb_tr2_findnext2_params));
+    iter    = tr2->payload + sizeof(smb_tr2_findnext2_params);
     eod     = msg->packet->payload + msg->payload_size;
     count   = params->count;
-    smb_tr2_find2_parse_entries(files_p, iter, count, eod);
+    smb_tr2_find2_parse_entries(files_p, iter, count, eod, interest);
     return;
 }
 
-static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const char *pattern)
+static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const char *pattern, uint16_t interest)
 {
     smb_message           *msg;
     smb_trans2_req        tr2;
@@ -179,6 +296,7 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
     char                  *utf_pattern;
     int                   res;
     unsigned int          padding = 0;
+    uint16_t              count, data_count;
 
     assert(s != NULL && pattern != NULL);
 
@@ -196,7 +314,9 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
         tr2_bct++;
     }
 
-    msg = smb_message_new(SMB_CMD_TRANS2);
+    smb_find_batch(s, interest, &count, &data_count);
+
+    msg = smb_message_new(s, SMB_CMD_TRANS2);
     if (!msg) {
         free(utf_pattern);
         return NULL;
@@ -206,7 +326,7 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
     SMB_MSG_INIT_PKT(tr2);
     tr2.wct                = 15;
     tr2.max_param_count    = 10; // ?? Why not the same or 12 ?
-    tr2.max_data_count     = 0xffff;;
+    tr2.max_data_count     = data_count;
     tr2.param_offset       = 68; // Offset of find_first_params in packet;
     tr2.data_count         = 0;
     tr2.data_offset        = 88; // Offset of pattern in packet
@@ -219,9 +339,9 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
 
     SMB_MSG_INIT_PKT(find);
     find.attrs     = SMB_FIND2_ATTR_DEFAULT;
-    find.count     = 1366;     // ??
+    find.count     = count;
     find.flags     = SMB_FIND2_FLAG_CLOSE_EOS | SMB_FIND2_FLAG_RESUME;
-    find.interest  = SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO;
+    find.interest  = interest;
     SMB_MSG_PUT_PKT(msg, find);
     smb_message_append(msg, utf_pattern, utf_pattern_len);
     while (padding--)
@@ -241,7 +361,7 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
     return msg;
 }
 
-static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t resume_key, uint16_t sid, const char *pattern)
+static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t resume_key, uint16_t sid, const char *pattern, uint16_t interest)
 {
     smb_message           *msg_find_next2 = NULL;
     smb_trans2_req        tr2_find_next2;
@@ -250,6 +370,7 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
     char                  *utf_pattern;
     int                   res;
     unsigned int          padding = 0;
+    uint16_t              count, data_count;
 
     assert(s != NULL && pattern != NULL);
 
@@ -267,7 +388,9 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
         tr2_bct++;
     }
 
-    msg_find_next2 = smb_message_new(SMB_CMD_TRANS2);
+    smb_find_batch(s, interest, &count, &data_count);
+
+    msg_find_next2 = smb_message_new(s, SMB_CMD_TRANS2);
     if (!msg_find_next2)
     {
         free(utf_pattern);
@@ -280,7 +403,7 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
     tr2_find_next2.total_param_count  = tr2_param_count;
     tr2_find_next2.total_data_count   = 0x0000;
     tr2_find_next2.max_param_count    = 10; // ?? Why not the same or 12 ?
-    tr2_find_next2.max_data_count     = 0xffff;
+    tr2_find_next2.max_data_count     = data_count;
     //max_setup_count
     //reserved
     //flags
@@ -298,8 +421,8 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
 
     SMB_MSG_INIT_PKT(find_next2);
     find_next2.sid        = sid;
-    find_next2.count      = 255;
-    find_next2.interest   = SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO;
+    find_next2.count      = count;
+    find_next2.interest   = interest;
     find_next2.flags      = SMB_FIND2_FLAG_CLOSE_EOS|SMB_FIND2_FLAG_CONTINUE;
     find_next2.resume_key = resume_key;
     SMB_MSG_PUT_PKT(msg_find_next2, find_next2);
@@ -321,7 +444,24 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
     return msg_find_next2;
 }
 
+void smb_find_counters(smb_session *s, uint64_t *round_trips,
+                       uint64_t *entries)
+{
+    assert(s != NULL);
+
+    if (round_trips != NULL)
+        *round_trips = s->find_requests;
+    if (entries != NULL)
+        *entries = s->find_entries;
+}
+
 smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
+{
+    return smb_find_info(s, tid, pattern, SMB_FIND_INFO_BOTH);
+}
+
+smb_file  *smb_find_info(smb_session *s, smb_tid tid, const char *pattern,
+                         int level)
 {
     smb_file                  *files = NULL;
     smb_message               *msg;
@@ -329,17 +469,30 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
     smb_tr2_findfirst2_params *findfirst2_params;
     smb_tr2_findnext2_params  *findnext2_params;
     bool                      end_of_search;
+    bool                      complete = false;
     uint16_t                  sid;
     uint16_t                  resume_key;
     uint16_t                  error_offset;
 
     assert(s != NULL && pattern != NULL);
 
+    switch (level)
+    {
+        case SMB_FIND_INFO_NAMES:
+        case SMB_FIND_INFO_DIRECTORY:
+        case SMB_FIND_INFO_FULL:
+        case SMB_FIND_INFO_BOTH:
+            break;
+        default:
+            BDSM_dbg("smb_find_info: Unsupported level 0x%x\n", level);
+            return NULL;
+    }
+
     // Send FIND_FIRST request
-    msg = smb_trans2_find_first(s,tid,pattern);
+    msg = smb_trans2_find_first(s, tid, pattern, level);
     if (msg)
     {
-        smb_find_first_parse(msg,&files);
+        smb_find_first_parse(msg, &files, level);
         if (files)
         {
             // Check if we shall send a FIND_NEXT request
@@ -350,6 +503,7 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
             end_of_search     = findfirst2_params->eos;
             resume_key        = findfirst2_params->last_name_offset;
             error_offset      = findfirst2_params->ea_error_offset;
+            smb_find_account(s, findfirst2_params->count);
 
             smb_message_destroy(msg);
 
@@ -357,7 +511,8 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
             // or until an error occurs
             while ((!end_of_search) && (error_offset == 0))
             {
-                msg = smb_trans2_find_next(s, tid, resume_key, sid, pattern);
+                msg = smb_trans2_find_next(s, tid, resume_key, sid, pattern,
+                                           level);
 
                 if (msg)
                 {
@@ -367,9 +522,10 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
                     end_of_search    = findnext2_params->eos;
                     resume_key       = findnext2_params->last_name_offset;
                     error_offset     = findnext2_params->ea_error_offset;
+                    smb_find_account(s, findnext2_params->count);
 
                     // parse the result for files
-                    smb_find_next_parse(msg, &files);
+                    smb_find_next_parse(msg, &files, level);
                     smb_message_destroy(msg);
 
                     if (!files)
@@ -385,6 +541,7 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
                     return NULL;
                 }
             }
+            complete = files != NULL && error_offset == 0;
         }
         else
         {
@@ -400,6 +557,9 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
         return NULL;
     }
 
+    // Names only listings have no attributes to cache
+    if (level != SMB_FIND_INFO_NAMES)
+        smb_stat_cache_store_list(s, tid, pattern, files, complete);
     return files;
 }
 
@@ -407,33 +567,30 @@ smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
  * Query management
  */
 
-smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
+// Builds a QUERY_PATH_INFO request for 'path', ready to be sent
+static smb_message *smb_fstat_msg(smb_session *s, smb_tid tid,
+                                  const char *path)
 {
-    smb_message           *msg, reply;
+    smb_message           *msg;
     smb_trans2_req        tr2;
-    smb_trans2_resp       *tr2_resp;
     smb_tr2_query         query;
-    smb_tr2_path_info     *info;
-    smb_file              *file;
     size_t                utf_path_len, msg_len;
     char                  *utf_path;
-    int                   res, padding = 0;
-
-    assert(s != NULL && path != NULL);
+    int                   padding = 0;
 
     utf_path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
     if (utf_path_len == 0)
-        return 0;
+        return NULL;
 
     msg_len   = sizeof(smb_trans2_req) + sizeof(smb_tr2_query);
     msg_len  += utf_path_len;
     if (msg_len %4)
         padding = 4 - msg_len % 4;
 
-    msg = smb_message_new(SMB_CMD_TRANS2);
+    msg = smb_message_new(s, SMB_CMD_TRANS2);
     if (!msg) {
         free(utf_path);
-        return 0;
+        return NULL;
     }
     msg->packet->header.tid = tid;
 
@@ -462,6 +619,63 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
     while (padding--)
         smb_message_put8(msg, 0);
 
+    return msg;
+}
+
+// Fills 'file' from a successful QUERY_PATH_INFO answer. The name is
+// allocated
+static bool smb_fstat_parse(smb_message *reply, smb_file *file)
+{
+    smb_trans2_resp       *tr2_resp;
+    smb_tr2_path_info     *info;
+
+    if (reply->payload_size < sizeof(smb_tr2_path_info))
+        return false;
+
+    tr2_resp  = (smb_trans2_resp *)reply->packet->payload;
+    info      = (smb_tr2_path_info *)(tr2_resp->payload + 4); //+4 is padding
+
+    if (info->name + info->name_len > reply->packet->payload + reply->payload_size)
+        return false;
+
+    file->name_len  = smb_from_utf16((const char *)info->name, info->name_len,
+                                     &file->name);
+    if (file->name == NULL)
+        return false;
+    file->name[info->name_len / 2] = 0;
+
+    file->created     = info->created;
+    file->accessed    = info->accessed;
+    file->written     = info->written;
+    file->changed     = info->changed;
+    file->alloc_size  = info->alloc_size;
+    file->size        = info->size;
+    file->attr        = info->attr;
+    file->is_dir      = info->is_dir;
+
+    return true;
+}
+
+smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_message           *msg, reply;
+    smb_file              *file;
+    int                   res;
+    bool                  absent;
+
+    assert(s != NULL && path != NULL);
+
+    if ((file = smb_stat_cache_lookup(s, tid, path, &absent)) != NULL)
+        return file;
+    if (absent)
+    {
+        s->nt_status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+        return NULL;
+    }
+
+    if ((msg = smb_fstat_msg(s, tid, path)) == NULL)
+        return NULL;
+
     res = smb_session_send_msg(s, msg);
     smb_message_destroy(msg);
     if (!res)
@@ -477,37 +691,238 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
         return NULL;
     }
 
-    if (reply.payload_size < sizeof(smb_tr2_path_info))
+    file      = calloc(1, sizeof(smb_file));
+    if (!file)
+        return NULL;
+
+    if (!smb_fstat_parse(&reply, file))
     {
         BDSM_dbg("[smb_fstat]Malformed message %s\n", path);
+        free(file);
         return NULL;
     }
 
-    tr2_resp  = (smb_trans2_resp *)reply.packet->payload;
-    info      = (smb_tr2_path_info *)(tr2_resp->payload + 4); //+4 is padding
+    smb_stat_cache_store(s, tid, path, file);
+    return file;
+}
 
-    if (info->name + info->name_len > reply.packet->payload + reply.payload_size)
+typedef struct
+{
+    smb_tid             tid;
+    const char *const   *paths;
+    smb_stat_batch      *batch;
+} smb_fstat_many_ctx;
+
+// Moves an allocated smb_file into entry 'i' of the batch
+static bool smb_fstat_many_set(smb_stat_batch *batch, size_t i, smb_file *f)
+{
+    char    *name = NULL;
+
+    if (f->name != NULL
+        && (name = smb_stat_batch_strdup(batch, f->name)) == NULL)
+        return false;
+    free(f->name);
+
+    batch->files[i]       = *f;
+    batch->files[i].name  = name;
+    batch->files[i].next  = NULL;
+    batch->status[i]      = NT_STATUS_SUCCESS;
+
+    return true;
+}
+
+static smb_message *smb_fstat_many_build(smb_session *s, size_t i,
+                                         void *opaque)
+{
+    smb_fstat_many_ctx  *ctx = opaque;
+    smb_message         *msg;
+    smb_file            *cached;
+    bool                absent;
+
+    cached = smb_stat_cache_lookup(s, ctx->tid, ctx->paths[i], &absent);
+    if (cached != NULL)
     {
-        BDSM_dbg("[smb_fstat]Malformed message %s\n", path);
+        if (!smb_fstat_many_set(ctx->batch, i, cached))
+        {
+            ctx->batch->status[i] = NT_STATUS_NO_MEMORY;
+            smb_stat_destroy(cached);
+            return NULL;
+        }
+        free(cached);
+        return NULL;
+    }
+    if (absent)
+    {
+        ctx->batch->status[i] = NT_STATUS_OBJECT_NAME_NOT_FOUND;
         return NULL;
     }
 
-    file      = calloc(1, sizeof(smb_file));
-    if (!file)
+    if ((msg = smb_fstat_msg(s, ctx->tid, ctx->paths[i])) == NULL)
+        ctx->batch->status[i] = NT_STATUS_OBJECT_NAME_INVALID;
+    return msg;
+}
+
+static bool smb_fstat_many_answer(smb_session *s, size_t i,
+                                  smb_message *reply, void *opaque)
+{
+    smb_fstat_many_ctx  *ctx = opaque;
+    smb_file            file;
+
+    ctx->batch->status[i] = reply->packet->header.status;
+    if (ctx->batch->status[i] != NT_STATUS_SUCCESS)
+        return true;
+
+    memset(&file, 0, sizeof(file));
+    if (!smb_fstat_parse(reply, &file))
+    {
+        BDSM_dbg("smb_fstat_many: Malformed message %s\n", ctx->paths[i]);
+        free(file.name);
+        ctx->batch->status[i] = NT_STATUS_INVALID_NETWORK_RESPONSE;
+        return true;
+    }
+    smb_stat_cache_store(s, ctx->tid, ctx->paths[i], &file);
+    if (!smb_fstat_many_set(ctx->batch, i, &file))
+    {
+        free(file.name);
+        ctx->batch->status[i] = NT_STATUS_NO_MEMORY;
+    }
+
+    return true;
+}
+
+smb_stat_batch  *smb_fstat_many(smb_session *s, smb_tid tid,
+                                const char *const *paths, size_t count)
+{
+    smb_fstat_many_ctx  ctx;
+
+    assert(s != NULL && (paths != NULL || count == 0));
+
+    ctx.tid   = tid;
+    ctx.paths = paths;
+    if ((ctx.batch = smb_stat_batch_new(count)) == NULL)
         return NULL;
 
-    file->name_len  = smb_from_utf16((const char *)info->name, info->name_len,
-                                     &file->name);
-    file->name[info->name_len / 2] = 0;
+    if (!smb_session_pipeline(s, count, smb_fstat_many_build,
+                              smb_fstat_many_answer, &ctx))
+    {
+        smb_stat_batch_destroy(ctx.batch);
+        return NULL;
+    }
 
-    file->created     = info->created;
-    file->accessed    = info->accessed;
-    file->written     = info->written;
-    file->changed     = info->changed;
-    file->alloc_size  = info->alloc_size;
-    file->size        = info->size;
-    file->attr        = info->attr;
-    file->is_dir      = info->is_dir;
+    return ctx.batch;
+}
 
-    return file;
+/*
+ * Set management
+ */
+
+// Sends a SET_FILE_INFO request with one of the levels holding a single
+// 64 bits value. 'lost' tells whether it failed because the connection was
+// lost
+static int  smb_set_file_once(smb_session *s, smb_file *file,
+                              uint16_t interest, uint64_t value, bool *lost)
+{
+    smb_message           *msg, reply;
+    smb_trans2_req        tr2;
+    smb_tr2_set_file      set;
+    int                   res;
+
+    msg = smb_message_new(s, SMB_CMD_TRANS2);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+    msg->packet->header.tid = file->tid;
+
+    SMB_MSG_INIT_PKT(tr2);
+    tr2.wct                = 15;
+    tr2.total_param_count  = sizeof(smb_tr2_set_file);
+    tr2.param_count        = tr2.total_param_count;
+    tr2.total_data_count   = sizeof(value);
+    tr2.data_count         = tr2.total_data_count;
+    tr2.max_param_count    = 2;
+    tr2.max_data_count     = 0;
+    tr2.param_offset       = 68; // Offset of set_file params in packet
+    tr2.data_offset        = 76; // Then 2 bytes to align the data
+    tr2.setup_count        = 1;
+    tr2.cmd                = SMB_TR2_SET_FILE;
+    tr2.bct                = 3 + sizeof(smb_tr2_set_file) + 2 + sizeof(value);
+    SMB_MSG_PUT_PKT(msg, tr2);
+
+    SMB_MSG_INIT_PKT(set);
+    set.fid        = file->srv_fid;
+    set.interest   = interest;
+    SMB_MSG_PUT_PKT(msg, set);
+    smb_message_put16(msg, 0);
+    smb_message_put64(msg, value);
+
+    res = smb_session_send_msg(s, msg);
+    smb_message_destroy(msg);
+    if (!res)
+    {
+        *lost = true;
+        return DSM_ERROR_NETWORK;
+    }
+
+    if (file->name != NULL)
+        smb_stat_cache_invalidate(s, file->tid, file->name, false);
+
+    if (!smb_session_recv_msg(s, &reply))
+    {
+        *lost = true;
+        return DSM_ERROR_NETWORK;
+    }
+    if (!smb_session_check_nt_status(s, &reply))
+        return DSM_ERROR_NT;
+
+    return DSM_SUCCESS;
+}
+
+static int  smb_set_file(smb_session *s, smb_fd fd, uint16_t interest,
+                         uint64_t value)
+{
+    smb_file              *file;
+    unsigned              attempts = 0;
+    bool                  lost;
+    int                   res;
+
+    assert(s != NULL);
+
+    // Setting the same value again is harmless
+    do
+    {
+        if ((file = smb_session_file_get(s, fd)) == NULL)
+            return DSM_ERROR_GENERIC;
+        lost = false;
+        res  = smb_set_file_once(s, file, interest, value, &lost);
+    }
+    while (res != DSM_SUCCESS && lost && smb_session_retry(s, fd, &attempts));
+
+    return res;
+}
+
+int         smb_ftruncate(smb_session *s, smb_fd fd, uint64_t size)
+{
+    smb_file              *file;
+    int                   res;
+
+    res = smb_set_file(s, fd, SMB_TR2_SET_FILE_END_OF_FILE_INFO, size);
+    if (res == DSM_SUCCESS && (file = smb_session_file_get(s, fd)) != NULL)
+        file->size = size;
+
+    return res;
+}
+
+int         smb_fallocate(smb_session *s, smb_fd fd, uint64_t size)
+{
+    smb_file              *file;
+    int                   res;
+
+    res = smb_set_file(s, fd, SMB_TR2_SET_FILE_ALLOCATION_INFO, size);
+    if (res == DSM_SUCCESS && (file = smb_session_file_get(s, fd)) != NULL)
+    {
+        file->alloc_size = size;
+        if (file->size > size)
+            file->size = size;
+    }
+
+    return res;
 }
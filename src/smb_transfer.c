@@ -0,0 +1,612 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "bdsm_debug.h"
+#include "smb_session.h"
+#include "smb_session_msg.h"
+#include "smb_fd.h"
+#include "smb_file.h"
+#include "smb_stat_cache.h"
+#include "smb_hash.h"
+#include "bdsm/smb_transfer.h"
+
+// Reads as large as the NetBIOS framing allows once the server accepts large
+// reads, otherwise what fits in the 64k buffer we negotiated
+#define SMB_TRANSFER_READ_LARGE     0x1f000
+#define SMB_TRANSFER_READ           0xf000
+
+// Chunks not answered yet
+#define SMB_TRANSFER_PENDING        UINT32_MAX
+
+// Data answered ahead of what is hashed
+typedef struct
+{
+    uint64_t            offset;
+    size_t              len;
+    uint8_t             *data;
+} smb_transfer_held;
+
+typedef struct
+{
+    smb_fd              fd;
+    smb_file            *file;
+    int                 local_fd;
+    uint64_t            total;
+    size_t              chunk;
+    size_t              count;
+    uint32_t            *got;       // Bytes actually copied of each chunk
+    uint8_t             *buf;
+    uint64_t            done;
+    struct timespec     start;
+    smb_hash            *hash;
+    smb_transfer_held   *held;
+    size_t              held_count;
+    size_t              held_size;
+    bool                hash_behind; // Hashed from the local file at the end
+    smb_transfer_cb     cb;
+    void                *opaque;
+    int                 res;
+} smb_transfer;
+
+static ssize_t  smb_transfer_pread(int fd, void *buf, size_t len,
+                                   uint64_t offset)
+{
+#ifdef HAVE_PREAD
+    return pread(fd, buf, len, offset);
+#else
+    if (lseek(fd, offset, SEEK_SET) < 0)
+        return -1;
+    return read(fd, buf, len);
+#endif
+}
+
+static bool     smb_transfer_pwrite(int fd, const void *buf, size_t len,
+                                    uint64_t offset)
+{
+    ssize_t         res;
+
+    while (len > 0)
+    {
+#ifdef HAVE_PREAD
+        res = pwrite(fd, buf, len, offset);
+#else
+        if (lseek(fd, offset, SEEK_SET) < 0)
+            return false;
+        res = write(fd, buf, len);
+#endif
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        buf     = (const uint8_t *)buf + res;
+        len    -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+static size_t   smb_transfer_chunk_len(smb_transfer *t, size_t i)
+{
+    uint64_t        offset = (uint64_t)i * t->chunk;
+
+    return t->total - offset < t->chunk ? t->total - offset : t->chunk;
+}
+
+// Bytes of the chunk already copied, none if it was never answered
+static size_t   smb_transfer_got(smb_transfer *t, size_t i)
+{
+    return t->got[i] == SMB_TRANSFER_PENDING ? 0 : t->got[i];
+}
+
+// Accounts for 'len' more bytes and tells the callback. False if it aborted
+static bool     smb_transfer_progress(smb_transfer *t, size_t len)
+{
+    struct timespec now;
+    double          elapsed;
+
+    t->done += len;
+    if (t->cb == NULL)
+        return true;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - t->start.tv_sec)
+              + (now.tv_nsec - t->start.tv_nsec) / 1e9;
+
+    if (t->cb(t->opaque, t->done, t->total,
+              elapsed > 0 ? t->done / elapsed : 0) != 0)
+    {
+        BDSM_dbg("smb_transfer: Aborted by the callback\n");
+        t->res = DSM_ERROR_GENERIC;
+        return false;
+    }
+    return true;
+}
+
+// Hashes data copied at 'offset', then what was held waiting for it. Data
+// coming ahead is held, the requests are not sent further ahead than that.
+// Only if it can't be allocated, the rest is hashed from the local file at
+// the end
+static void     smb_transfer_hash(smb_transfer *t, uint64_t offset,
+                                  const void *data, size_t len)
+{
+    smb_transfer_held   *held;
+    size_t              i;
+
+    if (t->hash == NULL || len == 0)
+        return;
+
+    if (smb_hash_feed(t->hash, offset, data, len))
+    {
+        for (i = 0; i < t->held_count;)
+        {
+            held = &t->held[i];
+            if (!smb_hash_feed(t->hash, held->offset, held->data, held->len))
+            {
+                i++;
+                continue;
+            }
+            free(held->data);
+            *held = t->held[--t->held_count];
+            i = 0;
+        }
+        return;
+    }
+
+    if (offset > t->hash->next)
+    {
+        held = &t->held[t->held_count];
+        if (t->held_count == t->held_size
+            || (held->data = malloc(len)) == NULL)
+        {
+            t->hash_behind = true;
+            return;
+        }
+        memcpy(held->data, data, len);
+        held->offset = offset;
+        held->len    = len;
+        t->held_count++;
+    }
+}
+
+// Hashes the end of the local file that could not be hashed on the fly
+static int      smb_transfer_hash_rest(smb_transfer *t)
+{
+    uint64_t        offset;
+    ssize_t         len;
+
+    if (t->hash == NULL || !t->hash_behind)
+        return DSM_SUCCESS;
+
+    for (offset = t->hash->next; offset < t->total; offset += len)
+    {
+        len = t->total - offset < t->chunk ? t->total - offset : t->chunk;
+        if ((len = smb_transfer_pread(t->local_fd, t->buf, len, offset)) < 0)
+            return DSM_ERROR_GENERIC;
+        if (len == 0)
+            break;
+        smb_hash_update(t->hash, t->buf, len);
+    }
+
+    return DSM_SUCCESS;
+}
+
+static void     smb_transfer_free(smb_transfer *t)
+{
+    while (t->held_count > 0)
+        free(t->held[--t->held_count].data);
+    free(t->held);
+    free(t->got);
+    free(t->buf);
+}
+
+static int      smb_transfer_init(smb_transfer *t, smb_session *s, smb_fd fd,
+                                  int local_fd, uint64_t total, size_t chunk,
+                                  smb_hash *hash, smb_transfer_cb cb,
+                                  void *opaque)
+{
+    size_t          i;
+
+    memset(t, 0, sizeof(*t));
+    t->fd       = fd;
+    t->file     = smb_session_file_get(s, fd);
+    t->local_fd = local_fd;
+    t->total    = total;
+    t->chunk    = chunk;
+    t->count    = (total + chunk - 1) / chunk;
+    t->hash     = hash;
+    t->cb       = cb;
+    t->opaque   = opaque;
+    clock_gettime(CLOCK_MONOTONIC, &t->start);
+
+    t->got = malloc((t->count ? t->count : 1) * sizeof(*t->got));
+    t->buf = malloc(chunk);
+    if (hash != NULL)
+    {
+        // What is answered out of order is at most a window ahead
+        hash->next   = 0;
+        t->held_size = s->srv.max_mpx ? s->srv.max_mpx : 1;
+        t->held      = malloc(t->held_size * sizeof(*t->held));
+    }
+    if (t->file == NULL || t->got == NULL || t->buf == NULL
+        || (hash != NULL && t->held == NULL))
+    {
+        smb_transfer_free(t);
+        return DSM_ERROR_GENERIC;
+    }
+    for (i = 0; i < t->count; i++)
+        t->got[i] = SMB_TRANSFER_PENDING;
+
+    return DSM_SUCCESS;
+}
+
+// True if some chunks were not answered yet
+static bool     smb_transfer_pending(smb_transfer *t)
+{
+    for (size_t i = 0; i < t->count; i++)
+        if (t->got[i] == SMB_TRANSFER_PENDING)
+            return true;
+    return false;
+}
+
+// Pipelines the chunks that were not answered yet, again after a
+// reconnection if the connection is lost in the middle, then completes the
+// chunks answered short. The pipeline also stops early for that when the
+// hash waits for one of them, and goes on afterwards
+static int      smb_transfer_run(smb_session *s, smb_transfer *t,
+                                 smb_pipeline_build build,
+                                 smb_pipeline_answer answer,
+                                 int (*fixup)(smb_session *, smb_transfer *))
+{
+    unsigned        attempts = 0;
+    int             res;
+
+    do
+    {
+        while (!smb_session_pipeline(s, t->count, build, answer, t))
+        {
+            if (t->res != DSM_SUCCESS)
+                return t->res;
+            if (!smb_session_retry(s, t->fd, &attempts))
+                return DSM_ERROR_NETWORK;
+            BDSM_dbg("smb_transfer: Resuming after a reconnection\n");
+        }
+        if (t->res != DSM_SUCCESS)
+            return t->res;
+        if ((res = fixup(s, t)) != DSM_SUCCESS)
+            return res;
+    }
+    while (smb_transfer_pending(t));
+
+    return DSM_SUCCESS;
+}
+
+static smb_message *smb_fget_build(smb_session *s, size_t i, void *opaque)
+{
+    smb_transfer    *t = opaque;
+
+    if (t->got[i] != SMB_TRANSFER_PENDING)
+        return NULL;
+    // What is answered beyond the hashed data must fit in t->held
+    if (t->hash != NULL && !t->hash_behind
+        && i > t->hash->next / t->chunk + t->held_size)
+        return SMB_PIPELINE_LATER;
+
+    return smb_file_read_msg(s, t->file, (uint64_t)i * t->chunk,
+                             smb_transfer_chunk_len(t, i));
+}
+
+static bool     smb_fget_answer(smb_session *s, size_t i, smb_message *msg,
+                                void *opaque)
+{
+    smb_transfer    *t = opaque;
+    void            *data;
+    ssize_t         len;
+
+    if (!smb_session_check_nt_status(s, msg))
+    {
+        t->res = DSM_ERROR_NT;
+        return false;
+    }
+    if ((len = smb_file_read_data(msg, &data)) < 0
+        || (size_t)len > smb_transfer_chunk_len(t, i))
+    {
+        BDSM_dbg("[smb_fget]Malformed message.\n");
+        t->res = DSM_ERROR_NETWORK;
+        return false;
+    }
+
+    if (!smb_transfer_pwrite(t->local_fd, data, len, (uint64_t)i * t->chunk))
+    {
+        BDSM_dbg("[smb_fget]Unable to write the local file.\n");
+        t->res = DSM_ERROR_GENERIC;
+        return false;
+    }
+    t->got[i] = len;
+    smb_transfer_hash(t, (uint64_t)i * t->chunk, data, len);
+
+    return smb_transfer_progress(t, len);
+}
+
+// Reads the end of the chunks the server answered short, one request at a
+// time. Stops at the end of the file if it was truncated meanwhile
+static int      smb_fget_fixup(smb_session *s, smb_transfer *t)
+{
+    uint64_t        offset;
+    size_t          i, want;
+    ssize_t         len;
+
+    for (i = 0; i < t->count; i++)
+    {
+        if (t->got[i] == SMB_TRANSFER_PENDING)
+            continue;
+        want   = smb_transfer_chunk_len(t, i) - smb_transfer_got(t, i);
+        offset = (uint64_t)i * t->chunk + smb_transfer_got(t, i);
+        if (want == 0)
+            continue;
+
+        smb_fseek(s, t->fd, offset, SEEK_SET);
+        while (want > 0)
+        {
+            if ((len = smb_fread(s, t->fd, t->buf, want)) < 0)
+                return DSM_ERROR_NETWORK;
+            if (len == 0)
+            {
+                // Nothing to ask for the chunks not sent yet either
+                for (; i < t->count; i++)
+                    if (t->got[i] == SMB_TRANSFER_PENDING)
+                        t->got[i] = 0;
+                return DSM_SUCCESS;
+            }
+            if (!smb_transfer_pwrite(t->local_fd, t->buf, len, offset))
+                return DSM_ERROR_GENERIC;
+            smb_transfer_hash(t, offset, t->buf, len);
+            t->got[i] = smb_transfer_got(t, i) + len;
+            offset += len;
+            want   -= len;
+            if (!smb_transfer_progress(t, len))
+                return t->res;
+        }
+    }
+
+    return DSM_SUCCESS;
+}
+
+// Cuts what the local file had beyond the data downloaded: what it held
+// before, the preallocated space, or the end of a file truncated meanwhile
+static int      smb_fget_truncate(smb_transfer *t)
+{
+    struct stat     st;
+    uint64_t        end = 0;
+
+    for (size_t i = 0; i < t->count; i++)
+        if (smb_transfer_got(t, i) > 0)
+            end = (uint64_t)i * t->chunk + smb_transfer_got(t, i);
+
+    // Devices and the like have no size to cut
+    if (fstat(t->local_fd, &st) != 0 || !S_ISREG(st.st_mode)
+        || (uint64_t)st.st_size == end)
+        return DSM_SUCCESS;
+    if (ftruncate(t->local_fd, end) != 0)
+    {
+        BDSM_dbg("[smb_fget]Unable to truncate the local file.\n");
+        return DSM_ERROR_GENERIC;
+    }
+
+    return DSM_SUCCESS;
+}
+
+int             smb_fget(smb_session *s, smb_tid tid, const char *path,
+                         int local_fd, int flags, smb_hash *hash,
+                         smb_transfer_cb cb, void *opaque)
+{
+    smb_transfer    t;
+    smb_file        *file;
+    smb_fd          fd;
+    size_t          chunk;
+    int             res;
+
+    assert(s != NULL && path != NULL && local_fd >= 0);
+
+    if ((res = smb_fopen(s, tid, path, SMB_MOD_RO, &fd)) != DSM_SUCCESS)
+        return res;
+    file = smb_session_file_get(s, fd);
+
+#ifdef HAVE_POSIX_FALLOCATE
+    // Best effort, the transfer works the same without it
+    if ((flags & SMB_TRANSFER_PREALLOCATE) && file->size > 0
+        && posix_fallocate(local_fd, 0, file->size) != 0)
+        BDSM_dbg("smb_fget: Unable to preallocate %"PRIu64" bytes\n",
+                 file->size);
+#else
+    (void)flags;
+#endif
+
+    chunk = s->srv.caps & SMB_CAPS_LARGE_READX ? SMB_TRANSFER_READ_LARGE
+                                               : SMB_TRANSFER_READ;
+    res = smb_transfer_init(&t, s, fd, local_fd, file->size, chunk, hash, cb,
+                            opaque);
+    if (res == DSM_SUCCESS)
+    {
+        res = smb_transfer_run(s, &t, smb_fget_build, smb_fget_answer,
+                               smb_fget_fixup);
+        if (res == DSM_SUCCESS)
+            res = smb_fget_truncate(&t);
+        if (res == DSM_SUCCESS)
+            res = smb_transfer_hash_rest(&t);
+        BDSM_dbg("smb_fget: %"PRIu64" bytes in %zu chunks of %zu\n",
+                 t.done, t.count, t.chunk);
+        smb_transfer_free(&t);
+    }
+
+    smb_fclose(s, fd);
+    return res;
+}
+
+// Reads the local chunk and builds its write. A local read error ends the
+// transfer, as the pipeline can not be stopped from here
+static smb_message *smb_fput_build(smb_session *s, size_t i, void *opaque)
+{
+    smb_transfer    *t = opaque;
+    size_t          want;
+    ssize_t         len;
+
+    if (t->got[i] != SMB_TRANSFER_PENDING || t->res != DSM_SUCCESS)
+        return NULL;
+
+    want = smb_transfer_chunk_len(t, i);
+    do
+        len = smb_transfer_pread(t->local_fd, t->buf, want,
+                                 (uint64_t)i * t->chunk);
+    while (len < 0 && errno == EINTR);
+    if (len <= 0)
+    {
+        BDSM_dbg("[smb_fput]Unable to read the local file.\n");
+        t->res = DSM_ERROR_GENERIC;
+        return NULL;
+    }
+    // Chunks are built in order, only those sent again are not hashed
+    smb_transfer_hash(t, (uint64_t)i * t->chunk, t->buf, len);
+
+    return smb_file_write_msg(s, t->file, (uint64_t)i * t->chunk, t->buf,
+                              (uint16_t)len, 0);
+}
+
+static bool     smb_fput_answer(smb_session *s, size_t i, smb_message *msg,
+                                void *opaque)
+{
+    smb_transfer    *t = opaque;
+    ssize_t         len;
+
+    if (!smb_session_check_nt_status(s, msg))
+    {
+        t->res = DSM_ERROR_NT;
+        return false;
+    }
+    if ((len = smb_file_write_count(msg)) < 0
+        || (size_t)len > smb_transfer_chunk_len(t, i))
+    {
+        BDSM_dbg("[smb_fput]Malformed message.\n");
+        t->res = DSM_ERROR_NETWORK;
+        return false;
+    }
+    t->got[i] = len;
+
+    return smb_transfer_progress(t, len);
+}
+
+// Writes the end of the chunks the server did not fully take
+static int      smb_fput_fixup(smb_session *s, smb_transfer *t)
+{
+    uint64_t        offset;
+    size_t          i, want;
+    ssize_t         len, res;
+
+    for (i = 0; i < t->count; i++)
+    {
+        want   = smb_transfer_chunk_len(t, i) - smb_transfer_got(t, i);
+        offset = (uint64_t)i * t->chunk + smb_transfer_got(t, i);
+        if (want == 0)
+            continue;
+
+        len = smb_transfer_pread(t->local_fd, t->buf, want, offset);
+        if (len <= 0)
+            return DSM_ERROR_GENERIC;
+
+        smb_fseek(s, t->fd, offset, SEEK_SET);
+        while (len > 0)
+        {
+            if ((res = smb_fwrite(s, t->fd, t->buf, len)) <= 0)
+                return DSM_ERROR_NETWORK;
+            memmove(t->buf, t->buf + res, len - res);
+            len -= res;
+            if (!smb_transfer_progress(t, res))
+                return t->res;
+        }
+    }
+
+    return DSM_SUCCESS;
+}
+
+int             smb_fput(smb_session *s, smb_tid tid, const char *path,
+                         int local_fd, int flags, smb_hash *hash,
+                         smb_transfer_cb cb, void *opaque)
+{
+    smb_transfer    t;
+    smb_fopen_opts  opts;
+    struct stat     st;
+    smb_fd          fd;
+    int             res;
+
+    assert(s != NULL && path != NULL && local_fd >= 0);
+
+    if (fstat(local_fd, &st) != 0)
+        return DSM_ERROR_GENERIC;
+
+    // Not written through, the pipelined writes are worth nothing otherwise
+    memset(&opts, 0, sizeof(opts));
+    if (flags & SMB_TRANSFER_PREALLOCATE)
+        opts.alloc_size = st.st_size;
+    res = smb_file_open(s, tid, path, SMB_MOD_RW,
+                        SMB_DISPOSITION_FILE_OVERWRITE_IF, &opts, &fd);
+    if (res != DSM_SUCCESS)
+        return res;
+
+    res = smb_transfer_init(&t, s, fd, local_fd, st.st_size, SMB_FILE_MAX_WRITE,
+                            hash, cb, opaque);
+    if (res == DSM_SUCCESS)
+    {
+        res = smb_transfer_run(s, &t, smb_fput_build, smb_fput_answer,
+                               smb_fput_fixup);
+        BDSM_dbg("smb_fput: %"PRIu64" bytes in %zu chunks of %zu\n",
+                 t.done, t.count, t.chunk);
+        smb_transfer_free(&t);
+    }
+
+    smb_stat_cache_invalidate(s, tid, path, false);
+    smb_fclose(s, fd);
+    return res;
+}
@@ -63,7 +63,10 @@ void              smb_transport_nbt(smb_transport *tr)
     tr->destroy       = (void *)netbios_session_destroy;
     tr->pkt_init      = (void *)netbios_session_packet_init;
     tr->pkt_append    = (void *)netbios_session_packet_append;
+    tr->pkt_reserve   = (void *)netbios_session_packet_reserve;
+    tr->pkt_commit    = (void *)netbios_session_packet_commit;
     tr->send          = (void *)netbios_session_packet_send;
+    tr->wait          = (void *)netbios_session_wait;
     tr->recv          = (void *)netbios_session_packet_recv;
 }
 
@@ -76,6 +79,9 @@ void              smb_transport_tcp(smb_transport *tr)
     tr->destroy       = (void *)netbios_session_destroy;
     tr->pkt_init      = (void *)netbios_session_packet_init;
     tr->pkt_append    = (void *)netbios_session_packet_append;
+    tr->pkt_reserve   = (void *)netbios_session_packet_reserve;
+    tr->pkt_commit    = (void *)netbios_session_packet_commit;
     tr->send          = (void *)netbios_session_packet_send;
+    tr->wait          = (void *)netbios_session_wait;
     tr->recv          = (void *)netbios_session_packet_recv;
 }
@@ -48,6 +48,7 @@
 #endif
 
 #include "bdsm/smb_types.h"
+#include "bdsm/smb_hash.h"
 #include "smb_buffer.h"
 #include "smb_packets.h"
 
@@ -60,8 +61,11 @@ struct smb_file
 {
     smb_file            *next;          // Next file in this share
     char                *name;
-    smb_fid             fid;
+    smb_fid             fid;            // As seen by the user, in its smb_fd
     smb_tid             tid;
+    smb_fid             srv_fid;        // As given by the server
+    uint32_t            access;         // To reopen it after a reconnection
+    uint32_t            create_opts;
     size_t              name_len;
     uint64_t            created;
     uint64_t            accessed;
@@ -71,18 +75,51 @@ struct smb_file
     uint64_t            size;
     uint32_t            attr;
     off_t               offset;          // Current position pointer
+    smb_hash            *hash;          // Fed with what is read or written
+    uint8_t             oplock_req;     // Requested when opened, SMB_OPLOCK_*
+    uint8_t             oplock;         // Currently held, SMB_OPLOCK_*
     int                 is_dir;         // 0 -> file, 1 -> directory
 };
 
+// Names of a smb_stat_batch are carved from these, so that the whole batch
+// is freed in a few calls whatever the number of paths
+typedef struct smb_stat_chunk smb_stat_chunk;
+struct smb_stat_chunk
+{
+    smb_stat_chunk      *next;
+    size_t              used;
+    size_t              size;
+    char                data[];
+};
+
+struct smb_stat_batch
+{
+    size_t              count;
+    uint32_t            *status;        // NT status of each path
+    smb_file            *files;         // Valid where status is 0
+    smb_stat_chunk      *chunks;
+};
+
+struct smb_hash
+{
+    const smb_hash_algo *algo;
+    uint64_t            bytes;
+    uint64_t            next;           // File offset expected next
+    uint64_t            ctx[];          // algo->ctx_size bytes
+};
+
 typedef struct smb_share smb_share;
 struct smb_share
 {
     smb_share           *next;          // Next share in this session
     smb_file            *files;         // List of all open files for this share
-    smb_tid             tid;
+    smb_tid             tid;            // As seen by the user
+    smb_tid             srv_tid;        // As given by the server
+    char                *name;          // To connect it again after a reconnection
     uint16_t            opts;           // Optionnal support opts
     uint16_t            rights;         // Maximum rights field
     uint16_t            guest_rights;
+    struct smb_stat_cache *stat_cache;  // Attributes cache, NULL if disabled
 };
 
 typedef struct smb_transport smb_transport;
@@ -94,7 +131,10 @@ struct smb_transport
     void              (*destroy)(void *s);
     void              (*pkt_init)(void *s);
     int               (*pkt_append)(void *s, void *data, size_t size);
+    void              *(*pkt_reserve)(void *s, size_t size, size_t *capacity);
+    void              (*pkt_commit)(void *s, size_t size);
     int               (*send)(void *s);
+    int               (*wait)(void *s, int timeout);
     ssize_t           (*recv)(void *s, void **data);
 };
 
@@ -107,10 +147,23 @@ struct smb_srv_info
     uint16_t            uid;            // uid attributed by the server.
     uint32_t            session_key;    // The session key sent by the server on protocol negotiate
     uint32_t            caps;           // Server caps replyed during negotiate
+    uint32_t            max_bufsize;    // Max message size the server accepts
+    uint16_t            max_mpx;        // Max requests pending at once
     uint64_t            challenge;      // For challenge response security
     uint64_t            ts;             // It seems Win7 requires it :-/
 };
 
+typedef struct smb_message smb_message;
+struct smb_message
+{
+    size_t          payload_size; // Size of the allocated payload
+    size_t          cursor;       // Write cursor in the payload
+    smb_packet      *packet;      // Yummy yummy, Fruity fruity !
+    smb_session     *session;     // Pool to go back to, can be NULL
+    smb_message     *next_free;   // Next message in the pool
+    bool            direct;       // packet is the transport send buffer
+};
+
 /**
  * @brief An opaque data structure to represent a SMB Session.
  */
@@ -131,14 +184,31 @@ struct smb_session
 
     smb_share           *shares;          // shares->files | Map fd <-> smb_file
     uint32_t            nt_status;
-};
 
-typedef struct smb_message smb_message;
-struct smb_message
-{
-    size_t          payload_size; // Size of the allocated payload
-    size_t          cursor;       // Write cursor in the payload
-    smb_packet      *packet;      // Yummy yummy, Fruity fruity !
+    // What smb_session_reconnect() connects to again
+    uint32_t            srv_ip;
+    int                 srv_transport;
+    unsigned            reconnect_retries; // Per failed read/write, 0 disables
+    uint64_t            reconnects;
+
+    // Told about the oplock breaks sent by the server
+    smb_oplock_cb       oplock_cb;
+    void                *oplock_opaque;
+
+    // FIND_FIRST2/FIND_NEXT2 round trips and entries they returned
+    uint64_t            find_requests;
+    uint64_t            find_entries;
+
+    // File data read by smb_fread(), NULL if disabled
+    struct smb_block_cache *block_cache;
+
+    // Released messages, reused by smb_message_new()
+    smb_message         *msg_pool;
+    size_t              msg_pool_count;
+    // The message being built in the transport buffer, if msg_direct_busy.
+    // Released once sent, before anything is received in that buffer
+    smb_message         msg_direct;
+    bool                msg_direct_busy;
 };
 
 #endif
@@ -35,6 +35,9 @@
 #include <assert.h>
 #include <iconv.h>
 #include <locale.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,85 +47,428 @@
 # include <langinfo.h>
 #endif
 
+#if defined(__SSE2__)
+# include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__) && !defined(__ARM_BIG_ENDIAN)
+# define SMB_UTF_NEON
+# include <arm_neon.h>
+#endif
+
 #include "bdsm_debug.h"
 #include "smb_utils.h"
 
-static const char *current_encoding()
+// Conversion descriptors are expensive to open, each thread keeps its own
+typedef struct
+{
+    iconv_t             to_utf16;
+    iconv_t             from_utf16;
+} smb_iconv_cache;
+
+static pthread_once_t   utils_once = PTHREAD_ONCE_INIT;
+static pthread_key_t    iconv_key;
+static char             encoding[32];
+
+static const char *detect_encoding()
 {
 #if defined( __APPLE__ )
     return "UTF8";
 #elif !HAVE_NL_LANGINFO
     return "UTF-8";
 #else
-    static int locale_set = 0;
-
-    if (!locale_set)
-    {
-        setlocale(LC_ALL, "");
-        locale_set = 1;
-    }
+    setlocale(LC_ALL, "");
     //BDSM_dbg("%s\n", nl_langinfo(CODESET));
     return nl_langinfo(CODESET);
 #endif
 }
 
-static size_t smb_iconv(const char *src, size_t src_len, char **dst,
-                        const char *src_enc, const char *dst_enc)
+static void smb_iconv_cache_free(void *opaque)
 {
-    iconv_t   ic;
-    size_t    ret = 0;
+    smb_iconv_cache *cache = opaque;
 
-    assert(src != NULL && dst != NULL && src_enc != NULL && dst_enc != NULL);
+    if (cache->to_utf16 != (iconv_t)-1)
+        iconv_close(cache->to_utf16);
+    if (cache->from_utf16 != (iconv_t)-1)
+        iconv_close(cache->from_utf16);
+    free(cache);
+}
 
-    if (!src_len)
+static void smb_utils_init()
+{
+    strncpy(encoding, detect_encoding(), sizeof(encoding) - 1);
+    pthread_key_create(&iconv_key, smb_iconv_cache_free);
+}
+
+// The locale is only looked up once, applications are expected to set it
+// before using the library.
+static const char *current_encoding()
+{
+    pthread_once(&utils_once, smb_utils_init);
+    return encoding;
+}
+
+static iconv_t smb_iconv_get(bool to_utf16)
+{
+    smb_iconv_cache *cache;
+    iconv_t         *ic;
+
+    pthread_once(&utils_once, smb_utils_init);
+
+    if ((cache = pthread_getspecific(iconv_key)) == NULL)
     {
-        *dst = NULL;
-        return 0;
+        if ((cache = malloc(sizeof(*cache))) == NULL)
+            return (iconv_t)-1;
+        cache->to_utf16 = cache->from_utf16 = (iconv_t)-1;
+        if (pthread_setspecific(iconv_key, cache) != 0)
+        {
+            free(cache);
+            return (iconv_t)-1;
+        }
     }
 
-    if ((ic = iconv_open(dst_enc, src_enc)) == (iconv_t)-1)
+    ic = to_utf16 ? &cache->to_utf16 : &cache->from_utf16;
+    if (*ic == (iconv_t)-1)
     {
-        BDSM_dbg("Unable to open iconv to convert from %s to %s\n",
-                 src_enc, dst_enc);
-        *dst = NULL;
+        *ic = to_utf16 ? iconv_open("UCS-2LE", encoding)
+                       : iconv_open(encoding, "UCS-2LE");
+        if (*ic == (iconv_t)-1)
+            BDSM_dbg("Unable to open iconv to convert %s %s\n",
+                     to_utf16 ? "to UCS-2LE from" : "from UCS-2LE to",
+                     encoding);
+    }
+
+    return *ic;
+}
+
+// Returns the number of bytes written to dst, 0 on error (with errno set to
+// E2BIG if dst is too small)
+static size_t smb_iconv(iconv_t ic, const char *src, size_t src_len,
+                        char *dst, size_t dst_len)
+{
+    const char  *inp = src;
+    size_t      inb = src_len;
+    char        *outp = dst;
+    size_t      outb = dst_len;
+
+    // Reset the state left by the previous conversion
+    iconv(ic, NULL, NULL, NULL, NULL);
+    if (iconv(ic, (char **)&inp, &inb, &outp, &outb) == (size_t)(-1))
         return 0;
+
+    return dst_len - outb;
+}
+
+static bool is_utf8(const char *encoding)
+{
+    return !strcmp(encoding, "UTF-8") || !strcmp(encoding, "UTF8")
+           || !strcmp(encoding, "utf8");
+}
+
+// Convert the leading ASCII characters of src to UTF-16LE, 16 at a time.
+// Returns the number of characters converted, the rest is left to the
+// scalar code.
+static size_t ascii_to_utf16(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= src_len; i += 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i *)(src + i));
+
+        if (_mm_movemask_epi8(in) != 0)
+            break;
+        _mm_storeu_si128((__m128i *)(dst + 2 * i),
+                         _mm_unpacklo_epi8(in, zero));
+        _mm_storeu_si128((__m128i *)(dst + 2 * i + 16),
+                         _mm_unpackhi_epi8(in, zero));
     }
-    for (unsigned mul = 4; mul < 16; mul++)
+#elif defined(SMB_UTF_NEON)
+    for (; i + 16 <= src_len; i += 16)
     {
-        size_t outlen = mul * src_len;
-        char *out = malloc(outlen);
+        uint8x16_t in = vld1q_u8(src + i);
+
+        if (vmaxvq_u8(in) >= 0x80)
+            break;
+        vst1q_u16((uint16_t *)(dst + 2 * i), vmovl_u8(vget_low_u8(in)));
+        vst1q_u16((uint16_t *)(dst + 2 * i + 16), vmovl_u8(vget_high_u8(in)));
+    }
+#else
+    (void)src; (void)src_len; (void)dst;
+#endif
 
-        const char *inp = src;
-        size_t inb = src_len;
-        char *outp = out;
-        size_t outb = outlen;
+    return i;
+}
+
+// Convert the leading ASCII characters of the UTF-16LE string src (src_len
+// characters long), 16 at a time. Returns the number of characters converted.
+static size_t ascii_from_utf16(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+    size_t i = 0;
 
-        if (!out)
+#if defined(__SSE2__)
+    const __m128i non_ascii = _mm_set1_epi16((short)0xff80);
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; i + 16 <= src_len; i += 16)
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        __m128i high_bits = _mm_and_si128(_mm_or_si128(lo, hi), non_ascii);
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi16(high_bits, zero)) != 0xffff)
             break;
-        if (iconv(ic, (char **)&inp, &inb, &outp, &outb) != (size_t)(-1)) {
-            ret = outlen - outb;
-            *dst = out;
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#elif defined(SMB_UTF_NEON)
+    for (; i + 16 <= src_len; i += 16)
+    {
+        uint16x8_t lo = vld1q_u16((const uint16_t *)(src + 2 * i));
+        uint16x8_t hi = vld1q_u16((const uint16_t *)(src + 2 * i + 16));
+
+        if (vmaxvq_u16(vorrq_u16(lo, hi)) >= 0x80)
+            break;
+        vst1q_u8(dst + i, vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+    }
+#else
+    (void)src; (void)src_len; (void)dst;
+#endif
+
+    return i;
+}
+
+// Returns the number of bytes written to dst, or (size_t)-1 if src isn't
+// valid UTF-8. dst must be at least 2 * src_len bytes long.
+static size_t utf8_to_utf16(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+    size_t i = 0, o = 0;
+
+    while (i < src_len)
+    {
+        size_t   ascii = ascii_to_utf16(src + i, src_len - i, dst + o);
+        uint32_t c, min = 0;
+        size_t   extra;
+
+        i += ascii;
+        o += 2 * ascii;
+        if (i == src_len)
             break;
+
+        c = src[i];
+        if (c < 0x80)
+            extra = 0;
+        else if ((c & 0xe0) == 0xc0)
+        {
+            c &= 0x1f;
+            extra = 1;
+            min = 0x80;
         }
-        free(out);
-        if (errno != E2BIG)
+        else if ((c & 0xf0) == 0xe0)
+        {
+            c &= 0x0f;
+            extra = 2;
+            min = 0x800;
+        }
+        else if ((c & 0xf8) == 0xf0)
+        {
+            c &= 0x07;
+            extra = 3;
+            min = 0x10000;
+        }
+        else
+            return (size_t)-1;
+
+        if (extra >= src_len - i)
+            return (size_t)-1;
+        for (size_t k = 1; k <= extra; k++)
+        {
+            if ((src[i + k] & 0xc0) != 0x80)
+                return (size_t)-1;
+            c = (c << 6) | (src[i + k] & 0x3f);
+        }
+        // Overlong forms, surrogates and out of range code points
+        if (c < min || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+            return (size_t)-1;
+        i += extra + 1;
+
+        if (c >= 0x10000)
+        {
+            uint32_t high = 0xd800 | ((c - 0x10000) >> 10);
+            uint32_t low  = 0xdc00 | ((c - 0x10000) & 0x3ff);
+
+            dst[o++] = high & 0xff;
+            dst[o++] = high >> 8;
+            c = low;
+        }
+        dst[o++] = c & 0xff;
+        dst[o++] = c >> 8;
+    }
+
+    return o;
+}
+
+// Returns the number of bytes written to dst, or (size_t)-1 if src isn't
+// valid UTF-16LE. dst must be at least 3 * src_len / 2 bytes long.
+static size_t utf16_to_utf8(const uint8_t *src, size_t src_len, uint8_t *dst)
+{
+    size_t units = src_len / 2, i = 0, o = 0;
+
+    if (src_len % 2)
+        return (size_t)-1;
+
+    while (i < units)
+    {
+        size_t   ascii = ascii_from_utf16(src + 2 * i, units - i, dst + o);
+        uint32_t c;
+
+        i += ascii;
+        o += ascii;
+        if (i == units)
             break;
+
+        c = src[2 * i] | (src[2 * i + 1] << 8);
+        i++;
+        if (c >= 0xd800 && c <= 0xdfff)
+        {
+            uint32_t low;
+
+            if (c >= 0xdc00 || i == units)
+                return (size_t)-1;
+            low = src[2 * i] | (src[2 * i + 1] << 8);
+            if (low < 0xdc00 || low > 0xdfff)
+                return (size_t)-1;
+            i++;
+            c = 0x10000 + ((c - 0xd800) << 10) + (low - 0xdc00);
+        }
+
+        if (c < 0x80)
+            dst[o++] = c;
+        else if (c < 0x800)
+        {
+            dst[o++] = 0xc0 | (c >> 6);
+            dst[o++] = 0x80 | (c & 0x3f);
+        }
+        else if (c < 0x10000)
+        {
+            dst[o++] = 0xe0 | (c >> 12);
+            dst[o++] = 0x80 | ((c >> 6) & 0x3f);
+            dst[o++] = 0x80 | (c & 0x3f);
+        }
+        else
+        {
+            dst[o++] = 0xf0 | (c >> 18);
+            dst[o++] = 0x80 | ((c >> 12) & 0x3f);
+            dst[o++] = 0x80 | ((c >> 6) & 0x3f);
+            dst[o++] = 0x80 | (c & 0x3f);
+        }
     }
-    iconv_close(ic);
 
-    if (ret == 0)
-        *dst = NULL;
-    return ret;
+    return o;
+}
+
+size_t      smb_to_utf16_buf(const char *src, size_t src_len, char *dst)
+{
+    iconv_t ic;
+    size_t  ret;
+
+    assert(src != NULL && dst != NULL);
+
+    if (!src_len)
+        return 0;
+
+    if (is_utf8(current_encoding()))
+    {
+        ret = utf8_to_utf16((const uint8_t *)src, src_len, (uint8_t *)dst);
+        if (ret == (size_t)-1)
+        {
+            BDSM_dbg("smb_to_utf16: invalid UTF-8 string\n");
+            return 0;
+        }
+        return ret;
+    }
+
+    if ((ic = smb_iconv_get(true)) == (iconv_t)-1)
+        return 0;
+    // UCS-2 takes 2 bytes per character, and each character takes at
+    // least one byte in any encoding.
+    return smb_iconv(ic, src, src_len, dst, 2 * src_len);
 }
 
 size_t      smb_to_utf16(const char *src, size_t src_len, char **dst)
 {
-    return (smb_iconv(src, src_len, dst,
-                      current_encoding(), "UCS-2LE"));
+    char    *out;
+    size_t  ret;
+
+    assert(src != NULL && dst != NULL);
+
+    *dst = NULL;
+    if (!src_len)
+        return 0;
+
+    // NUL terminated, callers rely on being able to write one past the
+    // returned size
+    if ((out = malloc(2 * src_len + 2)) == NULL)
+        return 0;
+
+    if ((ret = smb_to_utf16_buf(src, src_len, out)) == 0)
+    {
+        free(out);
+        return 0;
+    }
+    out[ret] = out[ret + 1] = 0;
+
+    *dst = out;
+    return ret;
 }
 
 size_t      smb_from_utf16(const char *src, size_t src_len, char **dst)
 {
-    return (smb_iconv(src, src_len, dst,
-                      "UCS-2LE", current_encoding()));
+    iconv_t ic;
+    size_t  ret = 0;
+    char    *out;
+
+    assert(src != NULL && dst != NULL);
+
+    *dst = NULL;
+    if (!src_len)
+        return 0;
+
+    if (is_utf8(current_encoding()))
+    {
+        // Each UTF-16 unit gives at most 3 UTF-8 bytes
+        if ((out = malloc(3 * (src_len / 2) + 2)) == NULL)
+            return 0;
+        ret = utf16_to_utf8((const uint8_t *)src, src_len, (uint8_t *)out);
+        if (ret == (size_t)-1 || ret == 0)
+        {
+            BDSM_dbg("smb_from_utf16: invalid UTF-16 string\n");
+            free(out);
+            return 0;
+        }
+        out[ret] = 0;
+        *dst = out;
+        return ret;
+    }
+
+    if ((ic = smb_iconv_get(false)) == (iconv_t)-1)
+        return 0;
+    for (unsigned mul = 4; mul < 16; mul++)
+    {
+        size_t outlen = mul * src_len;
+
+        if ((out = malloc(outlen + 1)) == NULL)
+            break;
+        if ((ret = smb_iconv(ic, src, src_len, out, outlen)) != 0)
+        {
+            out[ret] = 0;
+            *dst = out;
+            break;
+        }
+        free(out);
+        if (errno != E2BIG)
+            break;
+    }
+
+    return ret;
 }
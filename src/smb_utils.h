@@ -43,6 +43,8 @@
  * @internal
  * @brief Converts a string from current locale encoding to UCS2-LE
  * @details It allocates the output string on the heap, you have to free it !
+ * UTF-8 locales use a built-in converter (producing UTF-16LE, so characters
+ * outside the BMP are kept as surrogate pairs), others go through iconv.
  *
  * @param[in] src The input string. It is considere to be in the current locale
  * @param[in] src_len The length in byte of the input string (strlen will do
@@ -54,6 +56,18 @@
  */
 size_t      smb_to_utf16(const char *src, size_t src_len, char **dst);
 
+/**
+ * @internal
+ * @brief Same as smb_to_utf16(), but converts into a buffer provided by the
+ * caller
+ *
+ * @param[in] src The input string. It is considere to be in the current locale
+ * @param[in] src_len The length in byte of the input string
+ * @param[out] dst The output buffer, it must be at least 2 * src_len long
+ * @return The size of the encoded string in bytes, 0 on error
+ */
+size_t      smb_to_utf16_buf(const char *src, size_t src_len, char *dst);
+
 /**
  * @internal
  * @brief Converts from UCS2-LE to local encoding (fetched using setlocale())
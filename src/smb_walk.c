@@ -0,0 +1,432 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "bdsm_debug.h"
+#include "smb_defs.h"
+#include "smb_session.h"
+#include "smb_stat.h"
+#include "bdsm/smb_walk.h"
+
+typedef struct
+{
+    char                *path;
+    int                 depth;
+} walk_dir;
+
+// Directories to list. The owner pushes and pops at the tail, the other
+// workers steal from the head
+typedef struct
+{
+    pthread_mutex_t     lock;
+    walk_dir            *items;
+    size_t              head;
+    size_t              count;
+    size_t              size;
+} walk_deque;
+
+typedef struct walk_ctx walk_ctx;
+
+typedef struct
+{
+    walk_ctx            *ctx;
+    size_t              index;
+    smb_session         *s;
+    smb_tid             tid;
+    walk_deque          queue;
+    pthread_t           thread;
+} walk_worker;
+
+struct walk_ctx
+{
+    walk_worker         *workers;
+    size_t              count;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;           // Signaled when work is queued or done
+    size_t              queued;         // Directories in the queues
+    size_t              outstanding;    // Directories queued or being listed
+    bool                stop;
+    int                 err;            // First directory that failed to list
+
+    pthread_mutex_t     cb_lock;        // Serializes the callback
+    int                 max_depth;
+    const char          *pattern;
+    smb_walk_cb         cb;
+    void                *opaque;
+};
+
+// '*' and '?' wildcards, case insensitive
+static bool walk_match(const char *pattern, const char *name)
+{
+    const char *star = NULL, *retry = NULL;
+
+    while (*name)
+    {
+        char p = *pattern, n = *name;
+
+        if (p >= 'A' && p <= 'Z')
+            p += 'a' - 'A';
+        if (n >= 'A' && n <= 'Z')
+            n += 'a' - 'A';
+
+        if (p == '*')
+        {
+            star  = ++pattern;
+            retry = name;
+        }
+        else if (p == '?' || (p != 0 && p == n))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star != NULL)
+        {
+            pattern = star;
+            name    = ++retry;
+        }
+        else
+            return false;
+    }
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == 0;
+}
+
+static bool walk_deque_push(walk_deque *q, walk_dir *dir)
+{
+    walk_dir    *items;
+    size_t      size;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size)
+    {
+        size = q->size ? q->size * 2 : 16;
+        if ((items = malloc(size * sizeof(*items))) == NULL)
+        {
+            pthread_mutex_unlock(&q->lock);
+            return false;
+        }
+        for (size_t i = 0; i < q->count; i++)
+            items[i] = q->items[(q->head + i) % q->size];
+        free(q->items);
+        q->items = items;
+        q->head  = 0;
+        q->size  = size;
+    }
+    q->items[(q->head + q->count++) % q->size] = *dir;
+    pthread_mutex_unlock(&q->lock);
+
+    return true;
+}
+
+static bool walk_deque_take(walk_deque *q, walk_dir *dir, bool steal)
+{
+    bool found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0)
+    {
+        if (steal)
+        {
+            *dir    = q->items[q->head];
+            q->head = (q->head + 1) % q->size;
+        }
+        else
+            *dir = q->items[(q->head + q->count - 1) % q->size];
+        q->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    return found;
+}
+
+static bool walk_next(walk_worker *w, walk_dir *dir)
+{
+    walk_ctx    *ctx = w->ctx;
+
+    for (;;)
+    {
+        bool found = walk_deque_take(&w->queue, dir, false);
+
+        for (size_t i = 1; !found && i < ctx->count; i++)
+            found = walk_deque_take(&ctx->workers[(w->index + i) % ctx->count].queue,
+                                    dir, true);
+
+        pthread_mutex_lock(&ctx->lock);
+        if (found)
+        {
+            ctx->queued--;
+            pthread_mutex_unlock(&ctx->lock);
+            return true;
+        }
+
+        // Nothing to take: wait for another worker to queue something, or
+        // for the last directory to be done
+        while (!ctx->stop && ctx->outstanding > 0 && ctx->queued == 0)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        if (ctx->stop || ctx->outstanding == 0)
+        {
+            pthread_mutex_unlock(&ctx->lock);
+            return false;
+        }
+        pthread_mutex_unlock(&ctx->lock);
+    }
+}
+
+static bool walk_queue(walk_worker *w, char *path, int depth)
+{
+    walk_ctx    *ctx = w->ctx;
+    walk_dir    dir = { path, depth };
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->outstanding++;
+    ctx->queued++;
+    pthread_mutex_unlock(&ctx->lock);
+
+    if (!walk_deque_push(&w->queue, &dir))
+    {
+        pthread_mutex_lock(&ctx->lock);
+        ctx->outstanding--;
+        ctx->queued--;
+        pthread_mutex_unlock(&ctx->lock);
+        return false;
+    }
+
+    pthread_cond_signal(&ctx->cond);
+    return true;
+}
+
+static void walk_done(walk_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (--ctx->outstanding == 0)
+        pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Called with cb_lock held: stop is read under either lock
+static void walk_stop(walk_ctx *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stop = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void walk_fail(walk_ctx *ctx, int err)
+{
+    pthread_mutex_lock(&ctx->lock);
+    if (ctx->err == DSM_SUCCESS)
+        ctx->err = err;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+static void walk_list(walk_worker *w, walk_dir *dir)
+{
+    walk_ctx        *ctx = w->ctx;
+    smb_stat_list   list;
+    smb_stat        st;
+    char            *pattern, *path;
+    size_t          len;
+    int             res;
+
+    len = strlen(dir->path) + 3;
+    if ((pattern = malloc(len)) == NULL)
+    {
+        walk_fail(ctx, DSM_ERROR_GENERIC);
+        return;
+    }
+    snprintf(pattern, len, "%s\\*", dir->path);
+    // Every field of a smb_stat is already in the DIRECTORY_INFO level
+    list = smb_find_info(w->s, w->tid, pattern, SMB_FIND_INFO_DIRECTORY);
+    free(pattern);
+
+    if (list == NULL)
+    {
+        BDSM_dbg("smb_walk: Unable to list %s\n", dir->path);
+        walk_fail(ctx, DSM_ERROR_NT);
+        return;
+    }
+
+    for (st = list; st != NULL; st = smb_stat_list_next(st))
+    {
+        const char *name = smb_stat_name(st);
+
+        if (name == NULL || !strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+
+        len = strlen(dir->path) + strlen(name) + 2;
+        if ((path = malloc(len)) == NULL)
+        {
+            walk_fail(ctx, DSM_ERROR_GENERIC);
+            break;
+        }
+        snprintf(path, len, "%s\\%s", dir->path, name);
+
+        res = SMB_WALK_CONTINUE;
+        if (ctx->pattern == NULL || walk_match(ctx->pattern, name))
+        {
+            pthread_mutex_lock(&ctx->cb_lock);
+            res = ctx->stop ? SMB_WALK_STOP
+                            : ctx->cb(ctx->opaque, path, st, dir->depth);
+            if (res == SMB_WALK_STOP)
+                walk_stop(ctx);
+            pthread_mutex_unlock(&ctx->cb_lock);
+        }
+
+        if (res == SMB_WALK_STOP)
+        {
+            free(path);
+            break;
+        }
+        // Reparse points (junctions, symlinks) are reported but not followed:
+        // they may loop back to one of their parents
+        if (res != SMB_WALK_SKIP && smb_stat_get(st, SMB_STAT_ISDIR)
+            && !(st->attr & SMB_ATTR_REPARSE_POINT)
+            && (ctx->max_depth < 0 || dir->depth < ctx->max_depth))
+        {
+            if (walk_queue(w, path, dir->depth + 1))
+                continue;
+            walk_fail(ctx, DSM_ERROR_GENERIC);
+        }
+        free(path);
+    }
+    smb_stat_list_destroy(list);
+}
+
+static void *walk_worker_run(void *opaque)
+{
+    walk_worker *w = opaque;
+    walk_dir    dir;
+
+    while (walk_next(w, &dir))
+    {
+        walk_list(w, &dir);
+        free(dir.path);
+        walk_done(w->ctx);
+    }
+
+    return NULL;
+}
+
+int             smb_walk(smb_session **sessions, const smb_tid *tids,
+                         size_t count, const char *root, int max_depth,
+                         const char *pattern, smb_walk_cb cb, void *opaque)
+{
+    walk_ctx    ctx;
+    walk_dir    dir;
+    size_t      started = 0, len;
+    int         res = DSM_SUCCESS;
+
+    assert(sessions != NULL && tids != NULL && root != NULL && cb != NULL);
+
+    if (count == 0)
+        return DSM_ERROR_GENERIC;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.count     = count;
+    ctx.max_depth = max_depth;
+    ctx.pattern   = pattern;
+    ctx.cb        = cb;
+    ctx.opaque    = opaque;
+    if ((ctx.workers = calloc(count, sizeof(walk_worker))) == NULL)
+        return DSM_ERROR_GENERIC;
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_cond_init(&ctx.cond, NULL);
+    pthread_mutex_init(&ctx.cb_lock, NULL);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        ctx.workers[i].ctx   = &ctx;
+        ctx.workers[i].index = i;
+        ctx.workers[i].s     = sessions[i];
+        ctx.workers[i].tid   = tids[i];
+        pthread_mutex_init(&ctx.workers[i].queue.lock, NULL);
+    }
+
+    // The trailing separator is added back when listing
+    len = strlen(root);
+    while (len > 0 && (root[len - 1] == '\\' || root[len - 1] == '/'))
+        len--;
+    if ((dir.path = strndup(root, len)) == NULL
+        || !walk_queue(&ctx.workers[0], dir.path, 0))
+    {
+        free(dir.path);
+        res = DSM_ERROR_GENERIC;
+        goto cleanup;
+    }
+
+    for (; started < count; started++)
+        if (pthread_create(&ctx.workers[started].thread, NULL,
+                           walk_worker_run, &ctx.workers[started]))
+            break;
+
+    if (started == 0)
+    {
+        res = DSM_ERROR_GENERIC;
+        while (walk_deque_take(&ctx.workers[0].queue, &dir, false))
+            free(dir.path);
+    }
+    for (size_t i = 0; i < started; i++)
+        pthread_join(ctx.workers[i].thread, NULL);
+    if (res == DSM_SUCCESS)
+        res = ctx.err;
+
+    // Leftovers of a stopped walk
+    for (size_t i = 0; i < count; i++)
+        while (walk_deque_take(&ctx.workers[i].queue, &dir, false))
+            free(dir.path);
+
+cleanup:
+    for (size_t i = 0; i < count; i++)
+    {
+        pthread_mutex_destroy(&ctx.workers[i].queue.lock);
+        free(ctx.workers[i].queue.items);
+    }
+    pthread_mutex_destroy(&ctx.cb_lock);
+    pthread_cond_destroy(&ctx.cond);
+    pthread_mutex_destroy(&ctx.lock);
+    free(ctx.workers);
+
+    return res;
+}
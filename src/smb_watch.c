@@ -0,0 +1,294 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "bdsm_debug.h"
+#include "smb_session_msg.h"
+#include "smb_fd.h"
+#include "smb_file.h"
+#include "smb_utils.h"
+#include "smb_stat_cache.h"
+#include "bdsm/smb_watch.h"
+
+// Size of the server side buffer for change records. When it overflows, the
+// server reports NT_STATUS_NOTIFY_ENUM_DIR instead
+#define SMB_WATCH_BUFSIZE   16384
+
+struct smb_watch
+{
+    smb_fd              fd;
+    smb_tid             tid;
+    uint32_t            filter;
+    bool                subtree;
+    bool                pending;        // A NotifyChange request is outstanding
+    char                *path;
+};
+
+static int          smb_watch_post(smb_session *s, smb_watch *watch)
+{
+    smb_message         *msg;
+    smb_nt_trans_req    req;
+    smb_nt_notify_req   notify;
+    int                 res;
+
+    msg = smb_message_new(s, SMB_CMD_NT_TRANSACT);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+    msg->packet->header.tid = watch->tid;
+
+    SMB_MSG_INIT_PKT(req);
+    req.wct               = 19 + 4;
+    req.max_param_count   = SMB_WATCH_BUFSIZE;
+    req.param_offset      = sizeof(smb_header) + sizeof(req) + sizeof(notify);
+    req.data_offset       = req.param_offset;
+    req.setup_count       = 4;
+    req.function          = SMB_NT_TRANS_NOTIFY_CHANGE;
+    SMB_MSG_PUT_PKT(msg, req);
+
+    SMB_MSG_INIT_PKT(notify);
+    notify.filter         = watch->filter;
+    notify.fid            = smb_session_srv_fid(s, watch->fd);
+    notify.watch_tree     = watch->subtree;
+    SMB_MSG_PUT_PKT(msg, notify);
+
+    res = smb_session_send_msg(s, msg);
+    smb_message_destroy(msg);
+
+    return res ? DSM_SUCCESS : DSM_ERROR_NETWORK;
+}
+
+// Copies the parameters block of a (possibly fragmented) NT_TRANSACT response,
+// msg being its first fragment
+static ssize_t      smb_watch_recv_params(smb_session *s, smb_message *msg,
+                                          uint8_t **params)
+{
+    smb_nt_trans_resp   *resp;
+    size_t              total, received = 0;
+    size_t              offset, count, displacement;
+
+    *params = NULL;
+    total   = 0;
+    do
+    {
+        if (msg->payload_size < sizeof(smb_nt_trans_resp))
+            goto error;
+        resp         = (smb_nt_trans_resp *)msg->packet->payload;
+        offset       = resp->param_offset;
+        count        = resp->param_count;
+        displacement = resp->param_displacement;
+
+        if (*params == NULL)
+        {
+            total = resp->total_param_count;
+            if (total == 0)
+                return 0;
+            if ((*params = malloc(total)) == NULL)
+                return -1;
+        }
+
+        // param_offset is relative to the start of the SMB header
+        if (offset < sizeof(smb_header)
+            || offset + count > sizeof(smb_header) + msg->payload_size
+            || displacement + count > total)
+            goto error;
+
+        memcpy(*params + displacement, (uint8_t *)msg->packet + offset, count);
+        received += count;
+    } while (received < total && smb_session_recv_msg(s, msg));
+
+    if (received < total)
+        goto error;
+
+    return total;
+
+error:
+    BDSM_dbg("smb_watch: Malformed NT_TRANSACT response\n");
+    free(*params);
+    *params = NULL;
+    return -1;
+}
+
+static void         smb_watch_invalidate(smb_session *s, smb_watch *watch,
+                                         const char *name)
+{
+    char    *path;
+    size_t  len;
+
+    len = strlen(watch->path) + strlen(name) + 2;
+    if ((path = malloc(len)) == NULL)
+        return;
+    snprintf(path, len, "%s\\%s", watch->path, name);
+    smb_stat_cache_invalidate(s, watch->tid, path, true);
+    free(path);
+}
+
+int             smb_watch_open(smb_session *s, smb_tid tid, const char *path,
+                               uint32_t filter, int subtree,
+                               smb_watch **watch)
+{
+    smb_watch       *w;
+    smb_fopen_opts  opts;
+    int             res;
+
+    assert(s != NULL && path != NULL && watch != NULL);
+
+    if ((w = calloc(1, sizeof(*w))) == NULL)
+        return DSM_ERROR_GENERIC;
+    if ((w->path = strdup(path)) == NULL)
+    {
+        free(w);
+        return DSM_ERROR_GENERIC;
+    }
+
+    memset(&opts, 0, sizeof(opts));
+    opts.create_opts = SMB_CREATEOPT_DIRECTORY_FILE;
+    res = smb_file_open(s, tid, path, SMB_MOD_RO, SMB_DISPOSITION_FILE_OPEN,
+                        &opts, &w->fd);
+    if (res != DSM_SUCCESS)
+    {
+        free(w->path);
+        free(w);
+        return res;
+    }
+
+    w->tid     = tid;
+    w->filter  = filter;
+    w->subtree = subtree != 0;
+    *watch     = w;
+
+    return DSM_SUCCESS;
+}
+
+int             smb_watch_wait(smb_session *s, smb_watch *watch, int timeout,
+                               smb_watch_cb cb, void *opaque)
+{
+    smb_message         msg;
+    smb_nt_notify_info  *info;
+    uint8_t             *params;
+    ssize_t             size;
+    size_t              pos, next;
+    char                *name;
+    int                 res, count = 0;
+
+    assert(s != NULL && watch != NULL && cb != NULL);
+
+    if (!watch->pending)
+    {
+        if ((res = smb_watch_post(s, watch)) != DSM_SUCCESS)
+            return res;
+        watch->pending = true;
+    }
+
+    // Oplock breaks of files opened on the session may arrive first
+    res = smb_session_wait_msg(s, &msg, timeout);
+    if (res == 0)
+        return 0;
+    watch->pending = false;
+    if (res < 0)
+        return DSM_ERROR_NETWORK;
+
+    // The server has dropped the changes, there is nothing to parse
+    if (msg.packet->header.status == NT_STATUS_NOTIFY_ENUM_DIR)
+        size = 0;
+    else if (!smb_session_check_nt_status(s, &msg))
+        return DSM_ERROR_NT;
+    else if ((size = smb_watch_recv_params(s, &msg, &params)) < 0)
+        return DSM_ERROR_NETWORK;
+
+    if (size == 0)
+    {
+        smb_stat_cache_invalidate(s, watch->tid, watch->path, true);
+        cb(opaque, SMB_NOTIFY_ACTION_OVERFLOW, NULL);
+        return 1;
+    }
+
+    for (pos = 0; pos + sizeof(smb_nt_notify_info) <= (size_t)size; pos += next)
+    {
+        info = (smb_nt_notify_info *)(params + pos);
+        next = info->next_entry;
+        if (info->name_len > (size_t)size - pos - sizeof(smb_nt_notify_info))
+            break;
+
+        if (smb_from_utf16((const char *)info->name, info->name_len, &name) > 0)
+        {
+            smb_watch_invalidate(s, watch, name);
+            cb(opaque, info->action, name);
+            free(name);
+            count++;
+        }
+
+        if (next == 0)
+            break;
+    }
+    free(params);
+
+    return count;
+}
+
+void            smb_watch_close(smb_session *s, smb_watch *watch)
+{
+    smb_message         *msg;
+    smb_nt_cancel_req   req;
+
+    assert(s != NULL);
+
+    if (watch == NULL)
+        return;
+
+    if (watch->pending)
+    {
+        // The server answers the cancelled request, not the cancel itself
+        msg = smb_message_new(s, SMB_CMD_CANCEL);
+        if (msg)
+        {
+            msg->packet->header.tid = watch->tid;
+            SMB_MSG_INIT_PKT(req);
+            SMB_MSG_PUT_PKT(msg, req);
+            bool sent = smb_session_send_msg(s, msg);
+
+            smb_message_destroy(msg);
+            if (sent)
+                smb_session_recv_msg(s, NULL);
+        }
+    }
+
+    smb_fclose(s, watch->fd);
+    free(watch->path);
+    free(watch);
+}